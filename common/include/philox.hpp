@@ -0,0 +1,103 @@
+#ifndef _COMMON_PHILOX_HEADER_FILE
+#define _COMMON_PHILOX_HEADER_FILE
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+/*
+ * Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as
+ * 1, 2, 3"). A counter-based generator: the output is a pure function
+ * of (seed, counter), so particle i always gets the same numbers no
+ * matter which thread generates it, or how many threads there are.
+ */
+class Philox {
+	private:
+		std::array<std::uint32_t, 2> key;
+
+		static void mulhilo(std::uint32_t a, std::uint32_t b, std::uint32_t &hi, std::uint32_t &lo)
+		{
+			const std::uint64_t product = static_cast<std::uint64_t>(a) * b;
+			hi = static_cast<std::uint32_t>(product >> 32);
+			lo = static_cast<std::uint32_t>(product);
+		}
+
+	public:
+		using Block = std::array<std::uint32_t, 4>;
+
+		explicit Philox(std::uint64_t seed):
+			key { static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32) } {}
+
+		Block operator()(Block counter) const
+		{
+			std::array<std::uint32_t, 2> k = key;
+			for (int round = 0; round < 10; round++) {
+				std::uint32_t hi0, lo0, hi1, lo1;
+				mulhilo(0xD2511F53u, counter[0], hi0, lo0);
+				mulhilo(0xCD9E8D57u, counter[2], hi1, lo1);
+				counter = { hi1 ^ counter[1] ^ k[0], lo1, hi0 ^ counter[3] ^ k[1], lo0 };
+				k[0] += 0x9E3779B9u;
+				k[1] += 0xBB67AE85u;
+			}
+			return counter;
+		}
+
+		/*
+		 * The numbers belonging to one item (e.g. one particle), drawn in
+		 * order. Each item has its own 2^32 blocks of 4 values.
+		 */
+		class Stream {
+			private:
+				const Philox &rng;
+				std::uint64_t item;
+				std::uint32_t block = 0;
+				Block buffer {};
+				int used = 4;
+
+			public:
+				Stream(const Philox &rng, std::uint64_t item):
+					rng(rng), item(item) {}
+
+				std::uint32_t next()
+				{
+					if (used == 4) {
+						buffer = rng(Block {
+							static_cast<std::uint32_t>(item),
+							static_cast<std::uint32_t>(item >> 32),
+							block++,
+							0
+						});
+						used = 0;
+					}
+					return buffer[used++];
+				}
+
+				/* Uniform in [0, 1), with 53 random bits */
+				double uniform()
+				{
+					const std::uint64_t hi = next() >> 5;
+					const std::uint64_t lo = next() >> 6;
+					return static_cast<double>((hi << 26) | lo) * 0x1p-53;
+				}
+
+				double uniform(double low, double high)
+				{
+					return low + (high - low) * uniform();
+				}
+
+				/* Standard normal, by Box-Muller */
+				double normal()
+				{
+					const double u1 = 1.0 - uniform();
+					const double u2 = uniform();
+					return std::sqrt(-2.0 * std::log(u1)) * std::cos(6.283185307179586 * u2);
+				}
+		};
+
+		Stream stream(std::uint64_t item) const
+		{
+			return Stream(*this, item);
+		}
+};
+
+#endif // _COMMON_PHILOX_HEADER_FILE
@@ -19,6 +19,9 @@
 #include <array>
 #include <chrono>
 #include <random>
+#include <thread>
+
+#include <philox.hpp>
 
 #define MASS_LOW (1e2)
 #define MASS_HIGH (1e9)
@@ -29,8 +32,28 @@
 
 #define NPARTICLES (1e3)
 
+/*
+ * Particles fill the box uniformly, or with INITIAL_PLUMMER, form a
+ * Plummer sphere of scale radius PLUMMER_RADIUS in the middle of it,
+ * with velocities drawn from its equilibrium distribution. Generation
+ * is spread over all cores with a counter-based RNG, so a nonzero
+ * PARTICLE_SEED gives exactly the same particles on every run.
+ */
+#define INITIAL_PLUMMER (false)
+#define PLUMMER_RADIUS (0.2)
+#define PARTICLE_SEED (0)
+
 #define PRINT_FPS (true)
 
+/*
+ * Compute dispatches per second. 0 dispatches once per rendered frame.
+ * Otherwise the due dispatches (at most MAX_SUBSTEPS) are batched into
+ * one command buffer per frame, so a slow frame doesn't slow down the
+ * simulation and a fast one doesn't speed it up.
+ */
+#define SIMULATION_RATE (0)
+#define MAX_SUBSTEPS (8)
+
 /*
  * In degrees
  */
@@ -121,6 +144,7 @@ class GPUNewtonApp {
 		using TimePoint = std::chrono::steady_clock::time_point;
 		using Duration = std::chrono::duration<double, std::milli>;
 		Duration delta;
+		Duration simBacklog = Duration(0);
 		bool running = false;
 
 		void loadDevice();
@@ -1,31 +1,85 @@
 #include <main.hpp>
 
+/*
+ * Aarseth, Henon & Wielen (1974): the radius inverts the cumulative
+ * mass, the speed is drawn by rejection from the distribution function.
+ */
+static glm::vec3 isotropic(Philox::Stream &rng, double length)
+{
+	const double z = rng.uniform(-1.0, 1.0);
+	const double angle = 6.283185307179586 * rng.uniform();
+	const double planar = std::sqrt(1.0 - z * z) * length;
+	return glm::vec3(planar * std::cos(angle), planar * std::sin(angle), z * length);
+}
+
+static void plummer(Philox::Stream &rng, double totalMass, glm::vec3 &pos, glm::vec3 &veloc)
+{
+	const double gConstant = 6.6743e-11;
+	const double a = PLUMMER_RADIUS;
+
+	const double u = 1.0 - rng.uniform();
+	const double r = a / std::sqrt(std::pow(u, -2.0 / 3.0) - 1.0);
+	pos = isotropic(rng, r);
+
+	double q, g;
+	do {
+		q = rng.uniform();
+		g = q * q * std::pow(1.0 - q * q, 3.5);
+	} while (0.1 * rng.uniform() >= g);
+
+	const double escape = std::sqrt(2.0 * gConstant * totalMass / a) * std::pow(1.0 + r * r / (a * a), -0.25);
+	veloc = isotropic(rng, q * escape);
+}
+
 void ParticleSet::init(SDL_GPUDevice *gpuDevice)
 {
 	std::size_t numParticles = NPARTICLES;
 
 	this->gpuDevice = gpuDevice;
-	std::random_device device;
-	std::mt19937 rng(device());
-
-	std::uniform_real_distribution<float> xdisr(0.0f, PARTICLE_BOX_X);
-	std::uniform_real_distribution<float> ydisr(0.0f, PARTICLE_BOX_Y);
-	std::uniform_real_distribution<float> zdisr(0.0f, PARTICLE_BOX_Z);
-	std::uniform_real_distribution<float> mdisr(MASS_LOW, MASS_HIGH);
-
-	particles.reserve(numParticles);
-	for (std::size_t i = 0; i < numParticles; i++) {
-		Particle particle = {
-			.x = xdisr(rng),
-			.y = ydisr(rng),
-			.z = zdisr(rng),
-			.mass = 1000,
-			.vx = 0,
-			.vy = 0,
-			.vz = 0
-		};
-
-		particles.push_back(particle);
+
+	std::uint64_t seed = PARTICLE_SEED;
+	if (!seed) {
+		std::random_device device;
+		seed = (static_cast<std::uint64_t>(device()) << 32) | device();
+	}
+	const Philox philox(seed);
+	const float mass = 1000;
+
+	particles.resize(numParticles);
+	auto generate = [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			Philox::Stream rng = philox.stream(i);
+
+			glm::vec3 pos, veloc(0.0f);
+			if (INITIAL_PLUMMER) {
+				plummer(rng, mass * numParticles, pos, veloc);
+				pos += glm::vec3(PARTICLE_BOX_X, PARTICLE_BOX_Y, PARTICLE_BOX_Z) * 0.5f;
+			} else {
+				pos.x = rng.uniform(0.0, PARTICLE_BOX_X);
+				pos.y = rng.uniform(0.0, PARTICLE_BOX_Y);
+				pos.z = rng.uniform(0.0, PARTICLE_BOX_Z);
+			}
+
+			particles[i] = Particle {
+				.x = pos.x,
+				.y = pos.y,
+				.z = pos.z,
+				.mass = mass,
+				.padding = 0,
+				.vx = veloc.x,
+				.vy = veloc.y,
+				.vz = veloc.z
+			};
+		}
+	};
+
+	const std::size_t nThreads = std::max(1u, std::thread::hardware_concurrency());
+	const std::size_t chunk = (numParticles + nThreads - 1) / nThreads;
+	{
+		std::vector<std::jthread> workers;
+		for (std::size_t start = chunk; start < numParticles; start += chunk)
+			workers.emplace_back(generate, start, std::min(start + chunk, numParticles));
+		generate(0, std::min(chunk, numParticles));
 	}
 
 	const std::size_t bsize = numParticles * sizeof(ParticleSet::Particle);
@@ -424,18 +478,35 @@ void GPUNewtonApp::loop()
 		{
 			updateCameraPos(keyboard);
 
+			int substeps = 1;
+#if SIMULATION_RATE > 0
+			const Duration period = Duration(1000.0 / SIMULATION_RATE);
+			simBacklog += delta;
+			substeps = static_cast<int>(simBacklog / period);
+			if (substeps > MAX_SUBSTEPS) {
+				substeps = MAX_SUBSTEPS;
+				simBacklog = Duration(0);
+			} else {
+				simBacklog -= period * substeps;
+			}
+#endif
+
 			SDL_GPUStorageBufferReadWriteBinding bufferBinding{};
 			bufferBinding.buffer = particleSet.getBuffer();
 			bufferBinding.cycle = false;
-			SDL_GPUComputePass *computePass = SDL_BeginGPUComputePass(cmdBuffer, nullptr, 0, &bufferBinding, 1);
-			if (!computePass) {
-				log(SDL_LOG_PRIORITY_ERROR, "failed to acquire compute pass: %s", SDL_GetError());
-				continue;
+
+			/* One pass per step, so each step sees the previous one's writes */
+			for (int s = 0; s < substeps; s++) {
+				SDL_GPUComputePass *computePass = SDL_BeginGPUComputePass(cmdBuffer, nullptr, 0, &bufferBinding, 1);
+				if (!computePass) {
+					log(SDL_LOG_PRIORITY_ERROR, "failed to acquire compute pass: %s", SDL_GetError());
+					break;
+				}
+				SDL_BindGPUComputePipeline(computePass, compPipeline);
+				SDL_BindGPUComputeStorageBuffers(computePass, 0, &particleSetBuffer, 1);
+				SDL_DispatchGPUCompute(computePass, 1, 1, NPARTICLES);
+				SDL_EndGPUComputePass(computePass);
 			}
-			SDL_BindGPUComputePipeline(computePass, compPipeline);
-			SDL_BindGPUComputeStorageBuffers(computePass, 0, &particleSetBuffer, 1);
-			SDL_DispatchGPUCompute(computePass, 1, 1, NPARTICLES);
-			SDL_EndGPUComputePass(computePass);
 		}
 		/* End of simulation code */
 
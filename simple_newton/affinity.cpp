@@ -0,0 +1,187 @@
+#include <main.hpp>
+#include <affinity.hpp>
+#include <cpu_quota.hpp>
+
+#include <fstream>
+#include <tuple>
+
+static ThreadPlacement placement;
+
+namespace {
+
+struct CpuInfo {
+	std::size_t cpu;
+	std::size_t node;
+	long package;
+	long core;
+
+	auto key() const { return std::tie(node, package, core, cpu); }
+	bool sameCore(const CpuInfo &other) const
+	{
+		return node == other.node && package == other.package && core == other.core;
+	}
+};
+
+}
+
+/* A value from the CPU's sysfs topology directory, or -1 if there is none */
+static long readTopology(std::size_t cpu, const char *name)
+{
+	std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + name);
+	long value = -1;
+	file >> value;
+	return file ? value : -1;
+}
+
+ThreadPlacement planThreads(const std::vector<std::size_t> &allowed, bool physicalCoresOnly, bool reserveRenderCore)
+{
+	const NumaTopology &topology = numaTopology();
+	std::vector<CpuInfo> infos;
+	for (std::size_t cpu : allowed) {
+		long core = readTopology(cpu, "core_id");
+		/* Without topology, every CPU counts as a core of its own */
+		if (core < 0)
+			core = -1 - static_cast<long>(cpu);
+		infos.push_back(CpuInfo { cpu, topology.nodeOfCpu(cpu), readTopology(cpu, "physical_package_id"), core });
+	}
+	std::sort(infos.begin(), infos.end(), [](const CpuInfo &a, const CpuInfo &b) { return a.key() < b.key(); });
+
+	/* Siblings are next to each other now */
+	std::vector<std::vector<std::size_t>> cores;
+	for (std::size_t k = 0; k < infos.size(); k++) {
+		if (!k || !infos[k].sameCore(infos[k - 1]))
+			cores.emplace_back();
+		cores.back().push_back(infos[k].cpu);
+	}
+
+	ThreadPlacement result;
+	if (reserveRenderCore && cores.size() > 1) {
+		result.renderCpus = cores.back();
+		cores.pop_back();
+	}
+
+	/* First siblings of every core, then the second ones, ... */
+	for (std::size_t level = 0; ; level++) {
+		bool any = false;
+		for (const std::vector<std::size_t> &siblings : cores) {
+			if (level < siblings.size()) {
+				result.cpus.push_back(siblings[level]);
+				any = true;
+			}
+		}
+		if (!any || physicalCoresOnly)
+			break;
+	}
+	return result;
+}
+
+bool pinThread(const std::vector<std::size_t> &cpus)
+{
+#ifdef BS_THREAD_POOL_NATIVE_EXTENSIONS
+	if (cpus.empty())
+		return false;
+	std::vector<bool> affinity(*std::max_element(cpus.begin(), cpus.end()) + 1, false);
+	for (std::size_t cpu : cpus)
+		affinity[cpu] = true;
+	return BS::this_thread::set_os_thread_affinity(affinity);
+#else
+	(void) cpus;
+	return false;
+#endif
+}
+
+void configureThreads(std::size_t share, std::size_t shares)
+{
+	const CpuBudget budget = detectCpuBudget();
+	std::ostringstream log;
+	log << "Simulating on ";
+
+#if PIN_THREADS
+	placement = planThreads(budget.cpus, PHYSICAL_CORES_ONLY, RESERVE_RENDER_CORE);
+
+	/* Under a quota, the render thread's core comes out of it too */
+	std::size_t threads = budget.threads;
+	if (budget.quota > 0 && !placement.renderCpus.empty())
+		threads = std::max<std::size_t>(threads - 1, 1);
+	if (placement.cpus.size() > threads)
+		placement.cpus.resize(threads);
+
+	/* Processes sharing the machine take a slice each, at least one CPU */
+	if (shares > 1) {
+		std::vector<std::size_t> &all = placement.cpus;
+		const std::size_t start = share * all.size() / shares;
+		const std::size_t end = (share + 1) * all.size() / shares;
+		if (start < end)
+			all = std::vector<std::size_t>(all.begin() + start, all.begin() + end);
+		else if (!all.empty())
+			all = { all[share % all.size()] };
+		if (share > 0)
+			placement.renderCpus.clear();
+	}
+
+	const std::vector<std::size_t> &cpus = placement.cpus;
+	const std::size_t n = cpus.size();
+
+	/*
+	 * Only the threads stepping the particles are pinned, one to a CPU,
+	 * rather than every pool on top of each other: the team where it
+	 * owns the NUMA nodes' shares (see numa.cpp), the stealing pool
+	 * otherwise. The calling thread is index 0 of both.
+	 */
+	const bool teamSteps = NUMA_PLACEMENT && numaTopology().nodes() > 1;
+	threadPool.reset(n);
+	if (teamSteps) {
+		stealPool.reset(n);
+		stepTeam.reset(n, [&cpus](std::size_t member) { pinThread({ cpus[member] }); });
+	} else {
+		stealPool.reset(n, [&cpus](std::size_t worker) { pinThread({ cpus[worker + 1] }); });
+		stepTeam.reset(n);
+	}
+
+	pinRenderThread();
+
+	log << n << " pinned " << (PHYSICAL_CORES_ONLY ? "cores" : "CPUs");
+	if (!placement.renderCpus.empty()) {
+		log << ", CPU";
+		for (std::size_t cpu : placement.renderCpus)
+			log << " " << cpu;
+		log << " kept for rendering";
+	}
+#else
+	const std::size_t n = std::max<std::size_t>(1, budget.threads / shares);
+	threadPool.reset(n);
+	stealPool.reset(n);
+	stepTeam.reset(n);
+
+	log << n << " threads";
+#endif
+
+	if (shares > 1)
+		log << " as " << share + 1 << " of " << shares << " processes";
+	log << " (" << budget.cpus.size() << " CPUs allowed";
+	if (!budget.cpuset.empty())
+		log << " by the cpuset";
+	if (budget.quota > 0)
+		log << ", CFS quota of " << budget.quota << " CPUs";
+	if (budget.cgroupVersion)
+		log << ", cgroup v" << budget.cgroupVersion;
+	log << ")";
+	std::cout << log.str() << std::endl;
+}
+
+void pinSimulationThread()
+{
+	if (!placement.cpus.empty())
+		pinThread({ placement.cpus.front() });
+}
+
+void pinRenderThread()
+{
+	if (!placement.renderCpus.empty())
+		pinThread(placement.renderCpus);
+}
+
+const ThreadPlacement &threadPlacement()
+{
+	return placement;
+}
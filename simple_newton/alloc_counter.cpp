@@ -0,0 +1,93 @@
+#include <main.hpp>
+#include <alloc_counter.hpp>
+
+#if COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+struct alignas(64) Counter {
+	std::atomic<std::uint64_t> count = 0;
+};
+
+}
+
+/* Threads share counters round robin once there are more of them */
+static constexpr std::size_t nCounters = 64;
+static Counter counters[nCounters];
+static std::atomic<std::size_t> nextCounter = 0;
+
+void countAllocation()
+{
+	thread_local Counter &counter = counters[nextCounter.fetch_add(1, std::memory_order_relaxed) % nCounters];
+	counter.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void *allocate(std::size_t size, std::size_t align)
+{
+	countAllocation();
+
+	if (!size)
+		size = 1;
+	for (;;) {
+		void *block = align <= alignof(std::max_align_t) ?
+			std::malloc(size) : std::aligned_alloc(align, (size + align - 1) / align * align);
+		if (block)
+			return block;
+
+		const std::new_handler handler = std::get_new_handler();
+		if (!handler)
+			throw std::bad_alloc();
+		handler();
+	}
+}
+
+/* The array and nothrow forms end up in these */
+void *operator new(std::size_t size)
+{
+	return allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new(std::size_t size, std::align_val_t align)
+{
+	return allocate(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *block) noexcept
+{
+	std::free(block);
+}
+
+void operator delete(void *block, std::size_t) noexcept
+{
+	std::free(block);
+}
+
+void operator delete(void *block, std::align_val_t) noexcept
+{
+	std::free(block);
+}
+
+void operator delete(void *block, std::size_t, std::align_val_t) noexcept
+{
+	std::free(block);
+}
+
+std::uint64_t allocationCount()
+{
+	std::uint64_t total = 0;
+	for (const Counter &counter : counters)
+		total += counter.count.load(std::memory_order_relaxed);
+	return total;
+}
+#else
+void countAllocation()
+{
+}
+
+std::uint64_t allocationCount()
+{
+	return 0;
+}
+#endif
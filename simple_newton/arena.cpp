@@ -0,0 +1,90 @@
+#include <main.hpp>
+#include <arena.hpp>
+
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Set once mapping hugetlbfs pages failed, most likely because none are reserved */
+static std::atomic<bool> noHugetlb = false;
+
+static std::size_t alignUp(std::size_t n, std::size_t align)
+{
+	return (n + align - 1) / align * align;
+}
+
+static bool mapped(std::size_t bytes)
+{
+	return HUGE_PAGES && bytes >= hugePageSize;
+}
+
+/* An anonymous mapping, or nullptr */
+static void *mapPages(std::size_t bytes, int flags)
+{
+	void *block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	return block == MAP_FAILED ? nullptr : block;
+}
+
+void *arenaAllocate(std::size_t bytes)
+{
+	if (!mapped(bytes))
+		return ::operator new(bytes, std::align_val_t(cacheLineSize));
+
+	const std::size_t size = alignUp(bytes, hugePageSize);
+	countAllocation();
+
+#ifdef MAP_HUGETLB
+	/* Reserved pages are all-or-nothing, so this fails right here rather than at a fault */
+	if (!noHugetlb.load(std::memory_order_relaxed)) {
+#ifdef MAP_HUGE_SHIFT
+		const int hugeFlags = MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+#else
+		const int hugeFlags = MAP_HUGETLB;
+#endif
+		if (void *block = mapPages(size, hugeFlags))
+			return block;
+		noHugetlb.store(true, std::memory_order_relaxed);
+	}
+#endif
+
+	/* Map a huge page more than needed, and trim it down to an aligned block */
+	void *raw = mapPages(size + hugePageSize, 0);
+	if (!raw)
+		throw std::bad_alloc();
+
+	const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(raw);
+	const std::uintptr_t aligned = alignUp(start, hugePageSize);
+	const std::uintptr_t end = start + size + hugePageSize;
+	if (aligned > start)
+		munmap(raw, aligned - start);
+	if (end > aligned + size)
+		munmap(reinterpret_cast<void *>(aligned + size), end - aligned - size);
+
+	void *block = reinterpret_cast<void *>(aligned);
+#ifdef MADV_HUGEPAGE
+	madvise(block, size, MADV_HUGEPAGE);
+#endif
+	return block;
+}
+
+void arenaFree(void *block, std::size_t bytes)
+{
+	if (!block)
+		return;
+	if (!mapped(bytes))
+		::operator delete(block, std::align_val_t(cacheLineSize));
+	else
+		munmap(block, alignUp(bytes, hugePageSize));
+}
+
+std::size_t arenaPageSize(std::size_t bytes)
+{
+	if (mapped(bytes))
+		return hugePageSize;
+	static const std::size_t page = [] {
+		const long size = sysconf(_SC_PAGESIZE);
+		return size > 0 ? static_cast<std::size_t>(size) : std::size_t(4096);
+	}();
+	return page;
+}
@@ -0,0 +1,192 @@
+#include <main.hpp>
+#include <checkpoint.hpp>
+
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::size_t alignUp(std::size_t n, std::size_t align)
+{
+	return (n + align - 1) / align * align;
+}
+
+void ParticleSet::save(const std::string &fname) const
+{
+	if (domain)
+		throw std::runtime_error("checkpoints of distributed runs aren't supported");
+
+	const std::size_t n = infos.size();
+	const std::size_t columnBytes = alignUp(n * sizeof(double), CheckpointHeader::columnAlign);
+	const std::size_t idBytes = alignUp(n * sizeof(std::uint32_t), CheckpointHeader::columnAlign);
+	const bool withIds = ids.size() == n;
+
+	CheckpointHeader header{};
+	std::memcpy(header.magic, CheckpointHeader::magicValue, sizeof(header.magic));
+	header.version = CheckpointHeader::currentVersion;
+	header.headerSize = sizeof(CheckpointHeader);
+	header.count = n;
+	header.step = stepCount;
+	for (std::size_t c = 0; c < CheckpointHeader::NUM_COLUMNS; c++)
+		header.columnOffset[c] = CheckpointHeader::columnAlign + c * columnBytes;
+	header.idOffset = CheckpointHeader::columnAlign + CheckpointHeader::NUM_COLUMNS * columnBytes;
+
+	const std::size_t fileSize = header.idOffset + idBytes;
+	auto image = std::make_unique_for_overwrite<std::byte[]>(fileSize);
+	std::memset(image.get(), 0, CheckpointHeader::columnAlign);
+	std::memcpy(image.get(), &header, sizeof(header));
+
+	double *columns[CheckpointHeader::NUM_COLUMNS];
+	for (std::size_t c = 0; c < CheckpointHeader::NUM_COLUMNS; c++)
+		columns[c] = reinterpret_cast<double *>(image.get() + header.columnOffset[c]);
+	auto *idColumn = reinterpret_cast<std::uint32_t *>(image.get() + header.idOffset);
+
+	threadPool.detach_blocks(std::size_t(0), n, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			columns[CheckpointHeader::COLUMN_X][i]    = infos[i].pos.x;
+			columns[CheckpointHeader::COLUMN_Y][i]    = infos[i].pos.y;
+			columns[CheckpointHeader::COLUMN_VX][i]   = infos[i].veloc.x;
+			columns[CheckpointHeader::COLUMN_VY][i]   = infos[i].veloc.y;
+			columns[CheckpointHeader::COLUMN_MASS][i] = infos[i].mass;
+			idColumn[i] = withIds ? ids[i] : static_cast<std::uint32_t>(i);
+		}
+
+		/* Column padding, so we don't write uninitialized memory */
+		if (end == n) {
+			for (std::size_t c = 0; c < CheckpointHeader::NUM_COLUMNS; c++)
+				std::memset(columns[c] + n, 0, columnBytes - n * sizeof(double));
+			std::memset(idColumn + n, 0, idBytes - n * sizeof(std::uint32_t));
+		}
+	});
+	threadPool.wait();
+
+	/*
+	 * Write next to the old checkpoint and swap it in, so a crash never
+	 * leaves a torn file. The data has to reach the disk before the
+	 * rename does, and the rename before we return.
+	 */
+	const std::string tmpName = fname + ".tmp";
+	const int fd = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to create checkpoint " + tmpName + ": " + std::strerror(errno));
+
+	std::size_t written = 0;
+	while (written < fileSize) {
+		const ssize_t ret = write(fd, image.get() + written, fileSize - written);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			const int err = errno;
+			close(fd);
+			unlink(tmpName.c_str());
+			throw std::runtime_error("failed to write checkpoint " + tmpName + ": " + std::strerror(err));
+		}
+		written += static_cast<std::size_t>(ret);
+	}
+	if (fsync(fd) != 0) {
+		const int err = errno;
+		close(fd);
+		unlink(tmpName.c_str());
+		throw std::runtime_error("failed to write checkpoint " + tmpName + ": " + std::strerror(err));
+	}
+	close(fd);
+
+	if (rename(tmpName.c_str(), fname.c_str()) != 0)
+		throw std::runtime_error("failed to replace checkpoint " + fname + ": " + std::strerror(errno));
+
+	std::filesystem::path dir = std::filesystem::path(fname).parent_path();
+	if (dir.empty())
+		dir = ".";
+	const int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dirFd < 0 || fsync(dirFd) != 0) {
+		const int err = errno;
+		if (dirFd >= 0)
+			close(dirFd);
+		throw std::runtime_error("failed to sync the directory of checkpoint " + fname + ": " + std::strerror(err));
+	}
+	close(dirFd);
+}
+
+void ParticleSet::restore(const std::string &fname)
+{
+	if (domain)
+		throw std::runtime_error("checkpoints of distributed runs aren't supported");
+
+	const int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("failed to open checkpoint " + fname + ": " + std::strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(CheckpointHeader)) {
+		close(fd);
+		throw std::runtime_error("checkpoint " + fname + " is truncated");
+	}
+
+	const std::size_t fileSize = static_cast<std::size_t>(st.st_size);
+	void *map = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("failed to map checkpoint " + fname + ": " + std::strerror(errno));
+
+	const auto *base = static_cast<const std::byte *>(map);
+	const auto *header = reinterpret_cast<const CheckpointHeader *>(base);
+
+	const char *problem = nullptr;
+	if (std::memcmp(header->magic, CheckpointHeader::magicValue, sizeof(header->magic)) != 0)
+		problem = "is not a checkpoint";
+	else if (header->version < 1 || header->version > CheckpointHeader::currentVersion)
+		problem = "has an unsupported version";
+	else if (header->headerSize != (header->version == 1 ? checkpointHeaderSizeV1 : sizeof(CheckpointHeader)))
+		problem = "has a mismatched header";
+
+	for (std::size_t c = 0; !problem && c < CheckpointHeader::NUM_COLUMNS; c++) {
+		const std::uint64_t offset = header->columnOffset[c];
+		if (offset % alignof(double) != 0 ||
+		    offset > fileSize ||
+		    header->count > (fileSize - offset) / sizeof(double))
+			problem = "is truncated";
+	}
+
+	const bool withIds = !problem && header->version >= 2;
+	if (withIds) {
+		const std::uint64_t offset = header->idOffset;
+		if (offset % alignof(std::uint32_t) != 0 ||
+		    offset > fileSize ||
+		    header->count > (fileSize - offset) / sizeof(std::uint32_t))
+			problem = "is truncated";
+	}
+
+	if (problem) {
+		munmap(map, fileSize);
+		throw std::runtime_error("checkpoint " + fname + " " + problem);
+	}
+
+	const double *columns[CheckpointHeader::NUM_COLUMNS];
+	for (std::size_t c = 0; c < CheckpointHeader::NUM_COLUMNS; c++)
+		columns[c] = reinterpret_cast<const double *>(base + header->columnOffset[c]);
+
+	const auto *idColumn = withIds ? reinterpret_cast<const std::uint32_t *>(base + header->idOffset) : nullptr;
+
+	const std::size_t n = header->count;
+	infos.resize(n);
+	ids.resize(n);
+	threadPool.detach_blocks(std::size_t(0), n, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			infos[i].pos.x   = columns[CheckpointHeader::COLUMN_X][i];
+			infos[i].pos.y   = columns[CheckpointHeader::COLUMN_Y][i];
+			infos[i].veloc.x = columns[CheckpointHeader::COLUMN_VX][i];
+			infos[i].veloc.y = columns[CheckpointHeader::COLUMN_VY][i];
+			infos[i].mass    = columns[CheckpointHeader::COLUMN_MASS][i];
+			ids[i] = idColumn ? idColumn[i] : static_cast<std::uint32_t>(i);
+		}
+	});
+	threadPool.wait();
+
+	stepCount = header->step;
+	munmap(map, fileSize);
+}
@@ -0,0 +1,115 @@
+#include <main.hpp>
+
+/* Particles per range handed to the pool */
+static constexpr std::size_t collisionGrain = 1024;
+
+/*
+ * Runs after the positions of a step are final. The grid is built with
+ * cells as wide as the collision distance, so every pair in contact is
+ * in neighbouring cells.
+ */
+void ParticleSet::collide()
+{
+	const std::size_t n = infos.size();
+	const double reach = 2 * COLLISION_RADIUS;
+	grid.build(n, reach, [&](std::size_t i) { return infos[i].pos; });
+
+#if COLLISION_MERGE
+	/* Every particle points at the lowest index it touches, or itself */
+	mergeInto.resize(n);
+	stealPool.parallelFor(0, n, collisionGrain, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			std::size_t target = i;
+			grid.forEachNear(infos[i].pos, [&](std::size_t j) {
+				const glm::dvec2 dVector = infos[j].pos - infos[i].pos;
+				if (j < target && glm::dot(dVector, dVector) < reach * reach)
+					target = j;
+			});
+			mergeInto[i] = static_cast<std::uint32_t>(target);
+		}
+	});
+
+	/*
+	 * Targets only ever point to lower indices, so one ascending pass
+	 * resolves chains (i touches j, which touches k) to the particle at
+	 * their root, and merges everything into it in a fixed order.
+	 */
+	bool merged = false;
+	for (std::size_t i = 0; i < n; i++) {
+		const std::uint32_t root = mergeInto[mergeInto[i]];
+		mergeInto[i] = root;
+		if (root == i)
+			continue;
+
+		ParticleInfo &into = infos[root];
+		const ParticleInfo &from = infos[i];
+		const double mass = into.mass + from.mass;
+		into.pos = (into.pos * into.mass + from.pos * from.mass) / mass;
+		into.veloc = (into.veloc * into.mass + from.veloc * from.mass) / mass;
+		into.mass = mass;
+		merged = true;
+	}
+
+	if (merged) {
+		alive.resize(n);
+		stealPool.parallelFor(0, n, collisionGrain, [&](std::size_t start, std::size_t end) {
+			for (std::size_t i = start; i < end; i++)
+				alive[i] = mergeInto[i] == i;
+		});
+		compact();
+	}
+#else
+	auto approaching = [&](std::size_t i, std::size_t j, glm::dvec2 &dVector, double &dMagn, double &approach) {
+		dVector = infos[i].pos - infos[j].pos;
+		dMagn = glm::dot(dVector, dVector);
+		if (i == j || dMagn >= reach * reach || dMagn == 0)
+			return false;
+		approach = glm::dot(infos[i].veloc - infos[j].veloc, dVector);
+		return approach < 0;
+	};
+
+	contactCounts.resize(n);
+	stealPool.parallelFor(0, n, collisionGrain, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			std::uint32_t count = 0;
+			grid.forEachNear(infos[i].pos, [&](std::size_t j) {
+				glm::dvec2 dVector;
+				double dMagn, approach;
+				count += approaching(i, j, dVector, dMagn, approach);
+			});
+			contactCounts[i] = count;
+		}
+	});
+
+	/*
+	 * Every particle sums the impulses from all of its contacts, using
+	 * the velocities from before any of them, and only then are they
+	 * applied. A particle in several contacts at once would gain energy
+	 * from the plain sum, so each pair's impulse is shared out over the
+	 * busier of its two particles' contacts. Both particles of a pair
+	 * see the same scale, so momentum is still conserved exactly.
+	 */
+	collisionKicks.resize(n);
+	stealPool.parallelFor(0, n, collisionGrain, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			glm::dvec2 kick = glm::dvec2(0, 0);
+			grid.forEachNear(infos[i].pos, [&](std::size_t j) {
+				glm::dvec2 dVector;
+				double dMagn, approach;
+				if (!approaching(i, j, dVector, dMagn, approach))
+					return;
+
+				const double share = infos[j].mass / (infos[i].mass + infos[j].mass);
+				const double busiest = std::max(contactCounts[i], contactCounts[j]);
+				kick -= dVector * ((1 + COLLISION_RESTITUTION) * share * approach / (dMagn * busiest));
+			});
+			collisionKicks[i] = kick;
+		}
+	});
+
+	stealPool.parallelFor(0, n, collisionGrain, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++)
+			infos[i].veloc += collisionKicks[i];
+	});
+#endif
+}
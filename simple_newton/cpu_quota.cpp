@@ -0,0 +1,188 @@
+#include <main.hpp>
+#include <cpu_quota.hpp>
+
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+
+namespace {
+
+/* Where a cgroup hierarchy is mounted, and the process's cgroup in it */
+struct Hierarchy {
+	int version = 0;
+	std::string mountPoint;
+	std::string mountRoot;
+	std::string path;
+};
+
+}
+
+static std::string readLine(const std::string &fname)
+{
+	std::ifstream file(fname);
+	std::string line;
+	std::getline(file, line);
+	return line;
+}
+
+static bool hasItem(const std::string &list, const std::string &item)
+{
+	std::size_t pos = 0;
+	while (pos <= list.size()) {
+		std::size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+		if (list.compare(pos, end - pos, item) == 0)
+			return true;
+		pos = end + 1;
+	}
+	return false;
+}
+
+/*
+ * Finds the cgroup v1 hierarchy that has the controller, or else the v2
+ * one. The process's cgroup comes from /proc/self/cgroup, the mounts
+ * from /proc/self/mountinfo.
+ */
+static bool findHierarchy(const std::string &controller, Hierarchy &out)
+{
+	for (int version : { 1, 2 }) {
+		std::ifstream mounts("/proc/self/mountinfo");
+		std::string line;
+		while (std::getline(mounts, line)) {
+			/* id parent dev root mountpoint options [tags] - fstype source superoptions */
+			std::istringstream fields(line);
+			std::string id, parent, dev, root, mountPoint, field;
+			fields >> id >> parent >> dev >> root >> mountPoint;
+			while (fields >> field && field != "-") {}
+			std::string fsType, source, superOptions;
+			fields >> fsType >> source >> superOptions;
+
+			if (version == 1 && (fsType != "cgroup" || !hasItem(superOptions, controller)))
+				continue;
+			if (version == 2 && fsType != "cgroup2")
+				continue;
+
+			std::ifstream groups("/proc/self/cgroup");
+			std::string group;
+			while (std::getline(groups, group)) {
+				/* hierarchy-id:controllers:path */
+				const std::size_t first = group.find(':');
+				const std::size_t second = group.find(':', first + 1);
+				if (first == std::string::npos || second == std::string::npos)
+					continue;
+
+				const std::string controllers = group.substr(first + 1, second - first - 1);
+				if (version == 1 ? !hasItem(controllers, controller) : !controllers.empty())
+					continue;
+
+				out = Hierarchy { version, mountPoint, root, group.substr(second + 1) };
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * The process's cgroup directory, then every parent up to the mount.
+ * A container usually sees its own cgroup as the root of the mount.
+ */
+static std::vector<std::string> cgroupDirs(const Hierarchy &hierarchy)
+{
+	std::string relative = hierarchy.path;
+	if (hierarchy.mountRoot != "/" && relative.compare(0, hierarchy.mountRoot.size(), hierarchy.mountRoot) == 0)
+		relative = relative.substr(hierarchy.mountRoot.size());
+
+	const std::filesystem::path mountPoint = std::filesystem::path(hierarchy.mountPoint).lexically_normal();
+	std::filesystem::path dir = mountPoint;
+	if (!std::filesystem::path(relative).relative_path().empty())
+		dir /= std::filesystem::path(relative).relative_path();
+
+	std::error_code error;
+	if (!std::filesystem::is_directory(dir, error))
+		dir = mountPoint;
+
+	std::vector<std::string> dirs;
+	for (;;) {
+		dirs.push_back(dir.string());
+		if (dir == mountPoint || !dir.has_relative_path())
+			break;
+		dir = dir.parent_path();
+	}
+	return dirs;
+}
+
+/* The CFS quota of one cgroup in CPUs, 0 if unlimited */
+static double readQuota(const std::string &dir, int version)
+{
+	double quota = 0, period = 0;
+	if (version == 2) {
+		/* "max 100000" or "<quota> <period>" */
+		std::istringstream max(readLine(dir + "/cpu.max"));
+		std::string limit;
+		if (!(max >> limit >> period) || limit == "max")
+			return 0;
+		quota = std::atof(limit.c_str());
+	} else {
+		quota = std::atof(readLine(dir + "/cpu.cfs_quota_us").c_str());
+		period = std::atof(readLine(dir + "/cpu.cfs_period_us").c_str());
+	}
+	return quota > 0 && period > 0 ? quota / period : 0;
+}
+
+CpuBudget detectCpuBudget()
+{
+	CpuBudget budget;
+
+	Hierarchy hierarchy;
+	if (findHierarchy("cpu", hierarchy)) {
+		for (const std::string &dir : cgroupDirs(hierarchy)) {
+			const double quota = readQuota(dir, hierarchy.version);
+			if (quota > 0 && (budget.quota == 0 || quota < budget.quota)) {
+				budget.quota = quota;
+				budget.cgroupVersion = hierarchy.version;
+			}
+		}
+	}
+
+	/* The effective set already takes the parents into account */
+	if (findHierarchy("cpuset", hierarchy)) {
+		const std::string dir = cgroupDirs(hierarchy).front();
+		std::string list = readLine(dir + (hierarchy.version == 2 ? "/cpuset.cpus.effective" : "/cpuset.effective_cpus"));
+		if (list.empty() && hierarchy.version == 1)
+			list = readLine(dir + "/cpuset.cpus");
+		budget.cpuset = parseCpuList(list);
+		if (!budget.cpuset.empty() && !budget.cgroupVersion)
+			budget.cgroupVersion = hierarchy.version;
+	}
+
+	std::vector<std::size_t> &allowed = budget.cpus;
+#ifdef BS_THREAD_POOL_NATIVE_EXTENSIONS
+	if (const std::optional<std::vector<bool>> affinity = BS::get_os_process_affinity()) {
+		for (std::size_t cpu = 0; cpu < affinity->size(); cpu++) {
+			if ((*affinity)[cpu])
+				allowed.push_back(cpu);
+		}
+	}
+#endif
+	if (allowed.empty()) {
+		for (std::size_t cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++)
+			allowed.push_back(cpu);
+	}
+
+	/* The kernel keeps the affinity inside the cpuset anyway; trust it if they disagree */
+	std::vector<std::size_t> inCpuset;
+	for (std::size_t cpu : allowed) {
+		if (std::find(budget.cpuset.begin(), budget.cpuset.end(), static_cast<int>(cpu)) != budget.cpuset.end())
+			inCpuset.push_back(cpu);
+	}
+	if (!inCpuset.empty())
+		allowed.swap(inCpuset);
+
+	/* Round the quota down: a fraction of a thread still gets throttled */
+	budget.threads = std::max<std::size_t>(allowed.size(), 1);
+	if (budget.quota > 0)
+		budget.threads = std::clamp<std::size_t>(static_cast<std::size_t>(std::floor(budget.quota + 1e-9)), 1, budget.threads);
+	return budget;
+}
@@ -0,0 +1,134 @@
+#include <density_raster.hpp>
+
+#include <work_stealing.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+/* Rows per range handed to the pool */
+static constexpr std::size_t rowGrain = 8;
+/* Fewest particles worth a block, and a density image, of their own */
+static constexpr std::size_t splatGrain = 4096;
+
+void DensityRaster::resize(int width, int height, std::size_t nBins)
+{
+	this->width = width;
+	this->height = height;
+	this->nBins = nBins;
+
+	const std::size_t size = static_cast<std::size_t>(width) * height;
+	bins.resize(size * nBins);
+	density.resize(size);
+	rowMax.resize(height);
+	pixels.resize(size * 4);
+}
+
+void DensityRaster::splat(const RasterView &view, const float *x, const float *y,
+                          const float *prevX, const float *prevY, std::size_t n, float alpha)
+{
+	const std::size_t size = static_cast<std::size_t>(width) * height;
+	const std::size_t blockSize = (n + nBins - 1) / nBins;
+
+	const float scale = static_cast<float>(view.scale);
+	const float shiftX = static_cast<float>(view.scale * view.offsetX);
+	const float shiftY = static_cast<float>(view.scale * view.offsetY);
+	const float w = static_cast<float>(width);
+	const float h = static_cast<float>(height);
+
+	stealPool.parallelFor(0, nBins, 1, [&](std::size_t first, std::size_t last) {
+		for (std::size_t b = first; b < last; b++) {
+			std::uint32_t *bin = bins.data() + b * size;
+			std::fill(bin, bin + size, 0);
+
+			const std::size_t start = std::min(n, b * blockSize);
+			const std::size_t end = std::min(n, start + blockSize);
+			for (std::size_t i = start; i < end; i++) {
+				float px = x[i];
+				float py = y[i];
+				if (prevX) {
+					px = prevX[i] + (px - prevX[i]) * alpha;
+					py = prevY[i] + (py - prevY[i]) * alpha;
+				}
+				px = px * scale + shiftX;
+				py = py * scale + shiftY;
+
+				/* Also rejects NaN */
+				if (!(px >= 0.0f && px < w && py >= 0.0f && py < h))
+					continue;
+				bin[static_cast<std::size_t>(py) * width + static_cast<std::size_t>(px)]++;
+			}
+		}
+	});
+}
+
+void DensityRaster::merge()
+{
+	stealPool.parallelFor(0, height, rowGrain, [&](std::size_t start, std::size_t end) {
+		const std::size_t size = static_cast<std::size_t>(width) * height;
+		for (std::size_t row = start; row < end; row++) {
+			const std::size_t first = static_cast<std::size_t>(row) * width;
+			std::uint32_t *out = density.data() + first;
+			std::copy(bins.data() + first, bins.data() + first + width, out);
+			for (std::size_t b = 1; b < nBins; b++) {
+				const std::uint32_t *bin = bins.data() + b * size + first;
+				for (int col = 0; col < width; col++)
+					out[col] += bin[col];
+			}
+			rowMax[row] = *std::max_element(out, out + width);
+		}
+	});
+}
+
+void DensityRaster::toneMap(RasterColor color)
+{
+	const std::uint32_t peak = *std::max_element(rowMax.begin(), rowMax.end());
+	if (!peak) {
+		std::fill(pixels.begin(), pixels.end(), 0);
+		return;
+	}
+
+	/*
+	 * Brightness log(1 + d) / log(1 + peak), so a lone particle stays
+	 * visible next to a dense core. Low densities, which cover most
+	 * pixels, and all 256 resulting colours come from tables.
+	 */
+	const float norm = 1.0f / std::log1p(static_cast<float>(peak));
+	std::uint8_t levels[256];
+	for (int d = 0; d < 256; d++)
+		levels[d] = static_cast<std::uint8_t>(255.0f * std::min(1.0f, std::log1p(static_cast<float>(d)) * norm) + 0.5f);
+
+	std::uint8_t colors[256][4];
+	for (int level = 0; level < 256; level++) {
+		colors[level][0] = static_cast<std::uint8_t>(color.r * level / 255);
+		colors[level][1] = static_cast<std::uint8_t>(color.g * level / 255);
+		colors[level][2] = static_cast<std::uint8_t>(color.b * level / 255);
+		colors[level][3] = static_cast<std::uint8_t>(level);
+	}
+
+	stealPool.parallelFor(0, height, rowGrain, [&](std::size_t start, std::size_t end) {
+		for (std::size_t row = start; row < end; row++) {
+			const std::uint32_t *in = density.data() + static_cast<std::size_t>(row) * width;
+			std::uint8_t *out = pixels.data() + static_cast<std::size_t>(row) * width * 4;
+			for (int col = 0; col < width; col++) {
+				const std::uint32_t d = in[col];
+				const unsigned level = d < 256 ? levels[d] :
+					static_cast<unsigned>(255.0f * std::log1p(static_cast<float>(d)) * norm + 0.5f);
+				std::memcpy(out + 4 * col, colors[level], 4);
+			}
+		}
+	});
+}
+
+void DensityRaster::render(const RasterView &view, const float *x, const float *y,
+                           const float *prevX, const float *prevY, std::size_t n, float alpha,
+                           RasterColor color)
+{
+	const std::size_t nThreads = stealPool.getThreadCount();
+	const std::size_t wanted = std::clamp<std::size_t>(n / splatGrain, 1, std::min(nThreads, maxBins));
+	resize(std::max(view.width, 1), std::max(view.height, 1), wanted);
+
+	splat(view, x, y, prevX, prevY, n, alpha);
+	merge();
+	toneMap(color);
+}
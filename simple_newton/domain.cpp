@@ -0,0 +1,414 @@
+#include <main.hpp>
+#include <domain.hpp>
+
+#include <cerrno>
+#include <csignal>
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/* One past the largest key, for the end of the last range */
+static constexpr std::uint64_t endKey = std::uint64_t(1) << 62;
+
+/* Keys every rank contributes to finding the splitters */
+static constexpr std::size_t rebalanceSamples = 256;
+
+/* Particles per range handed to the pool while summing the remote pull */
+static constexpr std::size_t remoteGrain = 256;
+
+namespace {
+
+/* What rank 0 tells the others once, before the first step */
+struct Setup {
+	std::uint64_t seed;
+	std::uint64_t particles;
+	std::int32_t width;
+	std::int32_t height;
+	InitialConditions initial;
+};
+
+}
+
+Domain::Domain(const std::string &address, std::size_t rank, std::size_t ranks):
+	mesh(address, rank, ranks), bounds(ranks), outgoing(ranks), incoming(ranks)
+{
+}
+
+Domain::~Domain()
+{
+	if (mesh.rank() == 0) {
+		try {
+			command(Control { Command::STOP, 0, 0, 0 });
+		} catch (std::exception &e) {
+			std::cerr << e.what() << std::endl;
+		}
+	}
+
+	for (pid_t worker : workers)
+		(void) waitpid(worker, nullptr, 0);
+}
+
+void Domain::command(const Control &control)
+{
+	message.clear();
+	putValue(message, control);
+	for (std::size_t peer = 1; peer < mesh.size(); peer++)
+		mesh.send(peer, message);
+}
+
+Domain::Control Domain::nextCommand()
+{
+	mesh.receive(0, message);
+	MessageReader reader(message);
+	return reader.get<Control>();
+}
+
+std::size_t Domain::owner(std::uint64_t key) const
+{
+	const auto first = splitters.begin() + 1;
+	return std::upper_bound(first, splitters.end() - 1, key) - first;
+}
+
+static void stopWorkers(const std::vector<pid_t> &workers)
+{
+	for (pid_t worker : workers)
+		(void) kill(worker, SIGTERM);
+	for (pid_t worker : workers)
+		(void) waitpid(worker, nullptr, 0);
+}
+
+std::vector<pid_t> spawnWorkers(const std::string &address, std::size_t ranks)
+{
+	std::vector<pid_t> workers;
+	const std::string nRanks = std::to_string(ranks);
+	for (std::size_t r = 1; r < ranks; r++) {
+		const std::string rank = std::to_string(r);
+		const char *argv[] = {
+			"simple_newton", "--domains", nRanks.c_str(), "--peers", address.c_str(), "--rank", rank.c_str(), nullptr
+		};
+
+		pid_t pid;
+		const int err = posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, const_cast<char **>(argv), environ);
+		if (err) {
+			stopWorkers(workers);
+			throw std::runtime_error("failed to start rank " + rank + ": " + std::strerror(err));
+		}
+		workers.push_back(pid);
+	}
+	return workers;
+}
+
+ParticleSet distributedParticles(const Options &options, std::uint64_t seed, int width, int height)
+{
+	std::string address = options.peers;
+	std::vector<pid_t> workers;
+	if (address.empty()) {
+		address = "/tmp/simple_newton-" + std::to_string(getpid()) + ".sock";
+		workers = spawnWorkers(address, options.domains);
+	}
+
+	std::unique_ptr<Domain> domain;
+	try {
+		domain = std::make_unique<Domain>(address, options.rank, options.domains);
+	} catch (...) {
+		stopWorkers(workers);
+		throw;
+	}
+	domain->workers = std::move(workers);
+
+	PeerMesh &mesh = domain->mesh;
+	Setup setup;
+	if (mesh.rank() == 0) {
+		setup = Setup { seed, static_cast<std::uint64_t>(NUM_PARTICLES), width, height, options.initial };
+		domain->message.clear();
+		putValue(domain->message, setup);
+		for (std::size_t peer = 1; peer < mesh.size(); peer++)
+			mesh.send(peer, domain->message);
+	} else {
+		mesh.receive(0, domain->message);
+		MessageReader reader(domain->message);
+		setup = reader.get<Setup>();
+	}
+
+	/* The same particles a single process would make, cut into slices */
+	const std::size_t first = setup.particles * mesh.rank() / mesh.size();
+	const std::size_t last = setup.particles * (mesh.rank() + 1) / mesh.size();
+	domain->particles = setup.particles;
+
+	ParticleSet particleSet(setup.particles, first, last, setup.width, setup.height, setup.initial, setup.seed);
+	particleSet.attachDomain(std::move(domain));
+	return particleSet;
+}
+
+void ParticleSet::attachDomain(std::unique_ptr<Domain> domain)
+{
+	this->domain = std::move(domain);
+}
+
+void ParticleSet::serveDomain()
+{
+	for (;;) {
+		const Domain::Control control = domain->nextCommand();
+		switch (control.command) {
+			case Domain::Command::STEP: {
+				UpdateInfo info{};
+				info.delta = control.delta;
+				info.width = control.width;
+				info.height = control.height;
+				stepDomain(info);
+				break;
+			}
+			case Domain::Command::SNAPSHOT:
+				gatherSnapshot(nullptr);
+				break;
+			case Domain::Command::STOP:
+				return;
+		}
+	}
+}
+
+/*
+ * The remote pull is summed before the local step, from the positions
+ * the step starts with, and added in by the kick.
+ */
+void ParticleSet::stepDomain(const UpdateInfo &updateInfo)
+{
+	Domain &d = *domain;
+	const std::size_t rank = d.mesh.rank();
+	const std::size_t ranks = d.mesh.size();
+	if (rank == 0)
+		d.command(Domain::Control { Domain::Command::STEP, updateInfo.width, updateInfo.height, updateInfo.delta });
+
+	exchangeBounds();
+	if (d.splitters.empty() || stepCount % REBALANCE_INTERVAL == 0) {
+		rebalance();
+		migrate();
+		exchangeBounds();
+	}
+
+	d.tree.build(d.frame, infos.size(),
+	             [&](std::size_t i) { return infos[i].pos; },
+	             [&](std::size_t i) { return infos[i].mass; });
+	stealPool.parallelFor(0, ranks, 1, [&](std::size_t first, std::size_t last) {
+		for (std::size_t peer = first; peer < last; peer++) {
+			d.outgoing[peer].clear();
+			if (peer != rank)
+				d.tree.essentialFor(d.bounds[peer], d.outgoing[peer]);
+		}
+	});
+	d.mesh.exchange(d.outgoing, d.incoming);
+
+	d.field.clear();
+	for (std::size_t peer = 0; peer < ranks; peer++)
+		if (peer != rank)
+			d.field.add(d.incoming[peer]);
+
+#if DIAGNOSTICS_INTERVAL > 0
+	const bool measure = stepCount % DIAGNOSTICS_INTERVAL == 0;
+#else
+	const bool measure = false;
+#endif
+	const std::size_t n = infos.size();
+	resizeWithSlack(remoteAccels, n);
+	resizeWithSlack(remotePotentials, measure ? n : 0);
+	stealPool.parallelFor(0, n, remoteGrain, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++)
+			remoteAccels[i] = d.field.pull(infos[i].pos, measure ? &remotePotentials[i] : nullptr);
+	});
+
+	stepLocal(updateInfo);
+
+#if DIAGNOSTICS_INTERVAL > 0
+	/* Rank 0 adds everybody's sums up, in rank order */
+	if (measure && rank != 0) {
+		d.message.clear();
+		putValue(d.message, diagnostics);
+		d.mesh.send(0, d.message);
+	} else if (measure) {
+		for (std::size_t peer = 1; peer < ranks; peer++) {
+			d.mesh.receive(peer, d.message);
+			MessageReader reader(d.message);
+			const Diagnostics part = reader.get<Diagnostics>();
+			diagnostics.kinetic += part.kinetic;
+			diagnostics.potential += part.potential;
+			diagnostics.momentum += part.momentum;
+			diagnostics.angularMomentum += part.angularMomentum;
+		}
+	}
+#endif
+
+	migrate();
+}
+
+void ParticleSet::exchangeBounds()
+{
+	Domain &d = *domain;
+	BoundingBox own;
+	for (const ParticleInfo &info : infos)
+		own.add(info.pos);
+
+	for (PeerMesh::Buffer &message : d.outgoing) {
+		message.clear();
+		putValue(message, own);
+	}
+	d.mesh.exchange(d.outgoing, d.incoming);
+
+	for (std::size_t peer = 0; peer < d.mesh.size(); peer++) {
+		MessageReader reader(d.incoming[peer]);
+		d.bounds[peer] = reader.get<BoundingBox>();
+	}
+}
+
+/*
+ * Fits the frame around all particles, with room to move, and cuts the
+ * curve through it where the sampled keys of all ranks add up to equal
+ * shares. Every rank sees the same samples, in the same order, and so
+ * comes up with the same splitters.
+ */
+void ParticleSet::rebalance()
+{
+	Domain &d = *domain;
+	const std::size_t ranks = d.mesh.size();
+
+	BoundingBox all;
+	for (const BoundingBox &bounds : d.bounds)
+		all.add(bounds);
+	const glm::dvec2 extent = all.hi - all.lo;
+	d.frame.size = 1.5 * std::max(extent.x, extent.y) + 1;
+	d.frame.origin = (all.lo + all.hi) / 2.0 - glm::dvec2(d.frame.size, d.frame.size) / 2.0;
+
+	/* Each sample stands for the particles between it and the next */
+	const std::size_t n = infos.size();
+	const std::size_t stride = std::max<std::size_t>(1, n / rebalanceSamples);
+	const double weight = n ? static_cast<double>(n) / ((n + stride - 1) / stride) : 0;
+	PeerMesh::Buffer &own = d.outgoing[0];
+	own.clear();
+	putValue(own, weight);
+	for (std::size_t i = 0; i < n; i += stride)
+		putValue(own, d.frame.key(infos[i].pos));
+	for (std::size_t peer = 1; peer < ranks; peer++)
+		d.outgoing[peer] = own;
+	d.mesh.exchange(d.outgoing, d.incoming);
+
+	d.samples.clear();
+	for (const PeerMesh::Buffer &message : d.incoming) {
+		MessageReader reader(message);
+		const double sampleWeight = reader.get<double>();
+		while (!reader.atEnd())
+			d.samples.emplace_back(reader.get<std::uint64_t>(), sampleWeight);
+	}
+	std::sort(d.samples.begin(), d.samples.end());
+
+	double total = 0;
+	for (const auto &sample : d.samples)
+		total += sample.second;
+
+	d.splitters.assign(ranks + 1, endKey);
+	d.splitters[0] = 0;
+	std::size_t r = 1;
+	double seen = 0;
+	for (const auto &sample : d.samples) {
+		while (r < ranks && seen >= total * r / ranks)
+			d.splitters[r++] = sample.first;
+		seen += sample.second;
+	}
+}
+
+/*
+ * Hands every particle outside of this rank's range to its owner, with
+ * its id, and takes in the ones that came in.
+ */
+void ParticleSet::migrate()
+{
+	Domain &d = *domain;
+	const std::size_t rank = d.mesh.rank();
+	const std::size_t n = infos.size();
+
+	for (PeerMesh::Buffer &message : d.outgoing)
+		message.clear();
+
+	resizeWithSlack(alive, n);
+	for (std::size_t i = 0; i < n; i++) {
+		const std::size_t owner = d.owner(d.frame.key(infos[i].pos));
+		alive[i] = owner == rank;
+		if (owner == rank)
+			continue;
+
+		PeerMesh::Buffer &message = d.outgoing[owner];
+		putValue(message, infos[i]);
+		putValue(message, ids[i]);
+	}
+	d.mesh.exchange(d.outgoing, d.incoming);
+	compact();
+
+	for (std::size_t peer = 0; peer < d.mesh.size(); peer++) {
+		if (peer == rank)
+			continue;
+
+		MessageReader reader(d.incoming[peer]);
+		while (!reader.atEnd()) {
+			infos.push_back(reader.get<ParticleInfo>());
+			ids.push_back(reader.get<std::uint32_t>());
+		}
+	}
+}
+
+/*
+ * Every rank sends rank 0 its ids and positions, and rank 0 puts them
+ * in order of id, so particles keep their place in the snapshot from
+ * one step to the next wherever they are stepped.
+ */
+void ParticleSet::gatherSnapshot(Snapshot *out) const
+{
+	Domain &d = *domain;
+	const std::size_t ranks = d.mesh.size();
+	if (d.mesh.rank() != 0) {
+		d.message.clear();
+		for (std::size_t i = 0; i < infos.size(); i++) {
+			putValue(d.message, ids[i]);
+			putValue(d.message, infos[i].pos);
+		}
+		d.mesh.send(0, d.message);
+		return;
+	}
+
+	for (std::size_t peer = 1; peer < ranks; peer++)
+		d.mesh.receive(peer, d.incoming[peer]);
+
+	auto forEach = [&](auto &&visit) {
+		for (std::size_t i = 0; i < infos.size(); i++)
+			visit(ids[i], infos[i].pos);
+		for (std::size_t peer = 1; peer < ranks; peer++) {
+			MessageReader reader(d.incoming[peer]);
+			while (!reader.atEnd()) {
+				const auto id = reader.get<std::uint32_t>();
+				visit(id, reader.get<glm::dvec2>());
+			}
+		}
+	};
+
+	/* Ids merged away leave gaps, so slots are a prefix sum over the ids present */
+	d.slots.assign(d.particles, 0);
+	forEach([&](std::uint32_t id, const glm::dvec2 &) {
+		if (id >= d.particles)
+			throw std::runtime_error("particle id out of range from a peer");
+		d.slots[id] = 1;
+	});
+	std::uint32_t present = 0;
+	for (std::uint32_t &slot : d.slots) {
+		const std::uint32_t next = present + slot;
+		slot = present;
+		present = next;
+	}
+
+	out->x.resize(present);
+	out->y.resize(present);
+	forEach([&](std::uint32_t id, const glm::dvec2 &pos) {
+		out->x[d.slots[id]] = static_cast<float>(pos.x);
+		out->y[d.slots[id]] = static_cast<float>(pos.y);
+	});
+	out->step = stepCount;
+}
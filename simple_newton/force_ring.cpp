@@ -0,0 +1,372 @@
+#include <main.hpp>
+#include <force_ring.hpp>
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/* Polls before a waiting process parks on the futex */
+static constexpr unsigned spinLimit = 1 << 12;
+
+/* How often rank 0 looks for processes that died while it waits on them */
+static constexpr long livenessCheckNs = 100000000;
+
+/* In shared memory; the atomics must work across processes */
+struct ForceRing::Header {
+	/* Bumped by rank 0 to start a step, or to stop */
+	alignas(cacheLineSize) std::atomic<std::uint32_t> command;
+
+	/* Processes done with the step, and processes that mapped the segment */
+	alignas(cacheLineSize) std::atomic<std::uint32_t> finished;
+	alignas(cacheLineSize) std::atomic<std::uint32_t> attached;
+
+	alignas(cacheLineSize) std::uint64_t n;
+	std::uint64_t capacity;
+	std::uint32_t processes;
+	std::uint32_t measure;
+	std::uint32_t stopping;
+};
+
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free, "futexes need plain 32-bit words");
+
+static std::size_t alignUp(std::size_t n, std::size_t align)
+{
+	return (n + align - 1) / align * align;
+}
+
+static std::runtime_error ringError(const std::string &what)
+{
+	return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+static void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+/* Not FUTEX_PRIVATE_FLAG: the word is shared with other processes */
+static void futexWait(const std::atomic<std::uint32_t> &value, std::uint32_t old, const timespec *timeout)
+{
+	(void) syscall(SYS_futex, reinterpret_cast<const std::uint32_t *>(&value), FUTEX_WAIT, old, timeout, nullptr, 0);
+}
+
+static void futexWake(std::atomic<std::uint32_t> &value)
+{
+	(void) syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&value), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/*
+ * The pull of a block on one particle. Coincident pairs, the particle
+ * itself among them, add nothing, as in pairAccel().
+ */
+template <bool measure>
+static void pullFrom(const ForceRing::Body *block, std::size_t count, const glm::dvec2 &pos,
+                     glm::dvec2 &pull, double &potential)
+{
+	for (std::size_t j = 0; j < count; j++) {
+		const glm::dvec2 dVector = block[j].pos - pos;
+		const double dMagn = glm::dot(dVector, dVector);
+		if (dMagn == 0)
+			continue;
+		pull += dVector * (block[j].mass / dMagn);
+		if constexpr (measure)
+			potential += block[j].mass * std::log(dMagn);
+	}
+}
+
+std::size_t ForceRing::bytesFor(std::size_t capacity)
+{
+	return alignUp(sizeof(Header), cacheLineSize) +
+	       alignUp(capacity * sizeof(Body), cacheLineSize) +
+	       alignUp(capacity * sizeof(glm::dvec2), cacheLineSize) +
+	       capacity * sizeof(double);
+}
+
+void ForceRing::layOut()
+{
+	std::byte *at = static_cast<std::byte *>(segment);
+	header = reinterpret_cast<Header *>(at);
+	at += alignUp(sizeof(Header), cacheLineSize);
+	bodies = reinterpret_cast<Body *>(at);
+	at += alignUp(capacity * sizeof(Body), cacheLineSize);
+	sharedPulls = reinterpret_cast<glm::dvec2 *>(at);
+	at += alignUp(capacity * sizeof(glm::dvec2), cacheLineSize);
+	sharedPotentials = reinterpret_cast<double *>(at);
+}
+
+void ForceRing::mapSegment(int fd, std::size_t bytes)
+{
+	void *map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		throw ringError("failed to map shared memory " + name);
+	segment = map;
+	segmentSize = bytes;
+}
+
+ForceRing::ForceRing(std::size_t processes, std::size_t capacity):
+	processes(processes), capacity(std::max<std::size_t>(capacity, 1)),
+	name("/simple_newton-ring-" + std::to_string(getpid()))
+{
+	const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		throw ringError("failed to create shared memory " + name);
+
+	try {
+		const std::size_t bytes = bytesFor(this->capacity);
+		if (ftruncate(fd, bytes) != 0)
+			throw ringError("failed to size shared memory " + name);
+		mapSegment(fd, bytes);
+		close(fd);
+
+		new (segment) Header {};
+		layOut();
+		header->capacity = this->capacity;
+		header->processes = processes;
+
+		const std::string nProcesses = std::to_string(processes);
+		for (std::size_t r = 1; r < processes; r++) {
+			const std::string rank = std::to_string(r);
+			const char *argv[] = {
+				"simple_newton", "--ring", nProcesses.c_str(), "--ring-segment", name.c_str(), "--rank", rank.c_str(), nullptr
+			};
+
+			pid_t pid;
+			const int err = posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, const_cast<char **>(argv), environ);
+			if (err)
+				throw std::runtime_error("failed to start ring process " + rank + ": " + std::strerror(err));
+			workers.push_back(pid);
+		}
+		waitForWorkers(header->attached, processes - 1);
+	} catch (...) {
+		if (segment)
+			stopWorkers();
+		else
+			close(fd);
+		(void) shm_unlink(name.c_str());
+		if (segment)
+			munmap(segment, segmentSize);
+		throw;
+	}
+
+	/* Everybody has it mapped, so the name can go */
+	(void) shm_unlink(name.c_str());
+	startPrefetcher();
+}
+
+ForceRing::ForceRing(const std::string &name, std::size_t rank):
+	rank(rank), name(name)
+{
+	/* Rank 0 started us, and nobody else would ever stop us */
+	(void) prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() == 1)
+		throw std::runtime_error("ring process " + std::to_string(rank) + " lost rank 0");
+
+	const int fd = shm_open(name.c_str(), O_RDWR, 0);
+	if (fd < 0)
+		throw ringError("failed to open shared memory " + name);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+		close(fd);
+		throw std::runtime_error("shared memory " + name + " is truncated");
+	}
+	try {
+		mapSegment(fd, static_cast<std::size_t>(st.st_size));
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+
+	header = static_cast<Header *>(segment);
+	processes = header->processes;
+	capacity = header->capacity;
+	if (rank >= processes || bytesFor(capacity) > segmentSize) {
+		munmap(segment, segmentSize);
+		throw std::runtime_error("shared memory " + name + " doesn't hold a force ring for rank " + std::to_string(rank));
+	}
+	layOut();
+	startPrefetcher();
+
+	header->attached.fetch_add(1, std::memory_order_release);
+	futexWake(header->attached);
+}
+
+ForceRing::~ForceRing()
+{
+	stopPrefetcher();
+	if (rank == 0)
+		stopWorkers();
+	if (segment)
+		munmap(segment, segmentSize);
+}
+
+void ForceRing::stopWorkers()
+{
+	header->stopping = 1;
+	header->command.fetch_add(1, std::memory_order_release);
+	futexWake(header->command);
+	for (pid_t worker : workers)
+		(void) waitpid(worker, nullptr, 0);
+	workers.clear();
+}
+
+/* Waits for the others on rank 0, and throws if one of them died instead */
+void ForceRing::waitForWorkers(const std::atomic<std::uint32_t> &value, std::uint32_t expected)
+{
+	for (unsigned spin = 0; spin < spinLimit; spin++) {
+		if (value.load(std::memory_order_acquire) == expected)
+			return;
+		cpuRelax();
+	}
+
+	for (;;) {
+		const std::uint32_t seen = value.load(std::memory_order_acquire);
+		if (seen == expected)
+			return;
+
+		const timespec timeout { 0, livenessCheckNs };
+		futexWait(value, seen, &timeout);
+		for (pid_t worker : workers)
+			if (waitpid(worker, nullptr, WNOHANG) == worker)
+				throw std::runtime_error("a force ring process exited");
+	}
+}
+
+void ForceRing::startPrefetcher()
+{
+	prefetcher = std::jthread([this](std::stop_token stop) {
+		std::uint32_t seen = 0;
+		for (;;) {
+			prefetchRequest.wait(seen, std::memory_order_acquire);
+			seen = prefetchRequest.load(std::memory_order_acquire);
+			if (stop.stop_requested())
+				return;
+
+			copyBlock(prefetchBlock, *prefetchInto);
+			prefetchDone.store(seen, std::memory_order_release);
+			prefetchDone.notify_one();
+		}
+	});
+}
+
+void ForceRing::stopPrefetcher()
+{
+	if (!prefetcher.joinable())
+		return;
+	prefetcher.request_stop();
+	prefetchRequest.fetch_add(1, std::memory_order_release);
+	prefetchRequest.notify_one();
+	prefetcher.join();
+}
+
+void ForceRing::copyBlock(std::size_t block, ArenaVector<Body> &into) const
+{
+	const std::size_t n = header->n;
+	into.assign(bodies + n * block / processes, bodies + n * (block + 1) / processes);
+}
+
+void ForceRing::run(std::size_t n, bool measure)
+{
+	header->n = n;
+	header->measure = measure;
+	header->finished.store(0, std::memory_order_relaxed);
+	header->command.fetch_add(1, std::memory_order_release);
+	futexWake(header->command);
+
+	computeShare();
+	waitForWorkers(header->finished, processes - 1);
+}
+
+void ForceRing::serve()
+{
+	/* Nothing happens before everybody attached, so we can't have missed a command */
+	std::uint32_t seen = 0;
+	for (;;) {
+		unsigned spin = 0;
+		while (header->command.load(std::memory_order_acquire) == seen) {
+			if (spin++ < spinLimit)
+				cpuRelax();
+			else
+				futexWait(header->command, seen, nullptr);
+		}
+		seen++;
+		if (header->stopping)
+			return;
+
+		computeShare();
+		header->finished.fetch_add(1, std::memory_order_release);
+		futexWake(header->finished);
+	}
+}
+
+/*
+ * This process's i-block against every j-block, going around the ring
+ * from its own. The next j-block is copied on the prefetch thread while
+ * the pool sums the current one.
+ */
+void ForceRing::computeShare()
+{
+	const std::size_t n = header->n;
+	const bool measure = header->measure;
+	const std::size_t start = n * rank / processes;
+	const std::size_t end = n * (rank + 1) / processes;
+
+	copyBlock(rank, ownBlock);
+	pulls.assign(end - start, glm::dvec2(0, 0));
+	potentials.assign(measure ? end - start : 0, 0);
+
+	std::uint32_t requested = prefetchRequest.load(std::memory_order_relaxed);
+	for (std::size_t stage = 0; stage < processes; stage++) {
+		const bool prefetch = stage + 1 < processes;
+		if (prefetch) {
+			prefetchBlock = (rank + stage + 1) % processes;
+			prefetchInto = &blocks[(stage + 1) % 2];
+			requested = prefetchRequest.fetch_add(1, std::memory_order_release) + 1;
+			prefetchRequest.notify_one();
+		}
+
+		const ArenaVector<Body> &block = stage == 0 ? ownBlock : blocks[stage % 2];
+		if (!block.empty() && !ownBlock.empty()) {
+			stealPool.parallelFor(0, ownBlock.size(), std::max<std::size_t>(1, 16384 / block.size()),
+			                      [&](std::size_t first, std::size_t last) {
+				for (std::size_t i = first; i < last; i++) {
+					double unused = 0;
+					if (measure)
+						pullFrom<true>(block.data(), block.size(), ownBlock[i].pos, pulls[i], potentials[i]);
+					else
+						pullFrom<false>(block.data(), block.size(), ownBlock[i].pos, pulls[i], unused);
+				}
+			});
+		}
+
+		if (prefetch)
+			for (std::uint32_t done; (done = prefetchDone.load(std::memory_order_acquire)) != requested;)
+				prefetchDone.wait(done, std::memory_order_acquire);
+	}
+
+	std::copy(pulls.begin(), pulls.end(), sharedPulls + start);
+	std::copy(potentials.begin(), potentials.end(), sharedPotentials + start);
+}
+
+void ParticleSet::attachRing(std::unique_ptr<ForceRing> ring)
+{
+	this->ring = std::move(ring);
+}
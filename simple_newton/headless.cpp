@@ -0,0 +1,344 @@
+#include <main.hpp>
+#include <headless.hpp>
+
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+static bool endsWith(const std::string &s, std::string_view suffix)
+{
+	return std::string_view(s).ends_with(suffix);
+}
+
+FrameWriter::FrameWriter(const std::string &path, int width, int height, int fps):
+	path(path), width(width), height(height), fps(fps)
+{
+	if (endsWith(path, ".y4m"))
+		format = FORMAT_Y4M;
+	else if (endsWith(path, ".png"))
+		format = FORMAT_PNG;
+	else
+		format = FORMAT_PPM;
+
+	if (format != FORMAT_Y4M)
+		return;
+
+	stream = std::fopen(path.c_str(), "wb");
+	if (!stream)
+		throw std::runtime_error("failed to create " + path + ": " + std::strerror(errno));
+
+	/* Full resolution chroma, so no colour is lost to subsampling */
+	std::fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+}
+
+void FrameWriter::close()
+{
+	if (!stream)
+		return;
+
+	const bool flushed = std::fflush(stream) == 0 && !std::ferror(stream);
+	const bool closed = std::fclose(stream) == 0;
+	stream = nullptr;
+	if (!flushed || !closed)
+		throw std::runtime_error("failed to write " + path);
+}
+
+FrameWriter::~FrameWriter()
+{
+	if (stream)
+		std::fclose(stream);
+}
+
+/* Built in place, so numbering frames doesn't allocate once the name has its length */
+const std::string &FrameWriter::framePath(std::size_t index)
+{
+	const std::size_t slash = path.find_last_of('/');
+	std::size_t dot = path.find_last_of('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = path.size();
+
+	char number[32];
+	std::snprintf(number, sizeof(number), "%06zu", index);
+	fname.assign(path, 0, dot);
+	fname.append(number);
+	fname.append(path, dot);
+	return fname;
+}
+
+void FrameWriter::writeFile(const std::string &fname, const std::vector<std::uint8_t> &data) const
+{
+	std::FILE *file = std::fopen(fname.c_str(), "wb");
+	if (!file)
+		throw std::runtime_error("failed to create " + fname + ": " + std::strerror(errno));
+
+	const bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+	if (std::fclose(file) != 0 || !written)
+		throw std::runtime_error("failed to write " + fname);
+}
+
+void FrameWriter::encodePPM(const std::uint8_t *rgb)
+{
+	char header[64];
+	const int length = std::snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+	buffer.assign(header, header + length);
+	buffer.insert(buffer.end(), rgb, rgb + static_cast<std::size_t>(width) * height * 3);
+}
+
+static void putBE32(std::vector<std::uint8_t> &out, std::uint32_t v)
+{
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back(static_cast<std::uint8_t>(v >> shift));
+}
+
+static std::uint32_t crc32(const std::uint8_t *data, std::size_t size)
+{
+	static const auto table = [] {
+		std::array<std::uint32_t, 256> t;
+		for (std::uint32_t n = 0; n < 256; n++) {
+			std::uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[n] = c;
+		}
+		return t;
+	}();
+
+	std::uint32_t c = 0xFFFFFFFFu;
+	for (std::size_t i = 0; i < size; i++)
+		c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFFu;
+}
+
+/*
+ * PNG without a compression library: the image data goes into stored
+ * (uncompressed) deflate blocks. Particle frames are mostly black, but
+ * encoding speed matters more here than size; recompress afterwards if
+ * needed.
+ */
+void FrameWriter::encodePNG(const std::uint8_t *rgb)
+{
+	static constexpr std::uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	static constexpr std::size_t maxStored = 65535;
+
+	auto chunk = [this](const char *type, auto &&fill) {
+		const std::size_t lengthAt = buffer.size();
+		putBE32(buffer, 0);
+		buffer.insert(buffer.end(), type, type + 4);
+		fill();
+		const std::size_t length = buffer.size() - lengthAt - 8;
+		for (int k = 0; k < 4; k++)
+			buffer[lengthAt + k] = static_cast<std::uint8_t>(length >> (24 - 8 * k));
+		putBE32(buffer, crc32(buffer.data() + lengthAt + 4, length + 4));
+	};
+
+	buffer.assign(signature, signature + sizeof(signature));
+
+	chunk("IHDR", [&] {
+		putBE32(buffer, width);
+		putBE32(buffer, height);
+		/* 8 bits per channel, RGB, deflate, no filters, not interlaced */
+		for (std::uint8_t v : { 8, 2, 0, 0, 0 })
+			buffer.push_back(v);
+	});
+
+	chunk("IDAT", [&] {
+		const std::size_t rowSize = static_cast<std::size_t>(width) * 3;
+		const std::size_t rawSize = (rowSize + 1) * height;
+
+		/* zlib header: deflate, 32K window, no preset dictionary */
+		buffer.push_back(0x78);
+		buffer.push_back(0x01);
+
+		std::uint32_t a = 1, b = 0;
+		std::size_t inBlock = 0;
+		std::size_t remaining = rawSize;
+		auto put = [&](std::uint8_t v) {
+			if (!inBlock) {
+				const std::size_t size = std::min(remaining, maxStored);
+				buffer.push_back(size == remaining ? 1 : 0);
+				buffer.push_back(static_cast<std::uint8_t>(size));
+				buffer.push_back(static_cast<std::uint8_t>(size >> 8));
+				buffer.push_back(static_cast<std::uint8_t>(~size));
+				buffer.push_back(static_cast<std::uint8_t>(~size >> 8));
+				inBlock = size;
+			}
+			buffer.push_back(v);
+			inBlock--;
+			remaining--;
+			a = (a + v) % 65521;
+			b = (b + a) % 65521;
+		};
+
+		for (int y = 0; y < height; y++) {
+			/* Filter type: none */
+			put(0);
+			const std::uint8_t *row = rgb + y * rowSize;
+			for (std::size_t x = 0; x < rowSize; x++)
+				put(row[x]);
+		}
+		putBE32(buffer, (b << 16) | a);
+	});
+
+	chunk("IEND", [] {});
+}
+
+void FrameWriter::encodeY4M(const std::uint8_t *rgb)
+{
+	static constexpr char frameHeader[] = "FRAME\n";
+	const std::size_t plane = static_cast<std::size_t>(width) * height;
+
+	buffer.resize(sizeof(frameHeader) - 1 + 3 * plane);
+	std::memcpy(buffer.data(), frameHeader, sizeof(frameHeader) - 1);
+	std::uint8_t *yPlane = buffer.data() + sizeof(frameHeader) - 1;
+	std::uint8_t *uPlane = yPlane + plane;
+	std::uint8_t *vPlane = uPlane + plane;
+
+	/* BT.601, limited range */
+	for (std::size_t i = 0; i < plane; i++) {
+		const int r = rgb[3 * i];
+		const int g = rgb[3 * i + 1];
+		const int b = rgb[3 * i + 2];
+		yPlane[i] = static_cast<std::uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+		uPlane[i] = static_cast<std::uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+		vPlane[i] = static_cast<std::uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+	}
+}
+
+void FrameWriter::write(std::size_t index, const std::uint8_t *rgb)
+{
+	switch (format) {
+		case FORMAT_PPM:
+			encodePPM(rgb);
+			writeFile(framePath(index), buffer);
+			break;
+		case FORMAT_PNG:
+			encodePNG(rgb);
+			writeFile(framePath(index), buffer);
+			break;
+		case FORMAT_Y4M:
+			encodeY4M(rgb);
+			if (std::fwrite(buffer.data(), 1, buffer.size(), stream) != buffer.size())
+				throw std::runtime_error("failed to write " + path);
+			break;
+	}
+}
+
+HeadlessRenderer::HeadlessRenderer(const Options &options):
+	options(options), width(RENDER_WIDTH), height(RENDER_HEIGHT), frames(RENDER_QUEUE),
+	freeFrames(RENDER_QUEUE), rasterQueue(RENDER_QUEUE + 1), encodeQueue(RENDER_QUEUE + 1) {}
+
+void HeadlessRenderer::rasterize()
+{
+	DensityRaster raster;
+	const RasterView view { width, height, 1.0, 0.0, 0.0 };
+	const RasterColor background = SimpleNewtonApp::backgroundColor;
+
+	while (Frame *frame = rasterQueue.pop()) {
+		const ParticleSet::Snapshot &snapshot = frame->snapshot;
+		raster.render(view, snapshot.x.data(), snapshot.y.data(), nullptr, nullptr,
+		              snapshot.x.size(), 1.0f, ParticleSet::particleColor);
+
+		/* Added onto the background, as on screen */
+		const std::size_t size = static_cast<std::size_t>(width) * height;
+		const std::uint8_t *in = raster.data();
+		frame->rgb.resize(size * 3);
+		for (std::size_t i = 0; i < size; i++) {
+			frame->rgb[3 * i]     = static_cast<std::uint8_t>(std::min(255, background.r + in[4 * i]));
+			frame->rgb[3 * i + 1] = static_cast<std::uint8_t>(std::min(255, background.g + in[4 * i + 1]));
+			frame->rgb[3 * i + 2] = static_cast<std::uint8_t>(std::min(255, background.b + in[4 * i + 2]));
+		}
+		encodeQueue.push(frame);
+	}
+	encodeQueue.push(nullptr);
+}
+
+void HeadlessRenderer::encode(FrameWriter &writer)
+{
+	while (Frame *frame = encodeQueue.pop()) {
+		/* After a failure, keep handing frames back so the simulation never blocks */
+		if (!failed) {
+			try {
+				writer.write(frame->index, frame->rgb.data());
+			} catch (std::exception &) {
+				error = std::current_exception();
+				failed = true;
+			}
+		}
+		freeFrames.push(frame);
+	}
+}
+
+bool HeadlessRenderer::run()
+{
+	ParticleSet particleSet = initialParticles(options, width, height);
+	FrameWriter writer(options.render, width, height, RENDER_FPS);
+
+	for (Frame &frame : frames)
+		freeFrames.push(&frame);
+
+	/* The stages go to the render core, not wherever this thread happens to be */
+	std::jthread rasterThread([this] {
+		pinRenderThread();
+		rasterize();
+	});
+	std::jthread encodeThread([this, &writer] {
+		pinRenderThread();
+		encode(writer);
+	});
+	pinSimulationThread();
+
+	ParticleSet::UpdateInfo info{};
+	info.delta = TIMESTEP;
+	info.width = width;
+	info.height = height;
+
+#if COUNT_ALLOCATIONS
+	/* By the time a slot comes back the second time, every stage has seen every slot */
+	constexpr std::size_t warmUpFrames = 2 * RENDER_QUEUE;
+	std::uint64_t warmAllocations = 0;
+#endif
+
+	/* A step that throws (a lost peer) still lets the stages drain and stop */
+	std::exception_ptr stepError;
+	std::size_t rendered = 0;
+	try {
+		for (; rendered < options.frames && !failed; rendered++) {
+			for (int s = 0; rendered > 0 && s < RENDER_INTERVAL; s++)
+				particleSet.updateParticles(info);
+
+			Frame *frame = freeFrames.pop();
+#if COUNT_ALLOCATIONS
+			if (rendered == warmUpFrames)
+				warmAllocations = allocationCount();
+#endif
+			frame->index = rendered;
+			particleSet.snapshot(frame->snapshot);
+			rasterQueue.push(frame);
+		}
+	} catch (std::exception &) {
+		stepError = std::current_exception();
+	}
+	rasterQueue.push(nullptr);
+
+	rasterThread.join();
+	encodeThread.join();
+	if (stepError)
+		std::rethrow_exception(stepError);
+	if (error)
+		std::rethrow_exception(error);
+	writer.close();
+
+	std::cout << "Rendered " << rendered << " frames to " << options.render << std::endl;
+
+#if COUNT_ALLOCATIONS
+	if (rendered > warmUpFrames) {
+		const std::uint64_t allocations = allocationCount() - warmAllocations;
+		std::cout << allocations << " heap allocations in the last " << rendered - warmUpFrames
+		          << " frames, after warming up" << std::endl;
+		return allocations == 0;
+	}
+#endif
+	return true;
+}
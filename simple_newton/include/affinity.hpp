@@ -0,0 +1,50 @@
+#ifndef _SIMPLE_NEWTON_AFFINITY_HEADER_FILE
+#define _SIMPLE_NEWTON_AFFINITY_HEADER_FILE
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Which logical CPU each thread runs on. The threads that step
+ * particles take cpus in order, the simulation thread first, so the
+ * pools are sized to cpus.size().
+ */
+struct ThreadPlacement {
+	std::vector<std::size_t> cpus;
+
+	/* The logical CPUs of a core kept for the render/event thread and the headless stages */
+	std::vector<std::size_t> renderCpus;
+};
+
+/*
+ * Lays the allowed CPUs out in NUMA node, package and core order. Each
+ * core's first logical CPU comes before any SMT sibling, or
+ * physicalCoresOnly leaves the siblings out. With reserveRenderCore,
+ * the last core is set aside as renderCpus, as long as another one is
+ * left.
+ */
+ThreadPlacement planThreads(const std::vector<std::size_t> &allowed, bool physicalCoresOnly, bool reserveRenderCore);
+
+/* Keeps the calling thread on the given logical CPUs; false if that failed */
+bool pinThread(const std::vector<std::size_t> &cpus);
+
+/*
+ * Sizes the thread pools to the CPU budget (see cpu_quota.hpp), pins
+ * the one that steps particles according to PIN_THREADS and friends,
+ * moves the calling (render/event) thread to the render core, and logs
+ * what it decided. Must run before anything uses the pools. Processes
+ * that share the machine pass which share of the budget is theirs;
+ * only share 0 keeps a core for rendering.
+ */
+void configureThreads(std::size_t share = 0, std::size_t shares = 1);
+
+/* Pins the calling thread as the simulation thread, if threads are pinned */
+void pinSimulationThread();
+
+/* Moves the calling thread to the render core, if one is kept */
+void pinRenderThread();
+
+/* What configureThreads() set up; no CPUs if threads aren't pinned */
+const ThreadPlacement &threadPlacement();
+
+#endif // _SIMPLE_NEWTON_AFFINITY_HEADER_FILE
@@ -0,0 +1,22 @@
+#ifndef _SIMPLE_NEWTON_ALLOC_COUNTER_HEADER_FILE
+#define _SIMPLE_NEWTON_ALLOC_COUNTER_HEADER_FILE
+
+#include <cstdint>
+
+/*
+ * Heap allocations made through operator new, and arena blocks mapped
+ * on their own, by every thread, since the start of the process. With
+ * COUNT_ALLOCATIONS, the global operator new is replaced to keep the
+ * count, so a run can check that its steady state allocates nothing:
+ * read the count after warming up, and again at the end. Without it,
+ * the count is always 0.
+ *
+ * Every thread counts into a cache line of its own, so the count
+ * doesn't add contention of its own to what it measures.
+ */
+std::uint64_t allocationCount();
+
+/* Counts an allocation that doesn't go through operator new */
+void countAllocation();
+
+#endif // _SIMPLE_NEWTON_ALLOC_COUNTER_HEADER_FILE
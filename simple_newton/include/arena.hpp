@@ -0,0 +1,75 @@
+#ifndef _SIMPLE_NEWTON_ARENA_HEADER_FILE
+#define _SIMPLE_NEWTON_ARENA_HEADER_FILE
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <vector>
+
+/*
+ * Memory for the particle arrays and the scratch space of a step.
+ * Every block starts on a cache line, so SIMD loads never straddle one
+ * at the front of an array and no two arrays share a line. Blocks of
+ * at least hugePageSize are mapped on their own, aligned to a huge
+ * page, and backed by huge pages when HUGE_PAGES is set: explicit
+ * (hugetlbfs) pages if the system has some reserved, transparent ones
+ * otherwise. A step streaming through millions of particles then
+ * needs one TLB entry per 2 MB instead of per 4 KB.
+ */
+constexpr std::size_t cacheLineSize = 64;
+constexpr std::size_t hugePageSize = std::size_t(2) << 20;
+
+/* Throws std::bad_alloc if the memory can't be had */
+void *arenaAllocate(std::size_t bytes);
+void arenaFree(void *block, std::size_t bytes);
+
+/*
+ * The page size a block of that many bytes is mapped with, so anything
+ * that splits it up (NUMA placement) can stay on page boundaries.
+ */
+std::size_t arenaPageSize(std::size_t bytes);
+
+template <class T>
+struct ArenaAllocator {
+	using value_type = T;
+
+	static_assert(alignof(T) <= cacheLineSize, "over-aligned types need their own allocator");
+
+	ArenaAllocator() = default;
+	template <class U>
+	ArenaAllocator(const ArenaAllocator<U> &) {}
+
+	T *allocate(std::size_t n)
+	{
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+		return static_cast<T *>(arenaAllocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, std::size_t n)
+	{
+		arenaFree(p, n * sizeof(T));
+	}
+
+	template <class U>
+	bool operator==(const ArenaAllocator<U> &) const { return true; }
+};
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+/*
+ * For arrays that are cleared and refilled every step with a size that
+ * wobbles (a rank's particles, the messages between ranks): growing
+ * with some slack lets them settle on a capacity instead of
+ * reallocating every time they come out a little longer than before.
+ */
+template <class Vector>
+void resizeWithSlack(Vector &vector, std::size_t size)
+{
+	if (size > vector.capacity())
+		vector.reserve(size + size / 2);
+	vector.resize(size);
+}
+
+#endif // _SIMPLE_NEWTON_ARENA_HEADER_FILE
@@ -0,0 +1,47 @@
+#ifndef _SIMPLE_NEWTON_CHECKPOINT_HEADER_FILE
+#define _SIMPLE_NEWTON_CHECKPOINT_HEADER_FILE
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * On-disk layout of a checkpoint:
+ *
+ *   CheckpointHeader
+ *   x, y, vx, vy, mass    one column of doubles each, page aligned
+ *   id                    version 2 and up, a column of std::uint32_t
+ *
+ * Every column starts on a page boundary, so a mapped checkpoint can be
+ * read column by column without any parsing. Version 1 checkpoints
+ * have no ids; particles get their index as id when restored.
+ */
+struct CheckpointHeader {
+	enum Column {
+		COLUMN_X,
+		COLUMN_Y,
+		COLUMN_VX,
+		COLUMN_VY,
+		COLUMN_MASS,
+		NUM_COLUMNS
+	};
+
+	static constexpr char magicValue[8] = { 'S', 'N', 'C', 'K', 'P', 'T', '\r', '\n' };
+	static constexpr std::uint32_t currentVersion = 2;
+	static constexpr std::size_t columnAlign = 4096;
+
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t headerSize;
+	std::uint64_t count;
+	std::uint64_t step;
+	std::uint64_t columnOffset[NUM_COLUMNS];
+
+	/* Version 2 and up */
+	std::uint64_t idOffset;
+};
+
+/* Version 1 headers stop after columnOffset */
+static constexpr std::size_t checkpointHeaderSizeV1 = 72;
+static_assert(offsetof(CheckpointHeader, idOffset) == checkpointHeaderSizeV1);
+
+#endif // _SIMPLE_NEWTON_CHECKPOINT_HEADER_FILE
@@ -0,0 +1,35 @@
+#ifndef _SIMPLE_NEWTON_CPU_QUOTA_HEADER_FILE
+#define _SIMPLE_NEWTON_CPU_QUOTA_HEADER_FILE
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * How much CPU time the process may really use. Inside a container,
+ * hardware_concurrency() reports the host's CPUs, but the cgroup may
+ * pin us to a few of them (cpuset) or throttle us to a share of them
+ * (the CFS quota). Running more threads than the quota pays for gets
+ * the whole process frozen until the next period, which shows up as
+ * frame time spikes rather than as lower throughput.
+ */
+struct CpuBudget {
+	/* 1 or 2, 0 if no cgroup limits were found */
+	int cgroupVersion = 0;
+
+	/* The CFS quota in CPUs, the tightest along the hierarchy; 0 if unlimited */
+	double quota = 0;
+
+	/* CPUs of the effective cpuset, empty if unknown */
+	std::vector<int> cpuset;
+
+	/* CPUs the process may run on: its affinity, within the cpuset */
+	std::vector<std::size_t> cpus;
+
+	/* Threads that can run at once without being throttled */
+	std::size_t threads = 1;
+};
+
+/* Reads cgroup v1 or v2 limits of the calling process */
+CpuBudget detectCpuBudget();
+
+#endif // _SIMPLE_NEWTON_CPU_QUOTA_HEADER_FILE
@@ -0,0 +1,76 @@
+#ifndef _SIMPLE_NEWTON_DENSITY_RASTER_HEADER_FILE
+#define _SIMPLE_NEWTON_DENSITY_RASTER_HEADER_FILE
+
+#include <arena.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Maps simulation coordinates to pixels, the same way as
+ * ParticleSet::UpdateInfo: pixel = scale * (pos + offset).
+ */
+struct RasterView {
+	int width;
+	int height;
+	double scale;
+	double offsetX;
+	double offsetY;
+};
+
+struct RasterColor {
+	std::uint8_t r;
+	std::uint8_t g;
+	std::uint8_t b;
+};
+
+/*
+ * Software particle renderer, independent of SDL. Particles are
+ * split into blocks, and every block counts its particles into a
+ * density image of its own, so the threads never contend. The images
+ * are then summed row by row in parallel and tone mapped on a log
+ * scale into an RGBA image, ready to be uploaded as a texture or
+ * written to a file.
+ *
+ * The cost is O(N / threads) for splatting plus O(pixels) for the
+ * merge, however many particles share a pixel.
+ */
+class DensityRaster {
+	private:
+		static constexpr std::size_t maxBins = 16;
+
+		int width = 0;
+		int height = 0;
+
+		/* One density image per particle block, back to back */
+		ArenaVector<std::uint32_t> bins;
+		std::size_t nBins = 0;
+
+		ArenaVector<std::uint32_t> density;
+		std::vector<std::uint32_t> rowMax;
+		std::vector<std::uint8_t> pixels;
+
+		void resize(int width, int height, std::size_t nBins);
+		void splat(const RasterView &view, const float *x, const float *y,
+		           const float *prevX, const float *prevY, std::size_t n, float alpha);
+		void merge();
+		void toneMap(RasterColor color);
+
+	public:
+		/*
+		 * Renders n particles. With prevX and prevY, positions are
+		 * blended from there (alpha 0) to x and y (alpha 1).
+		 */
+		void render(const RasterView &view, const float *x, const float *y,
+		            const float *prevX, const float *prevY, std::size_t n, float alpha,
+		            RasterColor color);
+
+		/* RGBA, 8 bits per channel, with premultiplied alpha */
+		const std::uint8_t *data() const { return pixels.data(); }
+		int getWidth() const { return width; }
+		int getHeight() const { return height; }
+		std::size_t pitch() const { return static_cast<std::size_t>(width) * 4; }
+};
+
+#endif // _SIMPLE_NEWTON_DENSITY_RASTER_HEADER_FILE
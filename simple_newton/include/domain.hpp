@@ -0,0 +1,90 @@
+#ifndef _SIMPLE_NEWTON_DOMAIN_HEADER_FILE
+#define _SIMPLE_NEWTON_DOMAIN_HEADER_FILE
+
+#include <multipole.hpp>
+#include <transport.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * One rank's share of a distributed run (--domains). The ranks cut the
+ * Morton curve through a common square into one key range each, with
+ * the same number of particles in every range, and own the particles
+ * whose keys fall into theirs. Every step, each rank sends every other
+ * its locally essential tree (see multipole.hpp), adds the pull of what
+ * it received to the direct sum over its own particles, and hands the
+ * particles that crossed into another range to their new owner. Every
+ * REBALANCE_INTERVAL steps, the square and the ranges are fitted to
+ * where the particles are now.
+ *
+ * Rank 0 runs the application as usual and tells the others what to do
+ * next: step, gather a snapshot on rank 0, or stop. Collisions only
+ * happen between particles of the same rank.
+ */
+struct Domain {
+	/* What rank 0 tells the other ranks before each of them */
+	enum class Command : std::uint32_t {
+		STEP,
+		SNAPSHOT,
+		STOP
+	};
+
+	struct Control {
+		Command command;
+		std::int32_t width;
+		std::int32_t height;
+		double delta;
+	};
+
+	PeerMesh mesh;
+
+	/* Initial number of particles in the whole run; ids are below it */
+	std::size_t particles = 0;
+
+	/* Rank r owns the keys in [splitters[r], splitters[r + 1]) */
+	MortonFrame frame;
+	std::vector<std::uint64_t> splitters;
+
+	/* Where the particles of every rank are, as of the start of the step */
+	std::vector<BoundingBox> bounds;
+
+	MultipoleTree tree;
+	RemoteField field;
+	std::vector<PeerMesh::Buffer> outgoing;
+	std::vector<PeerMesh::Buffer> incoming;
+	/* For single messages between two ranks */
+	PeerMesh::Buffer message;
+
+	/* Keys sampled for rebalancing, and where rank 0 gathers snapshots */
+	std::vector<std::pair<std::uint64_t, double>> samples;
+	std::vector<std::uint32_t> slots;
+
+	/* Ranks rank 0 started itself, waited for after the last STOP */
+	std::vector<pid_t> workers;
+
+	Domain(const std::string &address, std::size_t rank, std::size_t ranks);
+	Domain(const Domain &) = delete;
+	Domain &operator=(const Domain &) = delete;
+
+	/* On rank 0, stops the other ranks */
+	~Domain();
+
+	/* Sent by rank 0, received by the others */
+	void command(const Control &control);
+	Control nextCommand();
+
+	/* Which rank owns a key */
+	std::size_t owner(std::uint64_t key) const;
+};
+
+/*
+ * Starts ranks 1 to ranks - 1 as copies of this executable, connecting
+ * through a Unix socket at address. They run until rank 0 stops them.
+ */
+std::vector<pid_t> spawnWorkers(const std::string &address, std::size_t ranks);
+
+#endif // _SIMPLE_NEWTON_DOMAIN_HEADER_FILE
@@ -0,0 +1,125 @@
+#ifndef _SIMPLE_NEWTON_FORCE_RING_HEADER_FILE
+#define _SIMPLE_NEWTON_FORCE_RING_HEADER_FILE
+
+#include <glm/vec2.hpp>
+#include <arena.hpp>
+#include <work_stealing.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * Splits the direct force sum over several processes (--ring), through
+ * a POSIX shared memory segment. The process that owns the particles
+ * (rank 0) copies their positions and masses into the segment every
+ * step, and every process then sums the pull on its own block of them,
+ * the i-block, from every block in turn. The j-blocks go around a ring:
+ * process p takes block p first, then p + 1, and so on, so no two
+ * processes stream the same block at once. Each j-block is copied into
+ * memory of the process's own while the one before it is summed, on a
+ * thread of its own, and the pull on the i-block goes back into the
+ * segment for rank 0 to kick with.
+ *
+ * Rank 0 creates the segment and starts the others, which map it and
+ * serve() until it goes away. Processes wait for each other on futexes
+ * in the segment. Everything throws std::runtime_error on failure,
+ * including a process that died.
+ */
+class ForceRing {
+	public:
+		struct Body {
+			glm::dvec2 pos;
+			double mass;
+		};
+
+	private:
+		struct Header;
+
+		std::size_t rank = 0;
+		std::size_t processes = 1;
+		std::size_t capacity = 0;
+		std::string name;
+
+		void *segment = nullptr;
+		std::size_t segmentSize = 0;
+		Header *header = nullptr;
+		Body *bodies = nullptr;
+		glm::dvec2 *sharedPulls = nullptr;
+		double *sharedPotentials = nullptr;
+
+		/* Started by rank 0 */
+		std::vector<pid_t> workers;
+
+		/* This process's copies of its i-block and of the j-blocks on either side of the handoff */
+		ArenaVector<Body> ownBlock;
+		ArenaVector<Body> blocks[2];
+		ArenaVector<glm::dvec2> pulls;
+		ArenaVector<double> potentials;
+
+		/* Copies the next j-block while the current one is summed */
+		std::jthread prefetcher;
+		std::atomic<std::uint32_t> prefetchRequest = 0;
+		std::atomic<std::uint32_t> prefetchDone = 0;
+		std::size_t prefetchBlock = 0;
+		ArenaVector<Body> *prefetchInto = nullptr;
+
+		static std::size_t bytesFor(std::size_t capacity);
+		void mapSegment(int fd, std::size_t bytes);
+		void layOut();
+		void stopWorkers();
+		void waitForWorkers(const std::atomic<std::uint32_t> &value, std::uint32_t expected);
+		void startPrefetcher();
+		void stopPrefetcher();
+		void copyBlock(std::size_t block, ArenaVector<Body> &into) const;
+		void computeShare();
+		void run(std::size_t n, bool measure);
+
+	public:
+		/* On rank 0: creates the segment for up to capacity particles and starts processes - 1 others */
+		ForceRing(std::size_t processes, std::size_t capacity);
+
+		/* On the others: maps the segment rank 0 created */
+		ForceRing(const std::string &name, std::size_t rank);
+
+		ForceRing(const ForceRing &) = delete;
+		ForceRing &operator=(const ForceRing &) = delete;
+
+		/* On rank 0, stops the others and waits for them */
+		~ForceRing();
+
+		/* Whether n particles fit into the segment */
+		bool fits(std::size_t n) const { return n <= capacity; }
+
+		/*
+		 * On rank 0: sums up the pull on every particle i, sum over j of
+		 * m_j * (pos_j - pos_i) / |pos_j - pos_i|^2, which is its
+		 * acceleration divided by G, and with measure, the potential,
+		 * sum of m_j * ln(|pos_j - pos_i|^2). Coincident pairs add
+		 * nothing. pos(i) and mass(i) must return the glm::dvec2
+		 * position and the mass of particle i.
+		 */
+		template <class PosFn, class MassFn>
+		void evaluate(std::size_t n, bool measure, PosFn &&pos, MassFn &&mass)
+		{
+			stealPool.parallelFor(0, n, 4096, [&](std::size_t start, std::size_t end) {
+				for (std::size_t i = start; i < end; i++)
+					bodies[i] = Body { pos(i), mass(i) };
+			});
+			run(n, measure);
+		}
+
+		/* The results of the last evaluate() */
+		const glm::dvec2 *pull() const { return sharedPulls; }
+		const double *potential() const { return sharedPotentials; }
+
+		/* On the other processes: computes their share of every step until rank 0 stops them */
+		void serve();
+};
+
+#endif // _SIMPLE_NEWTON_FORCE_RING_HEADER_FILE
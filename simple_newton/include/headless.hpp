@@ -0,0 +1,107 @@
+#ifndef _SIMPLE_NEWTON_HEADLESS_HEADER_FILE
+#define _SIMPLE_NEWTON_HEADLESS_HEADER_FILE
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Blocking queue between the stages of the headless renderer. Unlike
+ * the triple buffer used on screen, nothing is ever skipped: a full
+ * pipeline holds the simulation back instead. The items live in a
+ * ring of fixed capacity, so passing them along never allocates.
+ */
+template <class T>
+class StageQueue {
+	private:
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::vector<T> items;
+		std::size_t head = 0;
+		std::size_t count = 0;
+
+	public:
+		explicit StageQueue(std::size_t capacity):
+			items(capacity) {}
+
+		/* Waits for a free place if the queue is full */
+		void push(T item)
+		{
+			{
+				std::unique_lock lock(mutex);
+				cond.wait(lock, [this] { return count < items.size(); });
+				items[(head + count) % items.size()] = std::move(item);
+				count++;
+			}
+			cond.notify_all();
+		}
+
+		T pop()
+		{
+			T item;
+			{
+				std::unique_lock lock(mutex);
+				cond.wait(lock, [this] { return count > 0; });
+				item = std::move(items[head]);
+				head = (head + 1) % items.size();
+				count--;
+			}
+			cond.notify_all();
+			return item;
+		}
+};
+
+/*
+ * Writes rendered frames, either as numbered images (the index goes in
+ * front of the extension: out.png becomes out000000.png, out000001.png,
+ * ...) or, for a .y4m path, as a single YUV4MPEG2 stream that video
+ * tools read directly. Images are binary PPM, or PNG for a .png path.
+ */
+class FrameWriter {
+	public:
+		enum Format {
+			FORMAT_PPM,
+			FORMAT_PNG,
+			FORMAT_Y4M
+		};
+
+	private:
+		std::string path;
+		Format format;
+		int width;
+		int height;
+		int fps;
+		std::FILE *stream = nullptr;
+		std::vector<std::uint8_t> buffer;
+		std::string fname;
+
+		const std::string &framePath(std::size_t index);
+		void writeFile(const std::string &fname, const std::vector<std::uint8_t> &data) const;
+		void encodePPM(const std::uint8_t *rgb);
+		void encodePNG(const std::uint8_t *rgb);
+		void encodeY4M(const std::uint8_t *rgb);
+
+	public:
+		/* Throws std::runtime_error if a video stream can't be created */
+		FrameWriter(const std::string &path, int width, int height, int fps);
+		FrameWriter(const FrameWriter &) = delete;
+		FrameWriter &operator=(const FrameWriter &) = delete;
+
+		/* rgb is width * height * 3 bytes. Throws std::runtime_error. */
+		void write(std::size_t index, const std::uint8_t *rgb);
+
+		/*
+		 * Flushes and closes a video stream. Throws std::runtime_error
+		 * if the last frames couldn't be written; the destructor can't.
+		 */
+		void close();
+
+		~FrameWriter();
+};
+
+#endif // _SIMPLE_NEWTON_HEADLESS_HEADER_FILE
@@ -0,0 +1,31 @@
+#ifndef _SIMPLE_NEWTON_INITIAL_CONDITIONS_HEADER_FILE
+#define _SIMPLE_NEWTON_INITIAL_CONDITIONS_HEADER_FILE
+
+#include <cstdint>
+#include <string_view>
+
+/*
+ * Starting layouts for a new simulation. Every particle draws its
+ * numbers from a counter-based generator keyed by (seed, index), so
+ * particles are generated in parallel and the result is bit-identical
+ * for a given seed however many threads the pool has.
+ *
+ * Velocities are chosen for this simulation's 2D force law, under
+ * which the pull of a ring of mass on anything outside it is the same
+ * as that of a point mass in its centre.
+ */
+enum class InitialConditions {
+	/* At rest, spread evenly over the middle third of the window */
+	UNIFORM_BOX,
+	/* Projected Plummer profile with random, roughly virialised velocities */
+	PLUMMER,
+	/* Exponential disk on circular orbits, with a little dispersion */
+	EXPONENTIAL_DISK,
+	/* Two disks on a collision course, half of the particles each */
+	COLLIDING_GALAXIES
+};
+
+/* Accepts "box", "plummer", "disk" and "galaxies" */
+bool parseInitialConditions(std::string_view name, InitialConditions &out);
+
+#endif // _SIMPLE_NEWTON_INITIAL_CONDITIONS_HEADER_FILE
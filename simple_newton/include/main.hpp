@@ -5,7 +5,22 @@
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include <glm/geometric.hpp>
+#include <glm/common.hpp>
 #include <BS_thread_pool.hpp>
+#include <arena.hpp>
+#include <alloc_counter.hpp>
+#include <work_stealing.hpp>
+#include <worker_team.hpp>
+#include <numa.hpp>
+#include <affinity.hpp>
+#include <spatial_grid.hpp>
+#include <triple_buffer.hpp>
+#include <trajectory.hpp>
+#include <initial_conditions.hpp>
+#include <density_raster.hpp>
+#include <headless.hpp>
+#include <domain.hpp>
+#include <force_ring.hpp>
 
 #include <iostream>
 #include <random>
@@ -13,11 +28,21 @@
 #include <atomic>
 #include <sstream>
 #include <functional>
+#include <chrono>
+#include <limits>
+#include <charconv>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+
+extern BS::thread_pool<> threadPool;
 
 /*
  * The number of particles in the simulation.
  */
+#ifndef NUM_PARTICLES
 #define NUM_PARTICLES (3e4)
+#endif
 
 /*
  * The lowest possible particle mass.
@@ -29,6 +54,14 @@
  */
 #define MASS_HIGH (1e9)
 
+/*
+ * How new simulations are laid out, unless overridden with --initial,
+ * see initial_conditions.hpp. A seed of 0 draws a fresh one every run;
+ * any other (or --seed) makes the starting state reproducible.
+ */
+#define INITIAL_CONDITIONS (InitialConditions::UNIFORM_BOX)
+#define INITIAL_SEED (0)
+
 /*
  * Determines whether the particles collide with the walls.
  */
@@ -40,12 +73,197 @@
  */
 #define WALL_ABSORB (0.1)
 
+/*
+ * Particle-particle collisions. Particles closer than twice
+ * COLLISION_RADIUS collide, found every step through a spatial hash
+ * grid. With COLLISION_MERGE they merge into a single particle that
+ * keeps their mass and momentum, so N shrinks over long runs.
+ * Otherwise they bounce off each other, keeping COLLISION_RESTITUTION
+ * of the speed they approached with.
+ */
+#define PARTICLE_COLLISION (false)
+#define COLLISION_RADIUS (0.5)
+#define COLLISION_MERGE (true)
+#define COLLISION_RESTITUTION (1.0)
+
 /*
  * Increase this to increase the timestep of the simulation (this
  * will decrease the precision)
  */
 #define TIMESTEP (6)
 
+/*
+ * Multiple time stepping (RESPA). Pairs closer than RESPA_CUTOFF are
+ * integrated every step, found through a spatial grid. Everything
+ * further away only changes slowly, so it is evaluated once every
+ * RESPA_INTERVAL steps and applied as a single, scaled kick.
+ * An interval of 1 evaluates the full force every step.
+ */
+#define RESPA_INTERVAL (1)
+
+/*
+ * The near/far split distance. The split is smoothed over the outer
+ * RESPA_SMOOTHING fraction of the cutoff so no pair sees a sudden jump
+ * in force when it crosses it.
+ */
+#define RESPA_CUTOFF (40.0)
+#define RESPA_SMOOTHING (0.2)
+
+/*
+ * Steps with up to TEAM_PARTICLES particles run on a persistent team of
+ * threads that each take a fixed share, meeting at a spinning barrier
+ * between phases. At that size a step is over in microseconds, and
+ * handing out tasks and waking threads would cost more than the
+ * arithmetic. Larger steps go through the work-stealing pool. 0 always
+ * uses the pool.
+ */
+#define TEAM_PARTICLES (5000)
+
+/*
+ * Particle arrays and the scratch space of a step come from the arena
+ * in arena.hpp, aligned to cache lines. With HUGE_PAGES, the ones of
+ * 2 MB and up are also backed by huge pages, which saves multi-million
+ * particle runs most of their TLB misses.
+ */
+#define HUGE_PAGES (true)
+
+/*
+ * On machines with more than one NUMA node, every member of the worker
+ * team is bound to a node, each member's share of the particle arrays
+ * is moved to its node, and steps run on the team: a member works on
+ * its own share first, then helps out on its node, and only then on
+ * the others, so the thread stepping a particle mostly sits next to its
+ * memory and clusters still balance out. How many pages ended up local
+ * is printed after the first placement. Single-node machines are left
+ * alone.
+ */
+#define NUMA_PLACEMENT (true)
+
+/*
+ * Pin every thread that steps particles to a logical CPU of its own,
+ * so the scheduler can't move it away from its caches. With
+ * PHYSICAL_CORES_ONLY, they get one per physical core and the SMT
+ * siblings stay idle: siblings share the FP units the force kernel
+ * lives on. RESERVE_RENDER_CORE keeps a core, with its siblings, for
+ * the render/event thread and the headless stages. The pools are sized
+ * to the CPUs that are left. All off by default, since they take
+ * threads away on SMT machines; turn them on for dedicated machines.
+ */
+#define PIN_THREADS (false)
+#define PHYSICAL_CORES_ONLY (false)
+#define RESERVE_RENDER_CORE (false)
+
+/*
+ * Steps per second the simulation thread is held to. Set to 0 to step
+ * as fast as possible. When it falls behind, up to MAX_SUBSTEPS steps
+ * are batched before the next snapshot is published, and the renderer
+ * interpolates between the last two steps so motion stays smooth at
+ * any display rate.
+ */
+#define SIMULATION_RATE (0)
+#define MAX_SUBSTEPS (8)
+
+/*
+ * Draw by splatting the particles into a density image on all cores
+ * and uploading that as a single texture, rather than handing SDL
+ * every particle as a point. Crowded regions come out brighter, on a
+ * log scale.
+ */
+#define SPLAT_RENDERING (true)
+
+/*
+ * Without SPLAT_RENDERING, particles are culled to the window and drawn
+ * as points, unless there are more of them on screen than there are
+ * LOD_CELL x LOD_CELL pixel cells. Then every occupied cell is drawn as
+ * a single quad instead, brighter the more particles it holds, so the
+ * geometry sent to SDL depends on the window size, not on N.
+ */
+#define LOD_CELL (2)
+
+/*
+ * Every DIAGNOSTICS_INTERVAL steps, the pair loop also sums up the
+ * potential energy, and the total energy, linear momentum and angular
+ * momentum are printed. Energy drift shows whether a larger TIMESTEP
+ * or an approximate solver is still accurate enough. Only the steps
+ * that measure pay for it. 0 turns diagnostics off.
+ */
+#define DIAGNOSTICS_INTERVAL (100)
+
+/*
+ * Count heap allocations, see alloc_counter.hpp. With --render, the
+ * allocations made once the pipeline has warmed up are printed at the
+ * end, and any at all make it exit with a failure: a steady-state step
+ * allocates nothing, and neither does rasterizing or encoding a frame.
+ * Off by default, since it replaces the global operator new; the
+ * steady_state_allocations tests build with it on.
+ *
+ * That holds for a single process. A distributed run (--domains) only
+ * counts rank 0, and its per-rank arrays and messages still grow when a
+ * rank's share of the particles or of the tree reaches a new high, so
+ * it isn't held to zero.
+ */
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS (false)
+#endif
+
+/*
+ * Distributed runs (--domains, see domain.hpp). Every
+ * REBALANCE_INTERVAL steps, the ranks' key ranges are fitted to where
+ * the particles went. Remote cells are expanded to MULTIPOLE_ORDER
+ * terms, and used for ranks they look smaller than MULTIPOLE_THETA
+ * from; leaves of the trees hold up to MULTIPOLE_LEAF particles.
+ */
+#define REBALANCE_INTERVAL (50)
+#define MULTIPOLE_ORDER (10)
+#define MULTIPOLE_THETA (0.5)
+#define MULTIPOLE_LEAF (16)
+
+/*
+ * Where F5 saves and F9 restores the simulation state, unless
+ * overridden with --checkpoint.
+ */
+#define CHECKPOINT_FNAME "simple_newton.ckpt"
+
+/*
+ * With --record, every TRAJECTORY_INTERVAL-th step is streamed to disk.
+ * TRAJECTORY_BUFFERS frames can be waiting on the disk at once before
+ * further frames are dropped.
+ */
+#define TRAJECTORY_INTERVAL (10)
+#define TRAJECTORY_BUFFERS (8)
+
+/*
+ * Bits per coordinate that recorded positions are quantized to, with a
+ * keyframe every TRAJECTORY_KEYFRAME_INTERVAL frames and bit-packed
+ * offsets from it in between. 0 records the full state (positions,
+ * velocities and masses) as raw doubles instead.
+ */
+#define TRAJECTORY_BITS (16)
+#define TRAJECTORY_KEYFRAME_INTERVAL (30)
+
+/*
+ * With --replay, recorded frames shown per second at 1x speed, and how
+ * many frames the arrow keys seek while playing. While paused they
+ * step a single frame.
+ */
+#define REPLAY_FPS (30)
+#define REPLAY_SEEK (150)
+
+/*
+ * With --render, the simulation runs without a window, and every
+ * RENDER_INTERVAL-th step becomes a RENDER_WIDTH x RENDER_HEIGHT frame,
+ * RENDER_FRAMES of them unless --frames says otherwise. Frames are
+ * rasterized and encoded on threads of their own while the simulation
+ * carries on, with up to RENDER_QUEUE frames in flight. Y4M video
+ * plays at RENDER_FPS.
+ */
+#define RENDER_WIDTH (1280)
+#define RENDER_HEIGHT (720)
+#define RENDER_INTERVAL (1)
+#define RENDER_FRAMES (300)
+#define RENDER_QUEUE (4)
+#define RENDER_FPS (30)
+
 struct SDLError {
 	mutable std::string msg;
 	template <class T>
@@ -59,6 +277,21 @@ struct SDLError {
 	}
 };
 
+/*
+ * Conserved quantities, as of the start of a measured step.
+ * For this integrator (veloc += accel, pos += veloc * delta)
+ * the energy that is conserved is
+ *   sum of m * delta * |veloc|^2 / 2 + sum over pairs of G * m1 * m2 * ln(R)
+ */
+struct Diagnostics {
+	std::size_t step = 0;
+	double kinetic = 0;
+	double potential = 0;
+	glm::dvec2 momentum = glm::dvec2(0, 0);
+	double angularMomentum = 0;
+	bool valid = false;
+};
+
 class ParticleSet {
 	private:
 		struct ParticleInfo {
@@ -67,11 +300,88 @@ class ParticleSet {
 			double mass;
 		};
 
-		/* Positions stored here */
+		/* Projected positions and the splat renderer, only touched by draw() */
 		std::vector<SDL_FPoint> points;
-		std::vector<ParticleInfo> infos;
+		std::vector<std::size_t> visibleCounts;
+		DensityRaster raster;
+		std::vector<SDL_Vertex> lodVertices;
+		std::vector<int> lodIndices;
+		std::unique_ptr<SDL_Texture, decltype(&SDL_DestroyTexture)> texture { nullptr, SDL_DestroyTexture };
+		int textureWidth = 0;
+		int textureHeight = 0;
+		ArenaVector<ParticleInfo> infos;
+
+		SpatialGrid grid;
+		std::size_t stepCount = 0;
+
+		/* Index each particle had when the set was created or imported, kept by checkpoints */
+		ArenaVector<std::uint32_t> ids;
+
+		/* Per-particle and per-block diagnostics terms, summed in a fixed order */
+		struct DiagnosticTerms {
+			double kinetic;
+			double potential;
+			glm::dvec2 momentum;
+			double angularMomentum;
+		};
+		ArenaVector<DiagnosticTerms> diagnosticTerms;
+		ArenaVector<DiagnosticTerms> diagnosticBlocks;
+		Diagnostics diagnostics;
+		void sumDiagnostics(std::size_t step);
+
+		/* Collision scratch space, see collision.cpp */
+		ArenaVector<std::uint32_t> mergeInto;
+		ArenaVector<std::uint32_t> contactCounts;
+		ArenaVector<glm::dvec2> collisionKicks;
+
+		/*
+		 * Particles to keep at the next compact(), plus what it
+		 * gathers into. The spare vectors swap places with the live
+		 * ones, so their capacity is reused from step to step.
+		 */
+		ArenaVector<std::uint8_t> alive;
+		ArenaVector<std::size_t> aliveCounts;
+		ArenaVector<ParticleInfo> spareInfos;
+		ArenaVector<std::uint32_t> spareIds;
+
+		/*
+		 * Where the particle array was first placed over the NUMA
+		 * nodes, and the last blocks it was placed in (the live one and
+		 * the spare that compact() swaps in), with the particle count
+		 * their ranges were cut for. See numa.cpp.
+		 */
+		NumaReport numaReport;
+		struct PlacedBlock {
+			const void *data = nullptr;
+			std::size_t capacity = 0;
+			std::size_t count = 0;
+		};
+		PlacedBlock placedBlocks[2];
+
+		/*
+		 * The rank's share of a distributed run, and the pull of the
+		 * other ranks' particles on this one's, divided by G (and
+		 * their potential, on measured steps). See domain.cpp.
+		 */
+		std::unique_ptr<Domain> domain;
+		ArenaVector<glm::dvec2> remoteAccels;
+		ArenaVector<double> remotePotentials;
+
+		/* Sums the direct force over several processes instead, see force_ring.hpp */
+		std::unique_ptr<ForceRing> ring;
+
+		void exchangeBounds();
+		void rebalance();
+		void migrate();
+
+		void collide();
+		void resetIds();
+		void compact();
+		void placeParticles();
 
 	public:
+		static constexpr RasterColor particleColor { 255, 0, 100 };
+
 		struct UpdateInfo {
 			glm::dvec2 camPos;
 			double camScale;
@@ -80,36 +390,238 @@ class ParticleSet {
 			int height;
 		};
 
-		ParticleSet(std::size_t nParticles, int width, int height);
+		/*
+		 * Positions as of a given step, handed from the simulation
+		 * thread to the render thread.
+		 */
+		struct Snapshot {
+			std::vector<float> x;
+			std::vector<float> y;
+			std::size_t step = 0;
+
+			/* Only filled with a fixed SIMULATION_RATE */
+			std::vector<float> prevX;
+			std::vector<float> prevY;
+			std::chrono::steady_clock::time_point time;
+		};
+
+		ParticleSet() = default;
+		ParticleSet(std::size_t nParticles, int width, int height,
+		            InitialConditions kind, std::uint64_t seed);
+
+		/*
+		 * Only particles first to last of the nParticles the above
+		 * would make, with ids from first on.
+		 */
+		ParticleSet(std::size_t nParticles, std::size_t first, std::size_t last, int width, int height,
+		            InitialConditions kind, std::uint64_t seed);
 		void updateParticles(const UpdateInfo &updateInfo);
-		void draw(SDL_Renderer *render);
+
+		/* In a distributed run, rank 0 gathers every rank's particles */
+		void snapshot(Snapshot &out) const;
+
+		/*
+		 * Makes this set one rank of a distributed run. On the other
+		 * ranks, serveDomain() then follows rank 0's lead until it
+		 * stops them.
+		 */
+		void attachDomain(std::unique_ptr<Domain> domain);
+		void serveDomain();
+
+		/* Hands the pair sums to a ring of processes from now on */
+		void attachRing(std::unique_ptr<ForceRing> ring);
+
+		/*
+		 * Binary checkpoints, see checkpoint.hpp. Both throw
+		 * std::runtime_error on failure.
+		 */
+		void save(const std::string &fname) const;
+		void restore(const std::string &fname);
+
+		/*
+		 * Loads particles from a text or raw binary file written by
+		 * other tools, see particle_import.hpp. Throws
+		 * std::runtime_error on failure, leaving the set unchanged.
+		 */
+		void importFrom(const std::string &fname);
+
+		/* Hands the current state to the writer as one trajectory frame */
+		void record(TrajectoryWriter &writer) const;
+
+		std::size_t getNum() const;
+		std::size_t getStep() const;
+
+		const Diagnostics &getDiagnostics() const;
+		const NumaReport &getNumaReport() const;
+
+		/*
+		 * Projects a snapshot into screen space with the given camera,
+		 * in parallel, dropping everything outside the window. Returns
+		 * how many points were kept; they are at the front of
+		 * projected(). Like draw(), never touches the simulation state.
+		 */
+		std::size_t project(const Snapshot &snapshot, const UpdateInfo &camera, double alpha = 1.0);
+		const SDL_FPoint *projected() const { return points.data(); }
+
+		/*
+		 * Doesn't read the simulation state, so it is safe to call
+		 * while another thread is in updateParticles(). alpha blends
+		 * from the previous (0) to the latest (1) step in the snapshot.
+		 */
+		void draw(SDL_Renderer *render, const Snapshot &snapshot, const UpdateInfo &camera, double alpha = 1.0);
+
+	private:
+		void stepLocal(const UpdateInfo &updateInfo);
+		void stepDomain(const UpdateInfo &updateInfo);
+		void gatherSnapshot(Snapshot *out) const;
+};
+
+struct Options {
+	std::string checkpoint = CHECKPOINT_FNAME;
+	bool restore = false;
+	std::string record;
+	std::string replay;
+	std::string importFile;
+	InitialConditions initial = INITIAL_CONDITIONS;
+	std::uint64_t seed = INITIAL_SEED;
+	std::string render;
+	std::size_t frames = RENDER_FRAMES;
+
+	/* Ranks of a distributed run, this process's, and where rank 0 listens */
+	std::size_t domains = 1;
+	std::size_t rank = 0;
+	std::string peers;
+
+	/* Processes summing the forces, and the segment the others map */
+	std::size_t ring = 1;
+	std::string ringSegment;
 };
 
+/*
+ * The particles a run starts with: restored from the checkpoint,
+ * imported, or generated to fit a width x height view. With --ring,
+ * the force ring is started for them.
+ */
+ParticleSet initialParticles(const Options &options, int width, int height);
+
+/*
+ * This process's share of a distributed run, see domain.hpp. Rank 0
+ * starts the other ranks itself unless options.peers is set, and
+ * tells them the seed and the size of the view.
+ */
+ParticleSet distributedParticles(const Options &options, std::uint64_t seed, int width, int height);
+
 class SimpleNewtonApp {
 	private:
 		SDL_Window *window;
-		int width;
-		int height;
+		std::atomic<int> width;
+		std::atomic<int> height;
 
 		SDL_Renderer *render;
 		bool running;
 
+		/* Written by the simulation thread, read by the render thread */
+		TripleBuffer<ParticleSet::Snapshot> snapshots;
+
+		Options options;
+
+		/*
+		 * Set by the simulation thread when a step throws (a lost peer
+		 * of a distributed run, or a dead force ring process), so the
+		 * render thread stops and reports it.
+		 */
+		std::atomic<bool> simulationFailed = false;
+		std::exception_ptr simulationError;
+
+		/* Set by the render thread, serviced by the simulation thread between steps */
+		std::atomic<bool> saveRequested = false;
+		std::atomic<bool> restoreRequested = false;
+
+		std::unique_ptr<TrajectoryWriter> recorder;
+
+		/* Step of the last diagnostics printed, and the energy drift is measured from */
+		std::size_t reportedStep = std::numeric_limits<std::size_t>::max();
+		double initialEnergy = std::numeric_limits<double>::quiet_NaN();
+
+		/* Whether the NUMA placement was printed */
+		bool numaReported = false;
+
 		glm::dvec2 camPos = glm::dvec2(0.0);
 		double camScale = 1.0;
 
+		/* Playback controls; paused also holds the live simulation */
+		std::atomic<bool> paused = false;
+		double playbackSpeed = 1.0;
+		double seekFrames = 0.0;
+
+		ParticleSet::UpdateInfo cameraInfo() const;
 		void calcScale(const SDL_Event &event);
 		void calcMove(const SDL_Event &event);
+		void handleKey(SDL_Keycode key);
 		void handleEvents();
+		bool serviceCheckpoints(ParticleSet &particleSet);
+		void reportDiagnostics(const Diagnostics &diagnostics);
+		void step(ParticleSet &particleSet, const ParticleSet::UpdateInfo &info);
+		void simulateSteps(std::stop_token stop, ParticleSet &particleSet);
+		void simulate(std::stop_token stop, ParticleSet &particleSet);
 
 	public:
+		static constexpr RasterColor backgroundColor { 10, 0, 20 };
+
 		SimpleNewtonApp(const SimpleNewtonApp &) = delete;
 		SimpleNewtonApp(SimpleNewtonApp &&) = delete;
 
-		SimpleNewtonApp(std::string_view title, int width, int height);
+		SimpleNewtonApp(std::string_view title, int width, int height, const Options &options);
 
+		/* Throws std::runtime_error if the simulation fails */
 		void loop();
 
+		/* Plays back a recording made with --record instead of simulating */
+		void replay();
+
 		~SimpleNewtonApp();
 };
 
+/*
+ * Runs the simulation with no window, or SDL video at all, and writes
+ * frames to files (see FrameWriter). Frame slots cycle from the
+ * simulation to the raster thread, on to the encoder thread and back,
+ * so both stages overlap with the following steps.
+ */
+class HeadlessRenderer {
+	private:
+		struct Frame {
+			std::size_t index = 0;
+			ParticleSet::Snapshot snapshot;
+			std::vector<std::uint8_t> rgb;
+		};
+
+		Options options;
+		int width;
+		int height;
+
+		/* nullptr marks the end of the run */
+		std::vector<Frame> frames;
+		StageQueue<Frame *> freeFrames;
+		StageQueue<Frame *> rasterQueue;
+		StageQueue<Frame *> encodeQueue;
+
+		std::atomic<bool> failed = false;
+		std::exception_ptr error;
+
+		void rasterize();
+		void encode(FrameWriter &writer);
+
+	public:
+		explicit HeadlessRenderer(const Options &options);
+
+		/*
+		 * Throws std::runtime_error if a frame can't be written or a
+		 * step fails (a lost peer of a distributed run, or a dead
+		 * force ring process). With COUNT_ALLOCATIONS, returns false
+		 * if anything allocated once the pipeline warmed up.
+		 */
+		bool run();
+};
+
 #endif // _SIMPLE_NEWTON_MAIN_HEADER_FILE
@@ -0,0 +1,132 @@
+#ifndef _SIMPLE_NEWTON_MULTIPOLE_HEADER_FILE
+#define _SIMPLE_NEWTON_MULTIPOLE_HEADER_FILE
+
+#include <glm/vec2.hpp>
+#include <arena.hpp>
+#include <transport.hpp>
+
+#include <complex>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+ * The square every rank of a distributed run cuts its cells and
+ * domains from, so the same Morton key means the same place on all of
+ * them. Positions outside of it are clamped onto its edge.
+ */
+struct MortonFrame {
+	glm::dvec2 origin = glm::dvec2(0, 0);
+	double size = 1;
+
+	/* 31 bits per axis, x in the even bits, y in the odd ones */
+	std::uint64_t key(const glm::dvec2 &pos) const;
+};
+
+/* Axis-aligned bounds of a set of positions */
+struct BoundingBox {
+	glm::dvec2 lo = glm::dvec2(0, 0);
+	glm::dvec2 hi = glm::dvec2(0, 0);
+	bool empty = true;
+
+	void add(const glm::dvec2 &pos);
+	void add(const BoundingBox &other);
+	double distance(const glm::dvec2 &pos) const;
+};
+
+/*
+ * Quadtree over the particles of one rank, cut along Morton keys, with
+ * a multipole expansion of every cell. With the 2D force law, the pull
+ * of a cell with centre c on a point w outside of it is an exact power
+ * series in complex numbers:
+ *
+ *   sum of m / (w - z) = sum over k of Q_k / (w - c)^(k + 1),
+ *   where Q_k = sum of m * (z - c)^k
+ *
+ * and the acceleration is G times the complex conjugate of minus that.
+ * MULTIPOLE_ORDER terms after Q_0 are kept. Leaves get their moments
+ * from their particles, every other cell from its children's, shifted.
+ *
+ * A rank sends every other one its "locally essential" part of the
+ * tree: the coarsest cells that look small from anywhere in the
+ * other's bounds (radius under MULTIPOLE_THETA times the distance),
+ * and the particles of the leaves that never do.
+ */
+class MultipoleTree {
+	private:
+		struct Node {
+			glm::dvec2 centre;
+			double halfSize;
+			/* Furthest particle from the centre */
+			double radius;
+			std::uint32_t first;
+			std::uint32_t count;
+			std::uint32_t firstChild;
+			std::uint32_t nChildren;
+		};
+
+		std::vector<Node> nodes;
+		ArenaVector<std::complex<double>> moments;
+
+		/* The particles in key order */
+		ArenaVector<std::pair<std::uint64_t, std::uint32_t>> sortedKeys;
+		ArenaVector<glm::dvec2> positions;
+		ArenaVector<double> masses;
+
+		void sortKeys();
+		void finish(const MortonFrame &frame);
+		void split(std::size_t node, int level);
+		void leafMoments(std::size_t node);
+		void shiftMoments(std::size_t child, std::size_t parent);
+		void walk(std::size_t node, const BoundingBox &bounds, bool cells, PeerMesh::Buffer &out, std::uint64_t &count) const;
+
+	public:
+		/*
+		 * pos(i) and mass(i) must return the glm::dvec2 position and
+		 * the mass of particle i.
+		 */
+		template <class PosFn, class MassFn>
+		void build(const MortonFrame &frame, std::size_t n, PosFn &&pos, MassFn &&mass)
+		{
+			resizeWithSlack(sortedKeys, n);
+			for (std::size_t i = 0; i < n; i++)
+				sortedKeys[i] = { frame.key(pos(i)), static_cast<std::uint32_t>(i) };
+			sortKeys();
+
+			resizeWithSlack(positions, n);
+			resizeWithSlack(masses, n);
+			for (std::size_t i = 0; i < n; i++) {
+				positions[i] = pos(sortedKeys[i].second);
+				masses[i] = mass(sortedKeys[i].second);
+			}
+			finish(frame);
+		}
+
+		/* Appends what a rank with particles within bounds needs to the message */
+		void essentialFor(const BoundingBox &bounds, PeerMesh::Buffer &out) const;
+};
+
+/*
+ * The pull of everything that the other ranks sent, as messages
+ * written by MultipoleTree::essentialFor().
+ */
+class RemoteField {
+	private:
+		/* Centre, then (re, im) of every moment */
+		ArenaVector<double> cells;
+		/* x, y and mass */
+		ArenaVector<double> points;
+
+	public:
+		void clear();
+		void add(const PeerMesh::Buffer &message);
+
+		/*
+		 * The sum of m * (z - pos) / |z - pos|^2 over all the mass
+		 * received, which is the acceleration divided by G, and with
+		 * potential, the sum of m * ln(|z - pos|^2).
+		 */
+		glm::dvec2 pull(const glm::dvec2 &pos, double *potential) const;
+};
+
+#endif // _SIMPLE_NEWTON_MULTIPOLE_HEADER_FILE
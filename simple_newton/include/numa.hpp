@@ -0,0 +1,66 @@
+#ifndef _SIMPLE_NEWTON_NUMA_HEADER_FILE
+#define _SIMPLE_NEWTON_NUMA_HEADER_FILE
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Where the pages of the particle array ended up, counted right after
+ * it was first placed: on the node of the team member that owns them,
+ * elsewhere, or unknown (not resident, or the kernel won't say).
+ */
+struct NumaReport {
+	/* Bumped every time a block of particles is placed */
+	std::size_t placement = 0;
+	std::size_t nodes = 1;
+	std::size_t localPages = 0;
+	std::size_t remotePages = 0;
+	std::size_t unknownPages = 0;
+};
+
+/*
+ * The machine's NUMA nodes and their CPUs, read from sysfs. Machines
+ * and kernels without NUMA look like a single node.
+ */
+class NumaTopology {
+	private:
+		std::vector<int> ids;
+		std::vector<std::vector<int>> cpus;
+		std::size_t page = 4096;
+
+	public:
+		NumaTopology();
+
+		std::size_t nodes() const { return ids.size(); }
+		std::size_t pageSize() const { return page; }
+
+		/* The node a logical CPU belongs to, 0 if it isn't listed */
+		std::size_t nodeOfCpu(std::size_t cpu) const;
+
+		/* Unpinned team members are spread over the nodes in contiguous groups */
+		std::size_t nodeOfMember(std::size_t member, std::size_t teamSize) const
+		{
+			return member * nodes() / teamSize;
+		}
+
+		/* Keeps the calling thread on the node's CPUs; false if that failed */
+		bool bindThread(std::size_t node) const;
+
+		/*
+		 * Moves the pages in [pages, pages + bytes) to the node, and has
+		 * the ones not touched yet allocated there. Both ends must be
+		 * page aligned. Best effort; false if the kernel refused.
+		 */
+		bool place(const void *pages, std::size_t bytes, std::size_t node) const;
+
+		/* Adds up where the pages in [pages, pages + bytes) are, relative to node */
+		void count(const void *pages, std::size_t bytes, std::size_t node, NumaReport &report) const;
+};
+
+const NumaTopology &numaTopology();
+
+/* Parses a kernel CPU list such as "0-3,8-11" */
+std::vector<int> parseCpuList(const std::string &list);
+
+#endif // _SIMPLE_NEWTON_NUMA_HEADER_FILE
@@ -0,0 +1,30 @@
+#ifndef _SIMPLE_NEWTON_PARTICLE_IMPORT_HEADER_FILE
+#define _SIMPLE_NEWTON_PARTICLE_IMPORT_HEADER_FILE
+
+#include <cstddef>
+#include <string_view>
+
+/*
+ * Formats ParticleSet::importFrom() accepts, picked by file extension:
+ *
+ *   .bin, .raw    ImportRecords back to back, native byte order
+ *   anything else text, one particle per line: x y vx vy mass
+ *
+ * Text columns may be separated by any mix of commas, spaces and tabs.
+ * Blank lines and lines starting with '#' are skipped, and so is the
+ * first line if it doesn't start with a number (a CSV header).
+ */
+struct ImportRecord {
+	double x;
+	double y;
+	double vx;
+	double vy;
+	double mass;
+};
+
+/* Text is parsed in chunks of about this size, split at line ends */
+static constexpr std::size_t importChunkSize = std::size_t(1) << 22;
+
+bool isBinaryImport(std::string_view fname);
+
+#endif // _SIMPLE_NEWTON_PARTICLE_IMPORT_HEADER_FILE
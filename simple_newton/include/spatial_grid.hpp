@@ -0,0 +1,107 @@
+#ifndef _SIMPLE_NEWTON_SPATIAL_GRID_HEADER_FILE
+#define _SIMPLE_NEWTON_SPATIAL_GRID_HEADER_FILE
+
+#include <glm/vec2.hpp>
+#include <arena.hpp>
+#include <work_stealing.hpp>
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+ * A uniform grid hashed into a fixed number of buckets, rebuilt from
+ * scratch every step. Particles are bucketed with a parallel counting
+ * sort, and every bucket is kept sorted by particle index so that
+ * anything summed over neighbours comes out the same on every run.
+ *
+ * Different cells may share a bucket, so callers must still check the
+ * distance of everything forEachNear() hands them.
+ */
+class SpatialGrid {
+	private:
+		/* Particles per range handed to the pool */
+		static constexpr std::size_t buildGrain = 2048;
+
+		double cellSize = 1.0;
+		std::size_t mask = 0;
+
+		ArenaVector<std::uint32_t> cellOf;
+		ArenaVector<std::uint32_t> bucketStart;
+		ArenaVector<std::uint32_t> sorted;
+
+		/* Bumped from many threads at once, through std::atomic_ref */
+		ArenaVector<std::uint32_t> counts;
+
+		static std::uint32_t hashCell(std::int64_t cx, std::int64_t cy)
+		{
+			const std::uint64_t h =
+				static_cast<std::uint64_t>(cx) * 0x9E3779B185EBCA87ull ^
+				static_cast<std::uint64_t>(cy) * 0xC2B2AE3D27D4EB4Full;
+			return static_cast<std::uint32_t>(h >> 32);
+		}
+
+		std::int64_t cellCoord(double v) const
+		{
+			/* Escaped particles must not overflow the conversion */
+			const double c = std::floor(v / cellSize);
+			return static_cast<std::int64_t>(c > 0x1p52 ? 0x1p52 : (c < -0x1p52 ? -0x1p52 : c));
+		}
+
+		void resize(std::size_t n);
+		void scatter(std::size_t n);
+
+	public:
+		/*
+		 * pos(i) must return the glm::dvec2 position of particle i.
+		 */
+		template <class PosFn>
+		void build(std::size_t n, double cellSize, PosFn &&pos)
+		{
+			this->cellSize = cellSize;
+			resize(n);
+
+			stealPool.parallelFor(0, n, buildGrain, [&](std::size_t start, std::size_t end) {
+				for (std::size_t i = start; i < end; i++) {
+					const glm::dvec2 p = pos(i);
+					const std::uint32_t bucket = hashCell(cellCoord(p.x), cellCoord(p.y)) & mask;
+					cellOf[i] = bucket;
+					std::atomic_ref<std::uint32_t>(counts[bucket]).fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+
+			scatter(n);
+		}
+
+		/*
+		 * Calls fn(j) for every particle in the 3x3 block of cells
+		 * around p, visiting each bucket at most once.
+		 */
+		template <class Fn>
+		void forEachNear(const glm::dvec2 &p, Fn &&fn) const
+		{
+			const std::int64_t cx = cellCoord(p.x);
+			const std::int64_t cy = cellCoord(p.y);
+
+			std::uint32_t seen[9];
+			int nSeen = 0;
+			for (std::int64_t dy = -1; dy <= 1; dy++) {
+				for (std::int64_t dx = -1; dx <= 1; dx++) {
+					const std::uint32_t bucket = hashCell(cx + dx, cy + dy) & mask;
+
+					bool duplicate = false;
+					for (int k = 0; k < nSeen; k++)
+						duplicate |= seen[k] == bucket;
+					if (duplicate)
+						continue;
+					seen[nSeen++] = bucket;
+
+					for (std::uint32_t k = bucketStart[bucket]; k < bucketStart[bucket + 1]; k++)
+						fn(static_cast<std::size_t>(sorted[k]));
+				}
+			}
+		}
+};
+
+#endif // _SIMPLE_NEWTON_SPATIAL_GRID_HEADER_FILE
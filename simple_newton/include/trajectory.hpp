@@ -0,0 +1,246 @@
+#ifndef _SIMPLE_NEWTON_TRAJECTORY_HEADER_FILE
+#define _SIMPLE_NEWTON_TRAJECTORY_HEADER_FILE
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TrajectoryEncoder;
+class TrajectoryDecoder;
+
+/*
+ * On-disk layout of a trajectory recording:
+ *
+ *   TrajectoryFileHeader, padded to frameAlign
+ *   frame 0: TrajectoryFrameHeader, then the payload, padded
+ *   frame 1: ...
+ *   version 3 and up, once the recording is finished:
+ *   the offset of every frame, as std::uint64_t
+ *   TrajectoryIndexFooter
+ *
+ * Frames are self-describing, so the particle count may change from one
+ * frame to the next, and a reader can hop from header to header without
+ * touching the payloads in between. The index saves it the trip; a
+ * recording that was cut short has none.
+ *
+ * A raw frame's payload is count TrajectoryRecords. Quantized frames
+ * only store positions, see trajectory_codec.hpp. Neither has particle
+ * ids: particles are in their order at the time, and once some merged
+ * away, the ones after them move up.
+ */
+struct TrajectoryFileHeader {
+	static constexpr char magicValue[8] = { 'S', 'N', 'T', 'R', 'A', 'J', '\r', '\n' };
+	static constexpr std::uint32_t currentVersion = 3;
+	static constexpr std::size_t frameAlign = 4096;
+
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t headerSize;
+	std::uint64_t frameHeaderSize;
+	std::uint64_t recordSize;
+};
+
+struct TrajectoryFrameHeader {
+	static constexpr std::uint32_t magicValue = 0x4d415246; /* "FRAM" */
+
+	enum Encoding : std::uint32_t {
+		ENCODING_RAW,
+		ENCODING_KEYFRAME,
+		ENCODING_DELTA
+	};
+
+	std::uint32_t magic;
+	std::uint32_t encoding;
+	std::uint64_t step;
+	std::uint64_t count;
+
+	/* Header, payload and padding, i.e. the distance to the next frame */
+	std::uint64_t frameSize;
+
+	/*
+	 * Version 2 and up, only meaningful for quantized frames. Coordinate
+	 * q of an axis decodes to origin + q * scale, plus the keyframe's
+	 * position for delta frames.
+	 */
+	double origin[2];
+	double scale[2];
+	std::uint32_t bits;
+	/* How many frames back the keyframe of a delta frame is */
+	std::uint32_t keyDistance;
+};
+
+struct TrajectoryIndexFooter {
+	static constexpr char magicValue[8] = { 'S', 'N', 'T', 'I', 'N', 'D', 'X', '\n' };
+
+	std::uint64_t indexOffset;
+	std::uint64_t frames;
+	/* Last, so a torn index never ends in it */
+	char magic[8];
+};
+
+/* Version 1 frame headers stop after frameSize, and only hold raw frames */
+static constexpr std::size_t trajectoryFrameHeaderSizeV1 = 32;
+
+struct TrajectoryRecord {
+	double x;
+	double y;
+	double vx;
+	double vy;
+	double mass;
+};
+
+static_assert(sizeof(TrajectoryFrameHeader) % alignof(TrajectoryRecord) == 0);
+
+/*
+ * Streams frames to disk from a background thread. The simulation thread
+ * fills one of a fixed set of pinned buffers and hands it over; the
+ * writer pushes it out through io_uring, or plain pwrite() where
+ * io_uring isn't available, and gives the buffer back once the write
+ * completed. If every buffer is still in flight, the frame is dropped
+ * rather than stalling the simulation.
+ */
+class TrajectoryWriter {
+	public:
+		struct Buffer {
+			std::byte *data = nullptr;
+			std::size_t capacity = 0;
+			std::size_t size = 0;
+		};
+
+	private:
+		/* Lock-free single producer, single consumer queue of buffer indices */
+		class IndexRing {
+			private:
+				std::vector<std::uint32_t> slots;
+				alignas(64) std::atomic<std::size_t> head = 0;
+				alignas(64) std::atomic<std::size_t> tail = 0;
+
+			public:
+				explicit IndexRing(std::size_t capacity);
+				bool push(std::uint32_t index);
+				bool pop(std::uint32_t &index);
+		};
+
+		int fd = -1;
+		std::vector<Buffer> buffers;
+		void *pinned = nullptr;
+		std::size_t pinnedSize = 0;
+
+		/* Only with quantization: the encoded frames, one per buffer */
+		std::unique_ptr<TrajectoryEncoder> encoder;
+		std::vector<Buffer> encoded;
+
+		/* Simulation thread -> writer thread */
+		IndexRing readyRing;
+		/* Writer thread -> simulation thread */
+		IndexRing freeRing;
+
+		std::atomic<std::uint32_t> readySeq = 0;
+		std::atomic<bool> stopping = false;
+		std::atomic<std::size_t> droppedFrames = 0;
+		std::atomic<std::size_t> writtenFrames = 0;
+		std::atomic<bool> failed = false;
+		/* Whether dropping frames too large for the buffers was reported */
+		bool oversizeReported = false;
+
+		std::uint64_t fileOffset = 0;
+		/* Where every frame written went, for the index */
+		std::vector<std::uint64_t> frameOffsets;
+		std::jthread thread;
+
+		void mapBuffers(std::size_t capacity);
+		void startWriter();
+		void stopWriter();
+		void writerLoop();
+		void pwriteLoop();
+		bool uringLoop();
+		void writeFailed(int err);
+		void writeIndex();
+		void release(std::uint32_t index, bool written);
+
+		/* Encodes a captured frame if needed; returns what goes to disk */
+		Buffer &prepare(std::uint32_t index);
+
+	public:
+		/*
+		 * Creates the file and allocates nBuffers buffers that each fit a
+		 * frame of up to maxParticles particles. With bits set, frames are
+		 * quantized on the writer thread (see trajectory_codec.hpp) with a
+		 * keyframe every keyframeInterval frames. Throws
+		 * std::runtime_error if the file can't be created.
+		 */
+		TrajectoryWriter(const std::string &fname, std::size_t maxParticles, std::size_t nBuffers,
+		                 unsigned bits = 0, std::uint32_t keyframeInterval = 1);
+		TrajectoryWriter(const TrajectoryWriter &) = delete;
+		TrajectoryWriter &operator=(const TrajectoryWriter &) = delete;
+
+		/*
+		 * Simulation thread side. acquire() never blocks; it returns
+		 * nullptr if every buffer is in flight or the frame won't fit,
+		 * which counts as a dropped frame.
+		 */
+		Buffer *acquire(std::size_t frameSize);
+		void submit(Buffer *buffer);
+
+		/*
+		 * Simulation thread side, between frames: grows the buffers to
+		 * fit frames of maxParticles particles (after restoring a larger
+		 * checkpoint, say), once the frames in flight are written.
+		 * Throws std::runtime_error, keeping the old buffers, if the
+		 * memory can't be had.
+		 */
+		void reserve(std::size_t maxParticles);
+
+		std::size_t dropped() const { return droppedFrames.load(std::memory_order_relaxed); }
+		std::size_t written() const { return writtenFrames.load(std::memory_order_relaxed); }
+
+		static std::size_t frameSize(std::size_t count);
+
+		/* Waits for every submitted frame to hit the file, then writes the index */
+		void finish();
+		~TrajectoryWriter();
+};
+
+/*
+ * Plays back a recording straight from a read-only mapping. Opening
+ * doesn't read the frames: the writer's index says where each one
+ * starts. Recordings without one, from before version 3 or cut short,
+ * get their frame headers walked once instead. Only the frames actually
+ * read are ever paged in.
+ */
+class TrajectoryReader {
+	private:
+		const std::byte *base = nullptr;
+		std::size_t fileSize = 0;
+		std::size_t frameHeaderSize = 0;
+		std::unique_ptr<TrajectoryDecoder> decoder;
+		std::vector<std::uint64_t> offsets;
+
+		bool frameAt(std::uint64_t offset, const TrajectoryFrameHeader *&header) const;
+		bool readIndex();
+		void scanFrames();
+		const TrajectoryFrameHeader *frameHeader(std::size_t frame) const;
+
+	public:
+		/* Throws std::runtime_error if the file isn't a readable recording */
+		explicit TrajectoryReader(const std::string &fname);
+		TrajectoryReader(const TrajectoryReader &) = delete;
+		TrajectoryReader &operator=(const TrajectoryReader &) = delete;
+
+		std::size_t frames() const { return offsets.size(); }
+		std::uint64_t step(std::size_t frame) const;
+
+		/* Decodes the positions of one frame. Not thread safe. */
+		void read(std::size_t frame, std::vector<float> &x, std::vector<float> &y) const;
+
+		/* Asks the kernel to start paging in a frame we'll need soon */
+		void prefetch(std::size_t frame) const;
+
+		~TrajectoryReader();
+};
+
+#endif // _SIMPLE_NEWTON_TRAJECTORY_HEADER_FILE
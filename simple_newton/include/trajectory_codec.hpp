@@ -0,0 +1,72 @@
+#ifndef _SIMPLE_NEWTON_TRAJECTORY_CODEC_HEADER_FILE
+#define _SIMPLE_NEWTON_TRAJECTORY_CODEC_HEADER_FILE
+
+#include <trajectory.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Quantized trajectory frames, which only keep positions.
+ *
+ * A keyframe quantizes every coordinate to `bits` bits across the frame's
+ * bounding box. A delta frame stores each particle's offset from the
+ * decoded keyframe position instead, quantized in steps of the keyframe's
+ * grid spacing across the bounding box of the offsets. As long as
+ * particles move less than the whole box between keyframes that takes
+ * fewer bits, and since offsets are taken from what the decoder will see,
+ * the error never exceeds half a step however long the delta chain is.
+ *
+ * Coordinates are bit-packed, x then y per particle, in independent
+ * blocks of codecBlockSize particles, so blocks are packed and unpacked
+ * in parallel.
+ */
+static constexpr std::size_t codecBlockSize = 4096;
+
+class TrajectoryEncoder {
+	private:
+		unsigned bits;
+		std::uint32_t keyframeInterval;
+		std::uint32_t sinceKeyframe;
+
+		/* Keyframe positions as the decoder will reconstruct them */
+		std::vector<double> keyX;
+		std::vector<double> keyY;
+		double keyScale[2] = { 1.0, 1.0 };
+
+		std::size_t encodeRaw(const TrajectoryFrameHeader *raw, std::byte *out);
+
+	public:
+		TrajectoryEncoder(unsigned bits, std::uint32_t keyframeInterval);
+
+		/*
+		 * Encodes a raw frame, as written by ParticleSet::record(), into
+		 * out and returns the encoded frame size. out must have room for
+		 * the raw frame, as frames that can't be quantized (e.g. with
+		 * non-finite positions) are passed through unchanged.
+		 */
+		std::size_t encode(const TrajectoryFrameHeader *raw, std::byte *out);
+};
+
+class TrajectoryDecoder {
+	private:
+		std::vector<double> keyX;
+		std::vector<double> keyY;
+		const TrajectoryFrameHeader *cachedKeyframe = nullptr;
+
+		void decodeKeyframe(const TrajectoryFrameHeader *keyframe);
+
+	public:
+		/*
+		 * keyframe is only used for delta frames. Throws
+		 * std::runtime_error if the frames don't fit together.
+		 */
+		void decode(const TrajectoryFrameHeader *frame, const TrajectoryFrameHeader *keyframe,
+		            std::vector<float> &x, std::vector<float> &y);
+};
+
+/* Bytes taken by count packed particles at the given bits per coordinate */
+std::size_t packedSize(std::size_t count, unsigned bits);
+
+#endif // _SIMPLE_NEWTON_TRAJECTORY_CODEC_HEADER_FILE
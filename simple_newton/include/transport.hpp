@@ -0,0 +1,128 @@
+#ifndef _SIMPLE_NEWTON_TRANSPORT_HEADER_FILE
+#define _SIMPLE_NEWTON_TRANSPORT_HEADER_FILE
+
+#include <arena.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <poll.h>
+
+/*
+ * Sockets between the processes (ranks) of a distributed run, one for
+ * every pair of them. An address is either a path, for Unix domain
+ * sockets on one machine, or host:port for TCP.
+ *
+ * Rank 0 listens on the address. Every other rank listens on one of
+ * its own (next to the Unix socket, or on a free port of the interface
+ * it reached rank 0 through), connects to rank 0 and says where that
+ * is. Rank 0 hands the list around once everybody is there, and the
+ * ranks connect to each other directly. Every call throws
+ * std::runtime_error on failure, including a peer going away.
+ *
+ * Messages are raw bytes with a length in front, in the native byte
+ * order: all ranks are expected to run the same build.
+ */
+class PeerMesh {
+	public:
+		using Buffer = std::vector<std::uint8_t>;
+
+	private:
+		std::size_t rankId;
+		std::size_t nRanks;
+
+		/* Indexed by rank, -1 for ourselves */
+		std::vector<int> sockets;
+
+		/* Progress of every transfer in exchange(), kept to reuse the memory */
+		struct Transfer {
+			std::uint64_t sendLength;
+			std::size_t sent;
+			std::uint64_t receiveLength;
+			std::size_t received;
+		};
+		std::vector<Transfer> transfers;
+		std::vector<pollfd> polls;
+
+		void connectAll(const std::string &address);
+
+	public:
+		/* Waits until all ranks are connected */
+		PeerMesh(const std::string &address, std::size_t rank, std::size_t ranks);
+		PeerMesh(const PeerMesh &) = delete;
+		PeerMesh &operator=(const PeerMesh &) = delete;
+		~PeerMesh();
+
+		std::size_t rank() const { return rankId; }
+		std::size_t size() const { return nRanks; }
+
+		/*
+		 * Sends out[peer] to every other rank and receives in[peer]
+		 * from each of them, all at once, so large messages can't
+		 * block each other. in[rank()] gets a copy of out[rank()].
+		 */
+		void exchange(const std::vector<Buffer> &out, std::vector<Buffer> &in);
+
+		/* A single message to or from one peer */
+		void send(std::size_t peer, const Buffer &message);
+		void receive(std::size_t peer, Buffer &message);
+};
+
+/* Appends trivially copyable values to a message */
+template <class T>
+void putValue(PeerMesh::Buffer &buffer, const T &value)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	const std::size_t at = buffer.size();
+	resizeWithSlack(buffer, at + sizeof(T));
+	std::memcpy(buffer.data() + at, &value, sizeof(T));
+}
+
+template <class T>
+void putValues(PeerMesh::Buffer &buffer, const T *values, std::size_t n)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	const std::size_t at = buffer.size();
+	resizeWithSlack(buffer, at + n * sizeof(T));
+	if (n)
+		std::memcpy(buffer.data() + at, values, n * sizeof(T));
+}
+
+/* Reads them back in the same order; throws std::runtime_error past the end */
+class MessageReader {
+	private:
+		const PeerMesh::Buffer &buffer;
+		std::size_t pos = 0;
+
+	public:
+		explicit MessageReader(const PeerMesh::Buffer &buffer):
+			buffer(buffer) {}
+
+		template <class T>
+		T get()
+		{
+			T value;
+			getValues(&value, 1);
+			return value;
+		}
+
+		template <class T>
+		void getValues(T *values, std::size_t n)
+		{
+			static_assert(std::is_trivially_copyable_v<T>);
+			if (n > (buffer.size() - pos) / sizeof(T))
+				throw std::runtime_error("truncated message from a peer");
+			if (n)
+				std::memcpy(values, buffer.data() + pos, n * sizeof(T));
+			pos += n * sizeof(T);
+		}
+
+		bool atEnd() const { return pos == buffer.size(); }
+};
+
+#endif // _SIMPLE_NEWTON_TRANSPORT_HEADER_FILE
@@ -0,0 +1,59 @@
+#ifndef _SIMPLE_NEWTON_TRIPLE_BUFFER_HEADER_FILE
+#define _SIMPLE_NEWTON_TRIPLE_BUFFER_HEADER_FILE
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * Lock-free single producer, single consumer triple buffer. The writer
+ * fills writeBuffer() and publishes it, the reader picks up whatever was
+ * published last with update(). Neither side ever waits for the other;
+ * if the writer is faster, the reader just skips the states in between.
+ */
+template <class T>
+class TripleBuffer {
+	private:
+		static constexpr std::uint8_t indexMask = 0x3;
+		static constexpr std::uint8_t freshBit  = 0x4;
+
+		T buffers[3];
+
+		/* Index of the buffer in the middle, plus whether it was published since the last update() */
+		alignas(64) std::atomic<std::uint8_t> middle { 1 };
+
+		/* Owned by the writer */
+		alignas(64) std::uint8_t back = 0;
+
+		/* Owned by the reader */
+		alignas(64) std::uint8_t front = 2;
+
+	public:
+		T &writeBuffer()
+		{
+			return buffers[back];
+		}
+
+		void publish()
+		{
+			back = middle.exchange(back | freshBit, std::memory_order_acq_rel) & indexMask;
+		}
+
+		/*
+		 * Returns true if a new buffer was published since the last call.
+		 */
+		bool update()
+		{
+			if (!(middle.load(std::memory_order_relaxed) & freshBit))
+				return false;
+
+			front = middle.exchange(front, std::memory_order_acq_rel) & indexMask;
+			return true;
+		}
+
+		const T &readBuffer() const
+		{
+			return buffers[front];
+		}
+};
+
+#endif // _SIMPLE_NEWTON_TRIPLE_BUFFER_HEADER_FILE
@@ -0,0 +1,167 @@
+#ifndef _SIMPLE_NEWTON_WORK_STEALING_HEADER_FILE
+#define _SIMPLE_NEWTON_WORK_STEALING_HEADER_FILE
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Fork-join pool for the phases of a simulation step. Every worker owns
+ * a Chase-Lev deque: it splits the range it works on in halves, pushes
+ * the upper half to the bottom of its deque and carries on with the
+ * lower one, so the oldest, largest ranges sit at the top where idle
+ * workers steal them. Nothing is locked on the way, and a thread that
+ * runs into an expensive part of the range (a dense cluster, say) just
+ * keeps splitting while the others take the rest.
+ *
+ * The thread that calls parallelFor() works on the loop too, with a
+ * deque that it holds on to until it exits, so up to maxCallers threads
+ * besides the workers may use the pool at the same time. Past that,
+ * loops run serially on the caller.
+ */
+class WorkStealingPool {
+	public:
+		static constexpr std::size_t maxCallers = 8;
+
+	private:
+		struct Job {
+			void (*run)(const void *fn, std::size_t start, std::size_t end);
+			const void *fn;
+			std::size_t grain;
+			std::atomic<std::size_t> remaining;
+			std::atomic<bool> failed = false;
+			std::exception_ptr error;
+		};
+
+		struct Task {
+			Job *job;
+			std::size_t start;
+			std::size_t end;
+		};
+
+		/*
+		 * Chase-Lev deque with a fixed capacity (Lê et al., "Correct and
+		 * Efficient Work-Stealing for Weak Memory Models"). Only the
+		 * owner pushes and takes at the bottom, anyone steals from the
+		 * top. Halving ranges never nests deeper than 64 levels, so a
+		 * full deque only happens with many loops in flight at once;
+		 * push() then fails and the owner keeps the range for itself.
+		 * The fields are atomics because a thief may read a slot that
+		 * the owner is rewriting; it then loses the race on top and
+		 * throws what it read away.
+		 */
+		class Deque {
+			private:
+				static constexpr std::int64_t capacity = 256;
+
+				struct Slot {
+					std::atomic<Job *> job;
+					std::atomic<std::size_t> start;
+					std::atomic<std::size_t> end;
+				};
+
+				Slot slots[capacity];
+				alignas(64) std::atomic<std::int64_t> top = 0;
+				alignas(64) std::atomic<std::int64_t> bottom = 0;
+
+				void store(std::int64_t index, const Task &task);
+				Task load(std::int64_t index) const;
+
+			public:
+				bool push(const Task &task);
+				bool take(Task &task);
+				bool steal(Task &task);
+		};
+
+		struct alignas(64) Worker {
+			Deque deque;
+			std::uint64_t victimSeed = 0;
+		};
+
+		/*
+		 * Which caller deques are taken, one bit each. Threads holding
+		 * one give it back when they exit, which may be after the pool
+		 * was reset or destroyed, so they share ownership of this.
+		 */
+		struct Callers {
+			std::atomic<std::uint32_t> taken = 0;
+		};
+		static_assert(maxCallers <= 32);
+
+		/* The deque of the calling thread, for the start() of a pool that handed it out */
+		struct CallerSlot;
+		static thread_local CallerSlot callerSlot;
+
+		/* Workers first, then one per calling thread */
+		std::unique_ptr<Worker[]> workers;
+		std::size_t nWorkers = 0;
+		std::shared_ptr<Callers> callers;
+		/* Caller deques ever taken, the only ones thieves look at */
+		std::atomic<std::size_t> nCallers = 0;
+
+		std::vector<std::jthread> threads;
+		std::atomic<bool> stopping = false;
+
+		/* Bumped when work appears, idle workers sleep on it */
+		alignas(64) std::atomic<std::uint32_t> workEpoch = 0;
+		std::atomic<std::size_t> sleepers = 0;
+		/* Bumped when a loop finishes, waiting callers sleep on it */
+		alignas(64) std::atomic<std::uint32_t> doneEpoch = 0;
+
+		void start(std::size_t nThreads, const std::function<void(std::size_t)> &init);
+		void stop();
+		void workerLoop(std::size_t index);
+
+		Worker *self();
+		std::size_t takeCaller();
+		bool steal(Worker &thief, Task &task);
+		void execute(Worker &owner, Task task);
+		void wake();
+		void run(Job &job, std::size_t first, std::size_t last);
+
+	public:
+		/* nThreads counts the calling thread; 0 means one per core */
+		explicit WorkStealingPool(std::size_t nThreads = 0);
+		WorkStealingPool(const WorkStealingPool &) = delete;
+		WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+		~WorkStealingPool();
+
+		/*
+		 * Not thread safe: nothing may be running on the pool. Every
+		 * worker calls init(index) first, if given.
+		 */
+		void reset(std::size_t nThreads = 0, const std::function<void(std::size_t)> &init = {});
+
+		/* How many threads work on a loop, the caller included */
+		std::size_t getThreadCount() const { return nWorkers + 1; }
+
+		/*
+		 * Calls fn(start, end) over [first, last) in ranges of at most
+		 * grain indices, and returns once all of them ran. The first
+		 * exception thrown by fn is rethrown here.
+		 */
+		template <class Fn>
+		void parallelFor(std::size_t first, std::size_t last, std::size_t grain, Fn &&fn)
+		{
+			if (first >= last)
+				return;
+
+			Job job {
+				[](const void *fn, std::size_t start, std::size_t end) {
+					(*static_cast<const std::remove_reference_t<Fn> *>(fn))(start, end);
+				},
+				&fn, grain ? grain : 1, last - first
+			};
+			run(job, first, last);
+		}
+};
+
+extern WorkStealingPool stealPool;
+
+#endif // _SIMPLE_NEWTON_WORK_STEALING_HEADER_FILE
@@ -0,0 +1,143 @@
+#ifndef _SIMPLE_NEWTON_WORKER_TEAM_HEADER_FILE
+#define _SIMPLE_NEWTON_WORKER_TEAM_HEADER_FILE
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+ * A fixed team of threads that runs one function on every member at
+ * once, for steps too small to amortize handing out tasks. The members
+ * split the work into static ranges and meet at barrier() between
+ * phases. Waiting, whether at a barrier or for the next run(), spins
+ * for a while before parking on a futex, so back-to-back steps never
+ * make a system call.
+ *
+ * Where the cost per index varies, balancedFor() lets members that are
+ * done help out on the others' shares, within their group (NUMA node)
+ * before any other.
+ *
+ * The calling thread is member 0. Only one thread may run the team at
+ * a time, and the function must not throw: the others would wait at
+ * the next barrier forever.
+ */
+class WorkerTeam {
+	private:
+		std::size_t nThreads = 1;
+		std::vector<std::jthread> threads;
+
+		void (*job)(const void *fn, std::size_t member) = nullptr;
+		const void *jobFn = nullptr;
+		bool stopping = false;
+
+		/* Bumped to start a run, members wait on it in between */
+		alignas(64) std::atomic<std::uint32_t> dispatch = 0;
+
+		/* Sense-reversing central barrier */
+		alignas(64) std::atomic<std::uint32_t> arrived = 0;
+		alignas(64) std::atomic<std::uint32_t> phase = 0;
+
+		/* How many members are parked rather than spinning */
+		alignas(64) std::atomic<std::uint32_t> parked = 0;
+
+		/* What is left of a member's share in balancedFor() */
+		struct alignas(64) Share {
+			std::atomic<std::size_t> next = 0;
+			std::size_t end = 0;
+		};
+		std::unique_ptr<Share[]> shares;
+
+		/*
+		 * The shares each member works through, nThreads per member:
+		 * its own, then its group's, then everybody else's.
+		 */
+		std::vector<std::size_t> helpOrder;
+
+		void memberLoop(std::size_t member, std::uint32_t seen);
+		void waitWhile(const std::atomic<std::uint32_t> &value, std::uint32_t old);
+		void release(std::atomic<std::uint32_t> &value);
+		void start();
+		void spawn(std::size_t nThreads, const std::function<void(std::size_t)> &init);
+		void stop();
+
+	public:
+		/* nThreads counts the calling thread; 0 means one per core */
+		explicit WorkerTeam(std::size_t nThreads = 0);
+		WorkerTeam(const WorkerTeam &) = delete;
+		WorkerTeam &operator=(const WorkerTeam &) = delete;
+		~WorkerTeam();
+
+		/*
+		 * Not thread safe: the team must be idle. Every member but the
+		 * caller calls init(member) first, if given.
+		 */
+		void reset(std::size_t nThreads = 0, const std::function<void(std::size_t)> &init = {});
+
+		std::size_t size() const { return nThreads; }
+
+		/*
+		 * Not thread safe: the team must be idle. Members with the same
+		 * group help each other out first in balancedFor(); everybody
+		 * is in group 0 until this is called.
+		 */
+		void setGroups(const std::vector<std::size_t> &groups);
+
+		/* First index of the member's share of n, the next member's start is its end */
+		std::size_t rangeStart(std::size_t n, std::size_t member) const
+		{
+			return n * member / nThreads;
+		}
+
+		/* Waits until every member got here */
+		void barrier();
+
+		/*
+		 * Called by every member inside run(): calls fn(start, end)
+		 * over [0, n) in ranges of at most grain indices. A member
+		 * starts on its own share and then takes ranges from the
+		 * others, its group's first. Starts with a barrier, and the
+		 * members have to meet at another before the next call.
+		 */
+		template <class Fn>
+		void balancedFor(std::size_t member, std::size_t n, std::size_t grain, Fn &&fn)
+		{
+			Share &own = shares[member];
+			own.end = rangeStart(n, member + 1);
+			own.next.store(rangeStart(n, member), std::memory_order_relaxed);
+			barrier();
+
+			const std::size_t *order = &helpOrder[member * nThreads];
+			for (std::size_t k = 0; k < nThreads; k++) {
+				Share &share = shares[order[k]];
+				for (;;) {
+					const std::size_t start = share.next.fetch_add(grain, std::memory_order_relaxed);
+					if (start >= share.end)
+						break;
+					fn(start, std::min(start + grain, share.end));
+				}
+			}
+		}
+
+		/* Calls fn(member) on every member, and returns once all of them returned */
+		template <class Fn>
+		void run(Fn &&fn)
+		{
+			job = [](const void *fn, std::size_t member) {
+				(*static_cast<const std::remove_reference_t<Fn> *>(fn))(member);
+			};
+			jobFn = &fn;
+			start();
+			fn(std::size_t(0));
+			barrier();
+		}
+};
+
+extern WorkerTeam stepTeam;
+
+#endif // _SIMPLE_NEWTON_WORKER_TEAM_HEADER_FILE
@@ -0,0 +1,169 @@
+#include <main.hpp>
+#include <initial_conditions.hpp>
+#include <philox.hpp>
+
+#include <cmath>
+
+static constexpr double gConstant = 6.6743e-11;
+
+namespace {
+
+struct Layout {
+	glm::dvec2 centre;
+	/* Characteristic radius of the distribution */
+	double radius;
+	/* Expected total mass, known before any particle exists */
+	double totalMass;
+	double timestep;
+};
+
+struct Particle {
+	glm::dvec2 pos;
+	glm::dvec2 veloc;
+	double mass;
+};
+
+}
+
+/*
+ * Speed of a circular orbit around mass enclosedMass. With a force of
+ * G * M / r applied once per step, and positions advancing by
+ * veloc * timestep, that is sqrt(G * M / timestep).
+ */
+static double circularSpeed(double enclosedMass, double timestep)
+{
+	return std::sqrt(gConstant * enclosedMass / timestep);
+}
+
+static glm::dvec2 unitCircle(Philox::Stream &rng)
+{
+	const double angle = 6.283185307179586 * rng.uniform();
+	return glm::dvec2(std::cos(angle), std::sin(angle));
+}
+
+static Particle uniformBox(Philox::Stream &rng, const glm::dvec2 &low, const glm::dvec2 &high)
+{
+	const double x = rng.uniform(low.x, high.x);
+	const double y = rng.uniform(low.y, high.y);
+	return Particle { glm::dvec2(x, y), glm::dvec2(0.0), rng.uniform(MASS_LOW, MASS_HIGH) };
+}
+
+/*
+ * Surface density ~ (1 + r^2 / a^2)^-2, whose enclosed mass fraction
+ * r^2 / (r^2 + a^2) inverts in closed form.
+ */
+static Particle plummer(Philox::Stream &rng, const Layout &layout)
+{
+	const double u = rng.uniform();
+	const double r = layout.radius * std::sqrt(u / (1.0 - u));
+	const glm::dvec2 dir = unitCircle(rng);
+
+	const double enclosed = layout.totalMass * u;
+	const double sigma = circularSpeed(enclosed, layout.timestep) / std::sqrt(2.0);
+	const glm::dvec2 veloc(sigma * rng.normal(), sigma * rng.normal());
+
+	return Particle { layout.centre + dir * r, veloc, rng.uniform(MASS_LOW, MASS_HIGH) };
+}
+
+/*
+ * Surface density ~ exp(-r / h). The radius is Gamma(2, h) distributed,
+ * the sum of two exponentials.
+ */
+static Particle exponentialDisk(Philox::Stream &rng, const Layout &layout, double spin)
+{
+	const double r = -layout.radius * (std::log(1.0 - rng.uniform()) + std::log(1.0 - rng.uniform()));
+	const glm::dvec2 dir = unitCircle(rng);
+
+	const double x = r / layout.radius;
+	const double enclosed = layout.totalMass * (1.0 - (1.0 + x) * std::exp(-x));
+	const double speed = circularSpeed(enclosed, layout.timestep);
+	const double sigma = 0.05 * speed;
+	const glm::dvec2 veloc =
+		glm::dvec2(-dir.y, dir.x) * (spin * speed) +
+		glm::dvec2(sigma * rng.normal(), sigma * rng.normal());
+
+	return Particle { layout.centre + dir * r, veloc, rng.uniform(MASS_LOW, MASS_HIGH) };
+}
+
+/*
+ * Particles below half go to the first disk, the rest to the second,
+ * which rotates the other way. The disks start a few radii apart and
+ * slightly off axis, closing in at half their mutual orbital speed.
+ */
+static Particle collidingGalaxies(Philox::Stream &rng, const Layout &layout, bool second)
+{
+	Layout galaxy = layout;
+	galaxy.totalMass /= 2;
+
+	const glm::dvec2 offset(3.0 * layout.radius, 0.75 * layout.radius);
+	const double approach = 0.5 * circularSpeed(galaxy.totalMass, layout.timestep);
+	const double side = second ? 1.0 : -1.0;
+
+	galaxy.centre = layout.centre + offset * side;
+	Particle particle = exponentialDisk(rng, galaxy, side);
+	particle.veloc.x -= side * approach;
+	return particle;
+}
+
+bool parseInitialConditions(std::string_view name, InitialConditions &out)
+{
+	if (name == "box")
+		out = InitialConditions::UNIFORM_BOX;
+	else if (name == "plummer")
+		out = InitialConditions::PLUMMER;
+	else if (name == "disk")
+		out = InitialConditions::EXPONENTIAL_DISK;
+	else if (name == "galaxies")
+		out = InitialConditions::COLLIDING_GALAXIES;
+	else
+		return false;
+	return true;
+}
+
+ParticleSet::ParticleSet(std::size_t nParticles, int width, int height,
+                         InitialConditions kind, std::uint64_t seed):
+	ParticleSet(nParticles, 0, nParticles, width, height, kind, seed)
+{
+}
+
+ParticleSet::ParticleSet(std::size_t nParticles, std::size_t first, std::size_t last, int width, int height,
+                         InitialConditions kind, std::uint64_t seed)
+{
+	const Philox philox(seed);
+
+	const glm::dvec2 size(width, height);
+	const Layout layout {
+		size / 2.0,
+		std::min(size.x, size.y) / (kind == InitialConditions::PLUMMER ? 8.0 : 12.0),
+		static_cast<double>(nParticles) * (MASS_LOW + MASS_HIGH) / 2,
+		TIMESTEP
+	};
+
+	infos.resize(last - first);
+	threadPool.detach_blocks(first, last, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			Philox::Stream rng = philox.stream(i);
+
+			Particle particle;
+			switch (kind) {
+				case InitialConditions::UNIFORM_BOX:
+					particle = uniformBox(rng, size / 3.0, 2.0 * size / 3.0);
+					break;
+				case InitialConditions::PLUMMER:
+					particle = plummer(rng, layout);
+					break;
+				case InitialConditions::EXPONENTIAL_DISK:
+					particle = exponentialDisk(rng, layout, 1.0);
+					break;
+				case InitialConditions::COLLIDING_GALAXIES:
+					particle = collidingGalaxies(rng, layout, i >= nParticles / 2);
+					break;
+			}
+			infos[i - first] = ParticleInfo { particle.pos, particle.veloc, particle.mass };
+		}
+	});
+	threadPool.wait();
+
+	ids.resize(infos.size());
+	std::iota(ids.begin(), ids.end(), static_cast<std::uint32_t>(first));
+}
@@ -1,61 +1,201 @@
 #include <main.hpp>
 
-BS::thread_pool threadPool;
-
-ParticleSet::ParticleSet(std::size_t nParticles, int width, int height)
-{
-	std::random_device device;
-	std::mt19937 rng(device());
-
-	const float wfloat = static_cast<float>(width);
-	const float hfloat = static_cast<float>(height);
-	std::uniform_real_distribution<float> wdisr(wfloat/3, 2*wfloat/3);
-	std::uniform_real_distribution<float> hdisr(hfloat/3, 2*hfloat/3);
-	std::uniform_real_distribution<float> mdisr(MASS_LOW, MASS_HIGH);
-
-	points.reserve(nParticles);
-	infos.reserve(nParticles);
-	for (std::size_t i = 0; i < nParticles; i++) {
-		const float x = wdisr(rng);
-		const float y = hdisr(rng);
-		points.emplace_back(SDL_FPoint { x, y });
-		infos.emplace_back(ParticleInfo {
-			glm::vec2(x, y),
-			glm::vec2(0, 0),
-			mdisr(rng)
-		});
-	}
+BS::thread_pool<> threadPool;
+WorkStealingPool stealPool;
+WorkerTeam stepTeam;
+
+/*
+ * Acceleration that a particle of the given mass, dVector away,
+ * exerts on another one.
+ */
+static constexpr double gConstant = 6.6743e-11;
+
+static glm::dvec2 pairAccel(const glm::dvec2 &dVector, double mass)
+{
+	/*
+	 * This is a 2D simulation, so the formula is really
+	 * (G * m1) / R
+	 * Instead of
+	 * (G * m1) / R^2
+	 *
+	 * However, because we need to normalize dVector anyways,
+	 * we have to divide twice by the radius, effectively
+	 * divided by R^2. That's why dMagn is R^2 and not R
+	 */
+	double dMagn = glm::dot(dVector, dVector);
+	if (dMagn == 0)
+		dMagn = 1;
+	const double aScalar = (mass * gConstant) / dMagn;
+	return dVector * aScalar;
+}
+
+#if DIAGNOSTICS_INTERVAL > 0
+/*
+ * The potential of the pair, up to a factor of G * m1 / 2: the 2D
+ * force G * m / R comes from a potential of G * m * ln(R), and
+ * log(R^2) is 2 * ln(R). Coincident pairs feel no force (see
+ * pairAccel()), so they get no potential either.
+ */
+static double pairPotential(const glm::dvec2 &dVector, double mass)
+{
+	const double dMagn = glm::dot(dVector, dVector);
+	return dMagn == 0 ? 0 : mass * std::log(dMagn);
 }
+#endif
+
+#if RESPA_INTERVAL > 1
+/*
+ * How much of a pair force counts as near-field, given the squared
+ * distance of the pair. Goes smoothly from 1 to 0 across the outer
+ * RESPA_SMOOTHING band of the cutoff.
+ */
+static double nearWeight(double dMagn)
+{
+	const double outer = RESPA_CUTOFF;
+	const double inner = RESPA_CUTOFF * (1 - RESPA_SMOOTHING);
+	if (dMagn <= inner * inner)
+		return 1;
+	if (dMagn >= outer * outer)
+		return 0;
+
+	const double t = (std::sqrt(dMagn) - inner) / (outer - inner);
+	return 1 - t * t * (3 - 2 * t);
+}
+#endif
 
 void ParticleSet::updateParticles(const ParticleSet::UpdateInfo &updateInfo)
 {
-	for (std::size_t i = 0; i < points.size(); i++) {
-		threadPool.detach_task([&, i]() {
+	if (domain)
+		stepDomain(updateInfo);
+	else
+		stepLocal(updateInfo);
+}
+
+void ParticleSet::stepLocal(const ParticleSet::UpdateInfo &updateInfo)
+{
+#if RESPA_INTERVAL > 1
+	const bool outerStep = stepCount % RESPA_INTERVAL == 0;
+	const bool firstOuterStep = stepCount == 0;
+	if (!outerStep)
+		grid.build(infos.size(), RESPA_CUTOFF, [&](std::size_t i) { return infos[i].pos; });
+#endif
+#if DIAGNOSTICS_INTERVAL > 0
+	static_assert(DIAGNOSTICS_INTERVAL % RESPA_INTERVAL == 0, "diagnostics need the full pair loop of an outer step");
+	const std::size_t measuredStep = stepCount;
+	const bool measure = stepCount % DIAGNOSTICS_INTERVAL == 0;
+	if (measure)
+		diagnosticTerms.resize(infos.size());
+#else
+	const bool measure = false;
+#endif
+	stepCount++;
+
+	/* Pull summed outside of the kick: by the other ranks, or all of it by the ring */
+	const glm::dvec2 *remotePull = domain ? remoteAccels.data() : nullptr;
+	const double *remotePotential = domain ? remotePotentials.data() : nullptr;
+#if RESPA_INTERVAL > 1
+	/* The ring only sums the full force, see main() */
+	const bool ringForces = false;
+#else
+	const bool ringForces = ring && ring->fits(infos.size());
+#endif
+	if (ringForces) {
+		ring->evaluate(infos.size(), measure,
+		               [&](std::size_t i) { return infos[i].pos; },
+		               [&](std::size_t i) { return infos[i].mass; });
+		remotePull = ring->pull();
+		remotePotential = ring->potential();
+	}
+
+	/*
+	 * The kick only reads positions and only writes the particle's own
+	 * velocity, so it can't see a neighbour that already moved. The
+	 * drift comes after every kick is done.
+	 */
+	auto kick = [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
 			glm::dvec2 accelVector = glm::dvec2(0, 0);
-			for (std::size_t j = 0; j < points.size(); j++) {
-				if (i == j)
-					continue;
+#if DIAGNOSTICS_INTERVAL > 0
+			double potential = 0;
+#endif
+#if RESPA_INTERVAL > 1
+			if (outerStep) {
+				glm::dvec2 farVector = glm::dvec2(0, 0);
+				for (std::size_t j = 0; j < infos.size(); j++) {
+					if (i == j)
+						continue;
 
-				const glm::dvec2 dVector = infos[j].pos - infos[i].pos;
-				const double gConstant = 6.6743e-11;
+					const glm::dvec2 dVector = infos[j].pos - infos[i].pos;
+					const glm::dvec2 pVector = pairAccel(dVector, infos[j].mass);
+					const double weight = nearWeight(glm::dot(dVector, dVector));
+#if DIAGNOSTICS_INTERVAL > 0
+					if (measure)
+						potential += pairPotential(dVector, infos[j].mass);
+#endif
+					accelVector += pVector * weight;
+					farVector += pVector * (1 - weight);
+				}
 
 				/*
-				 * This is a 2D simulation, so the formula is really
-				 * (G * m1) / R
-				 * Instead of
-				 * (G * m1) / R^2
-				 *
-				 * However, because we need to normalize dVector anyways,
-				 * we have to divide twice by the radius, effectively
-				 * divided by R^2. That's why dMagn is R^2 and not R
+				 * Verlet-I kick: the half kick closing the last interval
+				 * and the one opening this one both use the far force at
+				 * the current positions, so they add up to one full kick.
+				 * The very first interval has nothing to close.
 				 */
-				double dMagn = glm::dot(dVector, dVector);
-				if (dMagn == 0)
-					dMagn = 1;
-				const double aScalar = (infos[j].mass * gConstant) / dMagn;
-				accelVector += dVector * aScalar;
+				accelVector += farVector * (firstOuterStep ? RESPA_INTERVAL / 2.0 : RESPA_INTERVAL);
+			} else {
+				grid.forEachNear(infos[i].pos, [&](std::size_t j) {
+					if (i == j)
+						return;
+
+					const glm::dvec2 dVector = infos[j].pos - infos[i].pos;
+					const double dMagn = glm::dot(dVector, dVector);
+					if (dMagn >= RESPA_CUTOFF * RESPA_CUTOFF)
+						return;
+
+					accelVector += pairAccel(dVector, infos[j].mass) * nearWeight(dMagn);
+				});
+			}
+#else
+			for (std::size_t j = 0; j < infos.size() && !ringForces; j++) {
+				if (i == j)
+					continue;
+
+				const glm::dvec2 dVector = infos[j].pos - infos[i].pos;
+				accelVector += pairAccel(dVector, infos[j].mass);
+#if DIAGNOSTICS_INTERVAL > 0
+				if (measure)
+					potential += pairPotential(dVector, infos[j].mass);
+#endif
+			}
+#endif
+			if (remotePull) {
+				accelVector += remotePull[i] * gConstant;
+#if DIAGNOSTICS_INTERVAL > 0
+				if (measure)
+					potential += remotePotential[i];
+#endif
 			}
+#if DIAGNOSTICS_INTERVAL > 0
+			if (measure) {
+				/* Halfway through the kick, to line up with the positions */
+				const glm::dvec2 veloc = infos[i].veloc + accelVector * 0.5;
+				const glm::dvec2 pos = infos[i].pos;
+				const double mass = infos[i].mass;
+				diagnosticTerms[i] = DiagnosticTerms {
+					0.5 * mass * updateInfo.delta * glm::dot(veloc, veloc),
+					0.25 * gConstant * mass * potential,
+					mass * veloc,
+					mass * (pos.x * veloc.y - pos.y * veloc.x)
+				};
+			}
+#endif
 			infos[i].veloc += accelVector;
+		}
+	};
+
+	auto drift = [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
 			glm::dvec2 finalVector = infos[i].veloc * updateInfo.delta;
 			infos[i].pos += finalVector;
 #if WALL_COLLISION
@@ -71,26 +211,321 @@ void ParticleSet::updateParticles(const ParticleSet::UpdateInfo &updateInfo)
 				infos[i].veloc.y *= -WALL_ABSORB;
 			}
 #endif
+		}
+	};
 
-			points[i].x = static_cast<float>(updateInfo.camScale * (infos[i].pos.x + updateInfo.camPos.x));
-			points[i].y = static_cast<float>(updateInfo.camScale * (infos[i].pos.y + updateInfo.camPos.y));
+	const std::size_t n = infos.size();
+#if NUMA_PLACEMENT
+	placeParticles();
+	const bool partitioned = numaTopology().nodes() > 1;
+#else
+	const bool partitioned = false;
+#endif
+	if (n <= TEAM_PARTICLES) {
+		/* Too small to hand out: static ranges, and a barrier in between */
+		stepTeam.run([&](std::size_t member) {
+			const std::size_t start = stepTeam.rangeStart(n, member);
+			const std::size_t end = stepTeam.rangeStart(n, member + 1);
+			kick(start, end);
+			stepTeam.barrier();
+			drift(start, end);
+		});
+	} else if (partitioned) {
+		/*
+		 * The shares sit on their members' NUMA nodes. Members that
+		 * are done with theirs help out on the node first, and on the
+		 * others only after that, so clusters still balance out.
+		 */
+		stepTeam.run([&](std::size_t member) {
+			stepTeam.balancedFor(member, n, std::max<std::size_t>(1, 16384 / n), kick);
+			stepTeam.barrier();
+			drift(stepTeam.rangeStart(n, member), stepTeam.rangeStart(n, member + 1));
 		});
+	} else {
+		/*
+		 * Ranges of particles go to whichever thread is free, so
+		 * clusters (many neighbours in the RESPA inner steps) balance
+		 * out. A range covers enough pairs to dwarf the cost of handing
+		 * it out.
+		 */
+		stealPool.parallelFor(0, n, std::max<std::size_t>(1, 16384 / n), kick);
+		stealPool.parallelFor(0, n, 4096, drift);
 	}
 
-	threadPool.wait();
+#if DIAGNOSTICS_INTERVAL > 0
+	if (measure)
+		sumDiagnostics(measuredStep);
+#endif
+#if PARTICLE_COLLISION
+	collide();
+#endif
 }
 
-void ParticleSet::draw(SDL_Renderer *render)
+/*
+ * Sums the per-particle terms over blocks of a fixed size, in parallel,
+ * then the block sums in order, so the totals come out bit for bit the
+ * same whatever the number of threads.
+ */
+void ParticleSet::sumDiagnostics(std::size_t step)
 {
-	const std::uint8_t red   = 255;
-	const std::uint8_t green = 0;
-	const std::uint8_t blue  = 100;
-	(void) SDL_SetRenderDrawColor(render, red, green, blue, 0);
-	(void) SDL_RenderPoints(render, points.data(), static_cast<int>(points.size()));
+	static constexpr std::size_t blockSize = 4096;
+	const std::size_t n = diagnosticTerms.size();
+	const std::size_t nBlocks = (n + blockSize - 1) / blockSize;
+	diagnosticBlocks.resize(nBlocks);
+
+	stealPool.parallelFor(0, nBlocks, 1, [&](std::size_t first, std::size_t last) {
+		for (std::size_t b = first; b < last; b++) {
+			DiagnosticTerms sum { 0, 0, glm::dvec2(0, 0), 0 };
+			for (std::size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize); i++) {
+				sum.kinetic += diagnosticTerms[i].kinetic;
+				sum.potential += diagnosticTerms[i].potential;
+				sum.momentum += diagnosticTerms[i].momentum;
+				sum.angularMomentum += diagnosticTerms[i].angularMomentum;
+			}
+			diagnosticBlocks[b] = sum;
+		}
+	});
+
+	diagnostics = Diagnostics{};
+	diagnostics.step = step;
+	diagnostics.valid = true;
+	for (const DiagnosticTerms &block : diagnosticBlocks) {
+		diagnostics.kinetic += block.kinetic;
+		diagnostics.potential += block.potential;
+		diagnostics.momentum += block.momentum;
+		diagnostics.angularMomentum += block.angularMomentum;
+	}
 }
 
-SimpleNewtonApp::SimpleNewtonApp(std::string_view title, int width, int height):
-	window(nullptr), width(width), height(height), render(nullptr), running(false)
+void ParticleSet::snapshot(Snapshot &out) const
+{
+	if (domain) {
+		domain->command(Domain::Control { Domain::Command::SNAPSHOT, 0, 0, 0 });
+		gatherSnapshot(&out);
+		return;
+	}
+
+	out.x.resize(infos.size());
+	out.y.resize(infos.size());
+	for (std::size_t i = 0; i < infos.size(); i++) {
+		out.x[i] = static_cast<float>(infos[i].pos.x);
+		out.y[i] = static_cast<float>(infos[i].pos.y);
+	}
+	out.step = stepCount;
+}
+
+std::size_t ParticleSet::getNum() const
+{
+	return infos.size();
+}
+
+std::size_t ParticleSet::getStep() const
+{
+	return stepCount;
+}
+
+const Diagnostics &ParticleSet::getDiagnostics() const
+{
+	return diagnostics;
+}
+
+void ParticleSet::resetIds()
+{
+	ids.resize(infos.size());
+	std::iota(ids.begin(), ids.end(), 0);
+}
+
+/*
+ * Drops every particle whose alive flag is clear, keeping the others in
+ * order along with their ids. Blocks count their
+ * survivors in parallel, a prefix sum over the counts gives each block
+ * its place in the output, and the blocks then gather in parallel into
+ * the spare vectors. Gathering in place isn't safe in parallel: a block
+ * could overwrite survivors of the block before it that weren't moved
+ * yet. Nothing is allocated once the spare vectors have grown.
+ */
+void ParticleSet::compact()
+{
+	const std::size_t n = infos.size();
+	const bool withIds = ids.size() == n;
+
+	static constexpr std::size_t blockSize = 4096;
+	const std::size_t nBlocks = std::max<std::size_t>(1, (n + blockSize - 1) / blockSize);
+	aliveCounts.resize(nBlocks + 1);
+
+	stealPool.parallelFor(0, nBlocks, 1, [&](std::size_t first, std::size_t last) {
+		for (std::size_t b = first; b < last; b++) {
+			const std::size_t start = std::min(n, b * blockSize);
+			const std::size_t end = std::min(n, start + blockSize);
+			std::size_t count = 0;
+			for (std::size_t i = start; i < end; i++)
+				count += alive[i];
+			aliveCounts[b + 1] = count;
+		}
+	});
+
+	aliveCounts[0] = 0;
+	for (std::size_t b = 0; b < nBlocks; b++)
+		aliveCounts[b + 1] += aliveCounts[b];
+	const std::size_t kept = aliveCounts[nBlocks];
+	if (kept == n)
+		return;
+
+	resizeWithSlack(spareInfos, kept);
+	if (withIds)
+		resizeWithSlack(spareIds, kept);
+
+	stealPool.parallelFor(0, nBlocks, 1, [&](std::size_t first, std::size_t last) {
+		for (std::size_t b = first; b < last; b++) {
+			const std::size_t start = std::min(n, b * blockSize);
+			const std::size_t end = std::min(n, start + blockSize);
+			std::size_t k = aliveCounts[b];
+			for (std::size_t i = start; i < end; i++) {
+				if (!alive[i])
+					continue;
+				spareInfos[k] = infos[i];
+				if (withIds)
+					spareIds[k] = ids[i];
+				k++;
+			}
+		}
+	});
+
+	infos.swap(spareInfos);
+	if (withIds)
+		ids.swap(spareIds);
+}
+
+std::size_t ParticleSet::project(const Snapshot &snapshot, const UpdateInfo &camera, double alpha)
+{
+	const std::size_t n = snapshot.x.size();
+	points.resize(n);
+
+	/* Without a previous step, blending from x to x at t = 1 leaves x as is */
+	const bool blend = alpha < 1.0 && snapshot.prevX.size() == n;
+	const float *fromX = blend ? snapshot.prevX.data() : snapshot.x.data();
+	const float *fromY = blend ? snapshot.prevY.data() : snapshot.y.data();
+	const float t = blend ? static_cast<float>(alpha) : 1.0f;
+
+	const float scale = static_cast<float>(camera.camScale);
+	const float shiftX = static_cast<float>(camera.camScale * camera.camPos.x);
+	const float shiftY = static_cast<float>(camera.camScale * camera.camPos.y);
+	const float w = static_cast<float>(camera.width);
+	const float h = static_cast<float>(camera.height);
+
+	const std::size_t nBlocks = std::clamp<std::size_t>(n / 4096, 1, stealPool.getThreadCount());
+	const std::size_t blockSize = (n + nBlocks - 1) / nBlocks;
+	visibleCounts.resize(nBlocks);
+
+	/*
+	 * Every block compacts its visible points to its own front. The
+	 * loop has no branches: every point is stored, but the write
+	 * position only advances past the ones on screen.
+	 */
+	stealPool.parallelFor(0, nBlocks, 1, [&](std::size_t first, std::size_t last) {
+		for (std::size_t b = first; b < last; b++) {
+			const std::size_t start = std::min(n, b * blockSize);
+			const std::size_t end = std::min(n, start + blockSize);
+			std::size_t k = start;
+			for (std::size_t i = start; i < end; i++) {
+				const float x = (fromX[i] + (snapshot.x[i] - fromX[i]) * t) * scale + shiftX;
+				const float y = (fromY[i] + (snapshot.y[i] - fromY[i]) * t) * scale + shiftY;
+				points[k] = SDL_FPoint { x, y };
+				k += (x >= 0.0f) & (x < w) & (y >= 0.0f) & (y < h);
+			}
+			visibleCounts[b] = k - start;
+		}
+	});
+
+	std::size_t visible = visibleCounts[0];
+	for (std::size_t b = 1; b < nBlocks; b++) {
+		std::memmove(points.data() + visible, points.data() + b * blockSize, visibleCounts[b] * sizeof(SDL_FPoint));
+		visible += visibleCounts[b];
+	}
+	return visible;
+}
+
+void ParticleSet::draw(SDL_Renderer *render, const Snapshot &snapshot, const UpdateInfo &camera, double alpha)
+{
+#if SPLAT_RENDERING
+	const bool blend = alpha < 1.0 && snapshot.prevX.size() == snapshot.x.size();
+	const RasterView view { camera.width, camera.height, camera.camScale, camera.camPos.x, camera.camPos.y };
+	raster.render(view, snapshot.x.data(), snapshot.y.data(),
+	              blend ? snapshot.prevX.data() : nullptr, blend ? snapshot.prevY.data() : nullptr,
+	              snapshot.x.size(), static_cast<float>(alpha), particleColor);
+
+	if (!texture || textureWidth != raster.getWidth() || textureHeight != raster.getHeight()) {
+		textureWidth = raster.getWidth();
+		textureHeight = raster.getHeight();
+		texture.reset(SDL_CreateTexture(render, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING,
+		                                textureWidth, textureHeight));
+		if (!texture)
+			throw SDLError("failed to create particle texture");
+		(void) SDL_SetTextureBlendMode(texture.get(), SDL_BLENDMODE_ADD_PREMULTIPLIED);
+	}
+
+	(void) SDL_UpdateTexture(texture.get(), nullptr, raster.data(), static_cast<int>(raster.pitch()));
+	(void) SDL_RenderTexture(render, texture.get(), nullptr, nullptr);
+#else
+	const std::uint8_t red   = particleColor.r;
+	const std::uint8_t green = particleColor.g;
+	const std::uint8_t blue  = particleColor.b;
+
+	const std::size_t visible = project(snapshot, camera, alpha);
+	const int cellsX = (camera.width + LOD_CELL - 1) / LOD_CELL;
+	const int cellsY = (camera.height + LOD_CELL - 1) / LOD_CELL;
+	if (visible <= static_cast<std::size_t>(cellsX) * cellsY) {
+		(void) SDL_SetRenderDrawColor(render, red, green, blue, 0);
+		(void) SDL_RenderPoints(render, points.data(), static_cast<int>(visible));
+		return;
+	}
+
+	/*
+	 * Too crowded for single points to mean anything: count particles
+	 * per cell, and draw each occupied cell as one quad whose opacity
+	 * follows the cell's (log scaled) count.
+	 */
+	const RasterView cells { cellsX, cellsY, camera.camScale / LOD_CELL, camera.camPos.x, camera.camPos.y };
+	const bool blend = alpha < 1.0 && snapshot.prevX.size() == snapshot.x.size();
+	raster.render(cells, snapshot.x.data(), snapshot.y.data(),
+	              blend ? snapshot.prevX.data() : nullptr, blend ? snapshot.prevY.data() : nullptr,
+	              snapshot.x.size(), static_cast<float>(alpha), particleColor);
+
+	lodVertices.clear();
+	const float size = LOD_CELL;
+	for (int cy = 0; cy < cellsY; cy++) {
+		const std::uint8_t *row = raster.data() + cy * raster.pitch();
+		for (int cx = 0; cx < cellsX; cx++) {
+			const std::uint8_t level = row[4 * cx + 3];
+			if (!level)
+				continue;
+
+			const SDL_FColor color { red / 255.0f, green / 255.0f, blue / 255.0f, level / 255.0f };
+			const float x = cx * size;
+			const float y = cy * size;
+			lodVertices.push_back(SDL_Vertex { { x,        y        }, color, { 0, 0 } });
+			lodVertices.push_back(SDL_Vertex { { x + size, y        }, color, { 0, 0 } });
+			lodVertices.push_back(SDL_Vertex { { x + size, y + size }, color, { 0, 0 } });
+			lodVertices.push_back(SDL_Vertex { { x,        y + size }, color, { 0, 0 } });
+		}
+	}
+
+	/* Two triangles per quad, the same for every quad */
+	const std::size_t quads = lodVertices.size() / 4;
+	for (std::size_t q = lodIndices.size() / 6; q < quads; q++) {
+		const int v = static_cast<int>(4 * q);
+		for (int index : { v, v + 1, v + 2, v, v + 2, v + 3 })
+			lodIndices.push_back(index);
+	}
+
+	(void) SDL_SetRenderDrawBlendMode(render, SDL_BLENDMODE_BLEND);
+	(void) SDL_RenderGeometry(render, nullptr, lodVertices.data(), static_cast<int>(lodVertices.size()),
+	                          lodIndices.data(), static_cast<int>(6 * quads));
+#endif
+}
+
+SimpleNewtonApp::SimpleNewtonApp(std::string_view title, int width, int height, const Options &options):
+	window(nullptr), width(width), height(height), render(nullptr), running(false), options(options)
 {
 	const SDL_InitFlags initFlags = SDL_INIT_VIDEO;
 	const SDL_WindowFlags windowFlags = SDL_WINDOW_RESIZABLE;
@@ -107,6 +542,16 @@ SimpleNewtonApp::SimpleNewtonApp(std::string_view title, int width, int height):
 		throw SDLError("failed to create renderer");
 }
 
+ParticleSet::UpdateInfo SimpleNewtonApp::cameraInfo() const
+{
+	ParticleSet::UpdateInfo camera{};
+	camera.camPos = camPos;
+	camera.camScale = camScale;
+	camera.width = width;
+	camera.height = height;
+	return camera;
+}
+
 void SimpleNewtonApp::calcScale(const SDL_Event &event)
 {
 	float y = event.wheel.y;
@@ -126,6 +571,39 @@ void SimpleNewtonApp::calcMove(const SDL_Event &event)
 	}
 }
 
+void SimpleNewtonApp::handleKey(SDL_Keycode key)
+{
+	switch (key) {
+		case SDLK_F5:
+			saveRequested = true;
+			break;
+		case SDLK_F9:
+			restoreRequested = true;
+			break;
+		case SDLK_SPACE:
+			paused = !paused;
+			break;
+		case SDLK_UP:
+			playbackSpeed *= 2;
+			break;
+		case SDLK_DOWN:
+			playbackSpeed /= 2;
+			break;
+		case SDLK_LEFT:
+			seekFrames -= paused ? 1 : REPLAY_SEEK;
+			break;
+		case SDLK_RIGHT:
+			seekFrames += paused ? 1 : REPLAY_SEEK;
+			break;
+		case SDLK_HOME:
+			seekFrames = -std::numeric_limits<double>::infinity();
+			break;
+		case SDLK_END:
+			seekFrames = std::numeric_limits<double>::infinity();
+			break;
+	}
+}
+
 void SimpleNewtonApp::handleEvents()
 {
 	SDL_Event event;
@@ -144,33 +622,275 @@ void SimpleNewtonApp::handleEvents()
 			case SDL_EVENT_MOUSE_MOTION:
 				calcMove(event);
 				break;
+			case SDL_EVENT_KEY_DOWN:
+				handleKey(event.key.key);
+				break;
+		}
+	}
+}
+
+bool SimpleNewtonApp::serviceCheckpoints(ParticleSet &particleSet)
+{
+	bool restored = false;
+	try {
+		if (saveRequested.exchange(false)) {
+			particleSet.save(options.checkpoint);
+			std::cout << "Saved checkpoint " << options.checkpoint << std::endl;
+		}
+
+		if (restoreRequested.exchange(false)) {
+			particleSet.restore(options.checkpoint);
+			std::cout << "Restored checkpoint " << options.checkpoint << std::endl;
+			initialEnergy = std::numeric_limits<double>::quiet_NaN();
+			restored = true;
+			if (recorder)
+				recorder->reserve(particleSet.getNum());
+		}
+	} catch (std::exception &e) {
+		std::cerr << e.what() << std::endl;
+	}
+	return restored;
+}
+
+void SimpleNewtonApp::step(ParticleSet &particleSet, const ParticleSet::UpdateInfo &info)
+{
+	particleSet.updateParticles(info);
+	if (recorder && particleSet.getStep() % TRAJECTORY_INTERVAL == 0)
+		particleSet.record(*recorder);
+
+	const Diagnostics &diagnostics = particleSet.getDiagnostics();
+	if (diagnostics.valid && diagnostics.step != reportedStep)
+		reportDiagnostics(diagnostics);
+
+#if NUMA_PLACEMENT
+	const NumaReport &numa = particleSet.getNumaReport();
+	if (numa.placement && !numaReported) {
+		numaReported = true;
+		std::cout << "Particles placed over " << numa.nodes << " NUMA nodes: "
+		          << numa.localPages << " pages local to their thread, " << numa.remotePages << " remote, "
+		          << numa.unknownPages << " unknown" << std::endl;
+	}
+#endif
+}
+
+void SimpleNewtonApp::reportDiagnostics(const Diagnostics &diagnostics)
+{
+	const double energy = diagnostics.kinetic + diagnostics.potential;
+	if (std::isnan(initialEnergy))
+		initialEnergy = energy;
+	reportedStep = diagnostics.step;
+
+	std::ostringstream line;
+	line << "step " << diagnostics.step
+	     << ": energy " << energy
+	     << " (kinetic " << diagnostics.kinetic << ", drift " << (energy - initialEnergy) / std::abs(initialEnergy) << ")"
+	     << ", momentum (" << diagnostics.momentum.x << ", " << diagnostics.momentum.y << ")"
+	     << ", angular momentum " << diagnostics.angularMomentum;
+	std::cout << line.str() << std::endl;
+}
+
+void SimpleNewtonApp::simulateSteps(std::stop_token stop, ParticleSet &particleSet)
+{
+#if SIMULATION_RATE > 0
+	using Clock = std::chrono::steady_clock;
+	const auto period = std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(1.0 / SIMULATION_RATE));
+	Clock::time_point due = Clock::now();
+#endif
+
+	while (!stop.stop_requested()) {
+		const bool restored = serviceCheckpoints(particleSet);
+
+		/*
+		 * The render thread keeps drawing the last snapshot with the
+		 * live camera, so a paused state can be inspected at full
+		 * frame rate.
+		 */
+		if (paused) {
+			if (restored) {
+				ParticleSet::Snapshot &out = snapshots.writeBuffer();
+				particleSet.snapshot(out);
+				out.prevX.clear();
+				out.prevY.clear();
+				snapshots.publish();
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+#if SIMULATION_RATE > 0
+			due = Clock::now();
+#endif
+			continue;
+		}
+
+		ParticleSet::UpdateInfo info{};
+		info.delta = TIMESTEP;
+		info.width = width;
+		info.height = height;
+
+		ParticleSet::Snapshot &out = snapshots.writeBuffer();
+#if SIMULATION_RATE > 0
+		std::this_thread::sleep_until(due);
+		const auto behind = Clock::now() - due;
+		const int substeps = static_cast<int>(std::min<Clock::rep>(1 + behind / period, MAX_SUBSTEPS));
+
+		for (int s = 0; s < substeps; s++) {
+			if (s == substeps - 1) {
+				particleSet.snapshot(out);
+				out.prevX.swap(out.x);
+				out.prevY.swap(out.y);
+			}
+			step(particleSet, info);
+		}
+		particleSet.snapshot(out);
+		out.time = due + period * (substeps - 1);
+
+		/* Don't try to catch up on a backlog we can never work through */
+		due += period * substeps;
+		if (Clock::now() - due > period * MAX_SUBSTEPS)
+			due = Clock::now();
+#else
+		step(particleSet, info);
+		particleSet.snapshot(out);
+#endif
+		snapshots.publish();
+	}
+}
+
+void SimpleNewtonApp::simulate(std::stop_token stop, ParticleSet &particleSet)
+{
+	pinSimulationThread();
+
+	try {
+		simulateSteps(stop, particleSet);
+	} catch (std::exception &) {
+		simulationError = std::current_exception();
+		simulationFailed = true;
+	}
+}
+
+ParticleSet initialParticles(const Options &options, int width, int height)
+{
+	ParticleSet particleSet;
+	if (options.restore) {
+		particleSet.restore(options.checkpoint);
+	} else if (!options.importFile.empty()) {
+		particleSet.importFrom(options.importFile);
+	} else {
+		std::uint64_t seed = options.seed;
+		if (!seed) {
+			std::random_device device;
+			seed = (static_cast<std::uint64_t>(device()) << 32) | device();
+			std::cout << "seed " << seed << std::endl;
 		}
+		if (options.domains > 1)
+			particleSet = distributedParticles(options, seed, width, height);
+		else
+			particleSet = ParticleSet(NUM_PARTICLES, width, height, options.initial, seed);
 	}
+
+	if (options.ring > 1)
+		particleSet.attachRing(std::make_unique<ForceRing>(options.ring, particleSet.getNum()));
+	return particleSet;
 }
 
 void SimpleNewtonApp::loop()
 {
-	ParticleSet particleSet(NUM_PARTICLES, width, height);
+	ParticleSet particleSet = initialParticles(options, width, height);
+
+	particleSet.snapshot(snapshots.writeBuffer());
+	snapshots.publish();
+
+	if (!options.record.empty())
+		recorder = std::make_unique<TrajectoryWriter>(options.record, particleSet.getNum(), TRAJECTORY_BUFFERS,
+		                                              TRAJECTORY_BITS, TRAJECTORY_KEYFRAME_INTERVAL);
 
 	running = true;
-	while (running) {
+	std::jthread simThread([&](std::stop_token stop) {
+		simulate(stop, particleSet);
+	});
+
+	while (running && !simulationFailed) {
 		handleEvents();
 
-		(void) SDL_SetRenderDrawColor(render, 10, 0, 20, 0);
+		(void) SDL_SetRenderDrawColor(render, backgroundColor.r, backgroundColor.g, backgroundColor.b, 0);
 		(void) SDL_RenderClear(render);
 
-		particleSet.draw(render);
+		const ParticleSet::UpdateInfo camera = cameraInfo();
+		snapshots.update();
+		const ParticleSet::Snapshot &snapshot = snapshots.readBuffer();
+
+		/* Rendering runs one step behind so there is always a step to blend towards */
+		double alpha = 1.0;
+#if SIMULATION_RATE > 0
+		const std::chrono::duration<double> sinceStep = std::chrono::steady_clock::now() - snapshot.time;
+		alpha = glm::clamp(sinceStep.count() * SIMULATION_RATE, 0.0, 1.0);
+#endif
+		particleSet.draw(render, snapshot, camera, alpha);
 
 		(void) SDL_RenderPresent(render);
+	}
 
-		ParticleSet::UpdateInfo info{};
-		info.camPos = camPos;
-		info.camScale = camScale;
-		info.delta = TIMESTEP;
-		info.width = width;
-		info.height = height;
+	simThread.request_stop();
+	simThread.join();
+	if (recorder) {
+		recorder->finish();
+		std::cout << "Recorded " << recorder->written() << " frames to " << options.record
+		          << " (" << recorder->dropped() << " dropped)" << std::endl;
+		recorder.reset();
+	}
+
+	if (simulationError)
+		std::rethrow_exception(simulationError);
+}
+
+void SimpleNewtonApp::replay()
+{
+	TrajectoryReader reader(options.replay);
+	if (!reader.frames())
+		throw std::runtime_error("trajectory " + options.replay + " has no frames");
+
+	/* Only used for drawing */
+	ParticleSet particleSet;
+	ParticleSet::Snapshot snapshot;
+
+	const double lastFrame = static_cast<double>(reader.frames() - 1);
+	double playhead = 0.0;
+	std::size_t shown = reader.frames();
+	auto lastTime = std::chrono::steady_clock::now();
+
+	running = true;
+	while (running) {
+		handleEvents();
+
+		const auto now = std::chrono::steady_clock::now();
+		const std::chrono::duration<double> delta = now - lastTime;
+		lastTime = now;
+
+		/* Frames we run past at high speed are skipped, and never even paged in */
+		if (!paused)
+			playhead += delta.count() * REPLAY_FPS * playbackSpeed;
+		playhead = glm::clamp(playhead + seekFrames, 0.0, lastFrame);
+		seekFrames = 0.0;
 
-		particleSet.updateParticles(info);
+		const std::size_t frame = static_cast<std::size_t>(playhead);
+		if (frame != shown) {
+			reader.read(frame, snapshot.x, snapshot.y);
+			snapshot.step = reader.step(frame);
+			if (frame > shown)
+				reader.prefetch(frame + (frame - shown));
+			shown = frame;
+
+			std::ostringstream title;
+			title << "Simple Newton - frame " << frame + 1 << "/" << reader.frames()
+			      << ", step " << snapshot.step << ", " << playbackSpeed << "x";
+			(void) SDL_SetWindowTitle(window, title.str().c_str());
+		}
+
+		(void) SDL_SetRenderDrawColor(render, backgroundColor.r, backgroundColor.g, backgroundColor.b, 0);
+		(void) SDL_RenderClear(render);
+
+		particleSet.draw(render, snapshot, cameraInfo());
+
+		(void) SDL_RenderPresent(render);
 	}
 }
 
@@ -185,8 +905,111 @@ SimpleNewtonApp::~SimpleNewtonApp()
 	SDL_Quit();
 }
 
-int main()
+static void usage(const char *argv0)
 {
-	SimpleNewtonApp app("Simple Newton", 700, 500);
-	app.loop();
+	std::cerr << "usage: " << argv0 << " [--checkpoint FILE] [--restore] [--record FILE]"
+	          << " [--import FILE] [--initial box|plummer|disk|galaxies] [--seed N]" << std::endl;
+	std::cerr << "       " << argv0 << " --replay FILE" << std::endl;
+	std::cerr << "       " << argv0 << " --render OUT.{ppm,png,y4m} [--frames N] [start options]" << std::endl;
+	std::cerr << "       " << argv0 << " --domains N [--peers PATH|HOST:PORT [--rank R]] [other options]" << std::endl;
+	std::cerr << "       " << argv0 << " --ring K [other options]" << std::endl;
+}
+
+template <class T>
+static bool parseNumber(std::string_view text, T &value)
+{
+	const auto [end, err] = std::from_chars(text.data(), text.data() + text.size(), value);
+	return err == std::errc() && end == text.data() + text.size();
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg = argv[i];
+		if (arg == "--checkpoint" && i + 1 < argc) {
+			options.checkpoint = argv[++i];
+		} else if (arg == "--restore") {
+			options.restore = true;
+		} else if (arg == "--record" && i + 1 < argc) {
+			options.record = argv[++i];
+		} else if (arg == "--replay" && i + 1 < argc) {
+			options.replay = argv[++i];
+		} else if (arg == "--import" && i + 1 < argc) {
+			options.importFile = argv[++i];
+		} else if (arg == "--initial" && i + 1 < argc && parseInitialConditions(argv[i + 1], options.initial)) {
+			i++;
+		} else if (arg == "--seed" && i + 1 < argc && parseNumber(argv[i + 1], options.seed)) {
+			i++;
+		} else if (arg == "--render" && i + 1 < argc) {
+			options.render = argv[++i];
+		} else if (arg == "--frames" && i + 1 < argc && parseNumber(argv[i + 1], options.frames)) {
+			i++;
+		} else if (arg == "--domains" && i + 1 < argc && parseNumber(argv[i + 1], options.domains)) {
+			i++;
+		} else if (arg == "--rank" && i + 1 < argc && parseNumber(argv[i + 1], options.rank)) {
+			i++;
+		} else if (arg == "--peers" && i + 1 < argc) {
+			options.peers = argv[++i];
+		} else if (arg == "--ring" && i + 1 < argc && parseNumber(argv[i + 1], options.ring)) {
+			i++;
+		} else if (arg == "--ring-segment" && i + 1 < argc) {
+			options.ringSegment = argv[++i];
+		} else {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Distributed runs start from generated particles, and can't be recorded */
+	const bool distributed = options.domains > 1;
+	const bool ringed = options.ring > 1;
+	bool invalid = options.domains == 0 || options.ring == 0 || (distributed && ringed) ||
+	               options.rank >= std::max(options.domains, options.ring) ||
+	               (options.rank > 0 && options.peers.empty() && options.ringSegment.empty()) ||
+	               (distributed && (options.restore || !options.importFile.empty() || !options.record.empty() || !options.replay.empty()));
+#if RESPA_INTERVAL > 1
+	/* The ring only sums the full force, not the near and far parts */
+	invalid = invalid || ringed;
+#endif
+	if (invalid) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Processes sharing a machine, through a Unix socket or the ring, share its CPUs too */
+	const bool local = distributed && (options.peers.empty() || options.peers.find('/') != std::string::npos);
+	if (ringed)
+		configureThreads(options.rank, options.ring);
+	else if (local)
+		configureThreads(options.rank, options.domains);
+	else
+		configureThreads();
+
+	/* A lost peer ends a distributed or ring run here, on every rank */
+	try {
+		if (!options.ringSegment.empty()) {
+			ForceRing(options.ringSegment, options.rank).serve();
+			return EXIT_SUCCESS;
+		}
+
+		if (options.rank > 0) {
+			distributedParticles(options, 0, 0, 0).serveDomain();
+			return EXIT_SUCCESS;
+		}
+
+		if (!options.render.empty()) {
+			return HeadlessRenderer(options).run() ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+
+		SimpleNewtonApp app("Simple Newton", 700, 500, options);
+		if (options.replay.empty())
+			app.loop();
+		else
+			app.replay();
+	} catch (std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
 }
@@ -0,0 +1,287 @@
+#include <main.hpp>
+#include <multipole.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+using Complex = std::complex<double>;
+
+static constexpr std::size_t terms = MULTIPOLE_ORDER + 1;
+/* 31 bits per axis; the deepest cells hold particles with equal keys */
+static constexpr int maxLevel = 31;
+
+/* Doubles in a cell and a point of a message */
+static constexpr std::size_t cellDoubles = 2 + 2 * terms;
+static constexpr std::size_t pointDoubles = 3;
+
+static const auto binomials = []
+{
+	std::array<std::array<double, terms>, terms> c{};
+	for (std::size_t n = 0; n < terms; n++) {
+		c[n][0] = 1;
+		for (std::size_t k = 1; k <= n; k++)
+			c[n][k] = c[n - 1][k - 1] + (k < n ? c[n - 1][k] : 0);
+	}
+	return c;
+}();
+
+static std::uint64_t spreadBits(std::uint32_t value)
+{
+	std::uint64_t bits = value;
+	bits = (bits | bits << 16) & 0x0000ffff0000ffff;
+	bits = (bits | bits << 8) & 0x00ff00ff00ff00ff;
+	bits = (bits | bits << 4) & 0x0f0f0f0f0f0f0f0f;
+	bits = (bits | bits << 2) & 0x3333333333333333;
+	bits = (bits | bits << 1) & 0x5555555555555555;
+	return bits;
+}
+
+/* Also takes NaN to 0, rather than to undefined behaviour */
+static std::uint32_t cellCoordinate(double at)
+{
+	constexpr double cells = 1u << maxLevel;
+	if (!(at > 0))
+		return 0;
+	if (at >= cells)
+		return (1u << maxLevel) - 1;
+	return static_cast<std::uint32_t>(at);
+}
+
+std::uint64_t MortonFrame::key(const glm::dvec2 &pos) const
+{
+	const glm::dvec2 at = (pos - origin) * (double(1u << maxLevel) / size);
+	return spreadBits(cellCoordinate(at.x)) | spreadBits(cellCoordinate(at.y)) << 1;
+}
+
+void BoundingBox::add(const glm::dvec2 &pos)
+{
+	if (empty) {
+		lo = hi = pos;
+		empty = false;
+	} else {
+		lo = glm::min(lo, pos);
+		hi = glm::max(hi, pos);
+	}
+}
+
+void BoundingBox::add(const BoundingBox &other)
+{
+	if (other.empty)
+		return;
+	add(other.lo);
+	add(other.hi);
+}
+
+double BoundingBox::distance(const glm::dvec2 &pos) const
+{
+	return glm::length(glm::max(glm::max(lo - pos, pos - hi), glm::dvec2(0, 0)));
+}
+
+void MultipoleTree::sortKeys()
+{
+	std::sort(sortedKeys.begin(), sortedKeys.end());
+}
+
+void MultipoleTree::finish(const MortonFrame &frame)
+{
+	nodes.clear();
+	moments.clear();
+	if (positions.empty())
+		return;
+
+	const double half = frame.size / 2;
+	nodes.push_back({ frame.origin + glm::dvec2(half, half), half, 0, 0, static_cast<std::uint32_t>(positions.size()), 0, 0 });
+	split(0, 0);
+}
+
+void MultipoleTree::split(std::size_t node, int level)
+{
+	/* New moments start out at zero */
+	resizeWithSlack(moments, nodes.size() * terms);
+
+	const Node parent = nodes[node];
+	if (parent.count <= MULTIPOLE_LEAF || level == maxLevel) {
+		leafMoments(node);
+		return;
+	}
+
+	/* Keys in a cell share their top 2 * level bits, the next two pick the child */
+	const int shift = 2 * (maxLevel - 1 - level);
+	const auto keys = sortedKeys.begin();
+	const auto end = keys + parent.first + parent.count;
+	auto start = keys + parent.first;
+	const std::size_t firstChild = nodes.size();
+	for (std::uint64_t quadrant = 0; quadrant < 4; quadrant++) {
+		const auto stop = std::partition_point(start, end, [&](const auto &key) {
+			return (key.first >> shift & 3) <= quadrant;
+		});
+		if (stop != start) {
+			const double half = parent.halfSize / 2;
+			const glm::dvec2 centre = parent.centre + glm::dvec2(quadrant & 1 ? half : -half, quadrant & 2 ? half : -half);
+			nodes.push_back({ centre, half, 0, static_cast<std::uint32_t>(start - keys), static_cast<std::uint32_t>(stop - start), 0, 0 });
+		}
+		start = stop;
+	}
+	nodes[node].firstChild = firstChild;
+	nodes[node].nChildren = nodes.size() - firstChild;
+
+	double radius = 0;
+	for (std::size_t child = firstChild; child < firstChild + nodes[node].nChildren; child++) {
+		split(child, level + 1);
+		shiftMoments(child, node);
+		radius = std::max(radius, glm::length(nodes[child].centre - parent.centre) + nodes[child].radius);
+	}
+	nodes[node].radius = radius;
+}
+
+void MultipoleTree::leafMoments(std::size_t node)
+{
+	Node &leaf = nodes[node];
+	Complex *q = &moments[node * terms];
+	const Complex centre(leaf.centre.x, leaf.centre.y);
+	double radius = 0;
+	for (std::size_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+		const Complex s = Complex(positions[i].x, positions[i].y) - centre;
+		radius = std::max(radius, std::abs(s));
+		Complex power = masses[i];
+		for (std::size_t k = 0; k < terms; k++) {
+			q[k] += power;
+			power *= s;
+		}
+	}
+	leaf.radius = radius;
+}
+
+/* Q_k(parent) += sum over j <= k of C(k, j) * Q_j(child) * d^(k - j), d from parent to child */
+void MultipoleTree::shiftMoments(std::size_t child, std::size_t parent)
+{
+	const glm::dvec2 offset = nodes[child].centre - nodes[parent].centre;
+	const Complex d(offset.x, offset.y);
+	std::array<Complex, terms> powers;
+	powers[0] = 1;
+	for (std::size_t k = 1; k < terms; k++)
+		powers[k] = powers[k - 1] * d;
+
+	const Complex *from = &moments[child * terms];
+	Complex *to = &moments[parent * terms];
+	for (std::size_t k = 0; k < terms; k++)
+		for (std::size_t j = 0; j <= k; j++)
+			to[k] += binomials[k][j] * from[j] * powers[k - j];
+}
+
+void MultipoleTree::essentialFor(const BoundingBox &bounds, PeerMesh::Buffer &out) const
+{
+	const std::size_t header = out.size();
+	std::uint64_t nCells = 0;
+	std::uint64_t nPoints = 0;
+	putValue(out, nCells);
+	putValue(out, nPoints);
+	if (nodes.empty() || bounds.empty)
+		return;
+
+	walk(0, bounds, true, out, nCells);
+	walk(0, bounds, false, out, nPoints);
+	std::memcpy(out.data() + header, &nCells, sizeof(nCells));
+	std::memcpy(out.data() + header + sizeof(nCells), &nPoints, sizeof(nPoints));
+}
+
+/* Writes either the cells or the points, so they each end up in one run */
+void MultipoleTree::walk(std::size_t node, const BoundingBox &bounds, bool cells, PeerMesh::Buffer &out, std::uint64_t &count) const
+{
+	const Node &cell = nodes[node];
+	if (cell.radius < MULTIPOLE_THETA * bounds.distance(cell.centre)) {
+		if (cells) {
+			putValue(out, cell.centre);
+			putValues(out, &moments[node * terms], terms);
+			count++;
+		}
+		return;
+	}
+
+	if (!cell.nChildren) {
+		if (!cells) {
+			for (std::size_t i = cell.first; i < cell.first + cell.count; i++) {
+				putValue(out, positions[i]);
+				putValue(out, masses[i]);
+			}
+			count += cell.count;
+		}
+		return;
+	}
+
+	for (std::size_t child = cell.firstChild; child < cell.firstChild + cell.nChildren; child++)
+		walk(child, bounds, cells, out, count);
+}
+
+void RemoteField::clear()
+{
+	cells.clear();
+	points.clear();
+}
+
+void RemoteField::add(const PeerMesh::Buffer &message)
+{
+	MessageReader reader(message);
+	const auto nCells = reader.get<std::uint64_t>();
+	const auto nPoints = reader.get<std::uint64_t>();
+	/* Before resizing to whatever the counts say */
+	const std::size_t doubles = message.size() / sizeof(double);
+	if (nCells > doubles / cellDoubles || nPoints > doubles / pointDoubles)
+		throw std::runtime_error("truncated message from a peer");
+
+	const std::size_t cellsAt = cells.size();
+	resizeWithSlack(cells, cellsAt + nCells * cellDoubles);
+	reader.getValues(cells.data() + cellsAt, nCells * cellDoubles);
+	const std::size_t pointsAt = points.size();
+	resizeWithSlack(points, pointsAt + nPoints * pointDoubles);
+	reader.getValues(points.data() + pointsAt, nPoints * pointDoubles);
+	if (!reader.atEnd())
+		throw std::runtime_error("malformed multipole message from a peer");
+}
+
+/*
+ * With u = pos - c, a cell pulls with minus the conjugate of
+ * sum of Q_k / u^(k + 1), and its potential is
+ * 2 * Re(Q_0 * ln(u) - sum over k >= 1 of Q_k / (k * u^k)).
+ */
+glm::dvec2 RemoteField::pull(const glm::dvec2 &pos, double *potential) const
+{
+	glm::dvec2 sum(0, 0);
+	double phi = 0;
+
+	const Complex w(pos.x, pos.y);
+	for (std::size_t c = 0; c < cells.size(); c += cellDoubles) {
+		const Complex u = w - Complex(cells[c], cells[c + 1]);
+		const Complex *q = reinterpret_cast<const Complex *>(&cells[c + 2]);
+		const Complex inverse = 1.0 / u;
+
+		Complex power = inverse;
+		Complex field = q[0];
+		Complex series = 0;
+		for (std::size_t k = 1; k < terms; k++) {
+			field += q[k] * power;
+			if (potential)
+				series += q[k] * power / double(k);
+			power *= inverse;
+		}
+		field *= inverse;
+		sum += glm::dvec2(-field.real(), field.imag());
+		if (potential)
+			phi += q[0].real() * std::log(std::norm(u)) - 2 * series.real();
+	}
+
+	for (std::size_t p = 0; p < points.size(); p += pointDoubles) {
+		const glm::dvec2 d = glm::dvec2(points[p], points[p + 1]) - pos;
+		const double dMagn = glm::dot(d, d);
+		if (dMagn == 0)
+			continue;
+		sum += points[p + 2] * d / dMagn;
+		if (potential)
+			phi += points[p + 2] * std::log(dMagn);
+	}
+
+	if (potential)
+		*potential = phi;
+	return sum;
+}
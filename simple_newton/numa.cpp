@@ -0,0 +1,261 @@
+#include <main.hpp>
+#include <numa.hpp>
+#include <affinity.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+
+#include <sched.h>
+#include <unistd.h>
+
+#if __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#define HAVE_NUMA 1
+#else
+#define HAVE_NUMA 0
+#endif
+
+/* Pages asked about per move_pages() call */
+static constexpr std::size_t queryBatch = 1024;
+
+std::vector<int> parseCpuList(const std::string &list)
+{
+	std::vector<int> cpus;
+	std::size_t pos = 0;
+	while (pos < list.size()) {
+		std::size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+
+		const std::string item = list.substr(pos, end - pos);
+		const std::size_t dash = item.find('-');
+		try {
+			const int first = std::stoi(item.substr(0, dash));
+			const int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+			for (int cpu = first; cpu <= last; cpu++)
+				cpus.push_back(cpu);
+		} catch (std::exception &) {
+			/* Trailing newline, or something we don't understand */
+		}
+		pos = end + 1;
+	}
+	return cpus;
+}
+
+NumaTopology::NumaTopology()
+{
+	const long pageSize = sysconf(_SC_PAGESIZE);
+	if (pageSize > 0)
+		page = static_cast<std::size_t>(pageSize);
+
+	std::error_code error;
+	for (const auto &entry : std::filesystem::directory_iterator("/sys/devices/system/node", error)) {
+		const std::string name = entry.path().filename().string();
+		if (name.size() <= 4 || name.compare(0, 4, "node") || name.find_first_not_of("0123456789", 4) != std::string::npos)
+			continue;
+
+		std::ifstream file(entry.path() / "cpulist");
+		std::string list;
+		std::getline(file, list);
+		ids.push_back(std::stoi(name.substr(4)));
+		cpus.push_back(parseCpuList(list));
+	}
+
+	if (ids.empty()) {
+		ids.push_back(0);
+		cpus.emplace_back();
+	}
+
+	/* The directory isn't sorted */
+	std::vector<std::size_t> order(ids.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return ids[a] < ids[b]; });
+	std::vector<int> sortedIds;
+	std::vector<std::vector<int>> sortedCpus;
+	for (std::size_t k : order) {
+		sortedIds.push_back(ids[k]);
+		sortedCpus.push_back(std::move(cpus[k]));
+	}
+	ids.swap(sortedIds);
+	cpus.swap(sortedCpus);
+}
+
+std::size_t NumaTopology::nodeOfCpu(std::size_t cpu) const
+{
+	for (std::size_t node = 0; node < cpus.size(); node++) {
+		if (std::find(cpus[node].begin(), cpus[node].end(), static_cast<int>(cpu)) != cpus[node].end())
+			return node;
+	}
+	return 0;
+}
+
+bool NumaTopology::bindThread(std::size_t node) const
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus[node]) {
+		if (cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+	return CPU_COUNT(&set) && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool NumaTopology::place(const void *pages, std::size_t bytes, std::size_t node) const
+{
+#if HAVE_NUMA
+	if (!bytes)
+		return true;
+
+	constexpr std::size_t bitsPerWord = 8 * sizeof(unsigned long);
+	const std::size_t id = static_cast<std::size_t>(ids[node]);
+	std::vector<unsigned long> mask(id / bitsPerWord + 1);
+	mask[id / bitsPerWord] |= 1ul << (id % bitsPerWord);
+
+	/* The kernel drops the last bit of maxnode, as libnuma knows */
+	return syscall(SYS_mbind, pages, bytes, MPOL_PREFERRED, mask.data(),
+	               mask.size() * bitsPerWord + 1, MPOL_MF_MOVE) == 0;
+#else
+	return false;
+#endif
+}
+
+void NumaTopology::count(const void *pages, std::size_t bytes, std::size_t node, NumaReport &report) const
+{
+	const std::size_t nPages = bytes / page;
+#if HAVE_NUMA
+	std::vector<void *> addresses;
+	std::vector<int> status;
+	for (std::size_t first = 0; first < nPages; first += queryBatch) {
+		const std::size_t batch = std::min(queryBatch, nPages - first);
+		addresses.resize(batch);
+		status.resize(batch);
+		for (std::size_t k = 0; k < batch; k++)
+			addresses[k] = const_cast<std::byte *>(static_cast<const std::byte *>(pages)) + (first + k) * page;
+
+		/* With no target nodes, move_pages() only reports where every page is */
+		if (syscall(SYS_move_pages, 0, batch, addresses.data(), nullptr, status.data(), 0) != 0) {
+			report.unknownPages += nPages - first;
+			return;
+		}
+		for (int where : status) {
+			if (where < 0)
+				report.unknownPages++;
+			else if (where == ids[node])
+				report.localPages++;
+			else
+				report.remotePages++;
+		}
+	}
+#else
+	(void) node;
+	report.unknownPages += nPages;
+#endif
+}
+
+const NumaTopology &numaTopology()
+{
+	static const NumaTopology topology;
+	return topology;
+}
+
+/* The node a member of the step team works on */
+static std::size_t memberNode(const NumaTopology &topology, std::size_t member)
+{
+	const std::vector<std::size_t> &pinned = threadPlacement().cpus;
+	if (member < pinned.size())
+		return topology.nodeOfCpu(pinned[member]);
+	return topology.nodeOfMember(member, stepTeam.size());
+}
+
+/*
+ * Every member of the step team stays on its node (pinned members
+ * already do), and helps out the members of its node first
+ */
+static void bindTeam(const NumaTopology &topology)
+{
+	static std::once_flag bound;
+	std::call_once(bound, [&] {
+		std::vector<std::size_t> nodes(stepTeam.size());
+		for (std::size_t member = 0; member < nodes.size(); member++)
+			nodes[member] = memberNode(topology, member);
+		stepTeam.setGroups(nodes);
+
+		if (!threadPlacement().cpus.empty())
+			return;
+		stepTeam.run([&](std::size_t member) {
+			topology.bindThread(nodes[member]);
+		});
+	});
+}
+
+/*
+ * Moves each team member's share of the particle array to the member's
+ * node. Compaction swaps between two blocks, and a block is placed
+ * again only once merges moved the shares by more than an eighth of
+ * one, so the pages aren't migrated on every step that loses a
+ * particle. Pages go to the member owning the particle they start
+ * with; pages the array only shares with its neighbours in the heap
+ * are left alone.
+ */
+void ParticleSet::placeParticles()
+{
+	const NumaTopology &topology = numaTopology();
+	if (topology.nodes() < 2)
+		return;
+
+	const std::size_t n = infos.size();
+	const PlacedBlock block { infos.data(), infos.capacity(), n };
+	if (!n)
+		return;
+
+	const std::size_t members = stepTeam.size();
+	const std::size_t drift = n / (8 * members);
+	for (const PlacedBlock &placed : placedBlocks) {
+		if (placed.data == block.data && placed.capacity == block.capacity &&
+		    std::max(placed.count, n) - std::min(placed.count, n) <= drift)
+			return;
+	}
+
+	bindTeam(topology);
+
+	const bool first = numaReport.placement == 0;
+	NumaReport report = numaReport;
+	report.placement++;
+	report.nodes = topology.nodes();
+
+	/* Huge pages are moved whole, so shares are cut on their boundaries */
+	const std::size_t bytes = block.capacity * sizeof(ParticleInfo);
+	const std::uintptr_t base = reinterpret_cast<std::uintptr_t>(block.data);
+	const std::uintptr_t page = std::max(arenaPageSize(bytes), topology.pageSize());
+	const std::uintptr_t lo = (base + page - 1) / page * page;
+	const std::uintptr_t hi = std::max(lo, (base + bytes) / page * page);
+	auto boundary = [&](std::size_t member) {
+		if (member == 0)
+			return lo;
+		if (member == members)
+			return hi;
+		return std::clamp((base + stepTeam.rangeStart(n, member) * sizeof(ParticleInfo)) / page * page, lo, hi);
+	};
+
+	for (std::size_t member = 0; member < members; member++) {
+		const std::uintptr_t start = boundary(member);
+		const std::uintptr_t end = std::max(start, boundary(member + 1));
+		const std::size_t node = memberNode(topology, member);
+		topology.place(reinterpret_cast<const void *>(start), end - start, node);
+		if (first)
+			topology.count(reinterpret_cast<const void *>(start), end - start, node, report);
+	}
+
+	numaReport = report;
+	if (placedBlocks[0].data != block.data)
+		placedBlocks[1] = placedBlocks[0];
+	placedBlocks[0] = block;
+}
+
+const NumaReport &ParticleSet::getNumaReport() const
+{
+	return numaReport;
+}
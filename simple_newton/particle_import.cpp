@@ -0,0 +1,227 @@
+#include <main.hpp>
+#include <particle_import.hpp>
+
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/* A range of whole lines, and where its particles go */
+struct TextChunk {
+	const char *begin;
+	const char *end;
+	std::size_t particles = 0;
+	std::size_t lines = 0;
+	std::size_t firstParticle = 0;
+	std::size_t firstLine = 0;
+
+	/* Line number of the first malformed line, if any */
+	std::size_t badLine = 0;
+	bool bad = false;
+};
+
+}
+
+bool isBinaryImport(std::string_view fname)
+{
+	return fname.ends_with(".bin") || fname.ends_with(".raw");
+}
+
+static bool isSeparator(char c)
+{
+	return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+static const char *skipSeparators(const char *p, const char *end)
+{
+	while (p < end && isSeparator(*p))
+		p++;
+	return p;
+}
+
+/* Blank and comment lines don't hold a particle */
+static bool isDataLine(const char *p, const char *end)
+{
+	p = skipSeparators(p, end);
+	return p < end && *p != '#';
+}
+
+static const char *lineEnd(const char *p, const char *end)
+{
+	const void *nl = std::memchr(p, '\n', end - p);
+	return nl ? static_cast<const char *>(nl) : end;
+}
+
+static bool parseNumber(const char *&p, const char *end, double &value)
+{
+	p = skipSeparators(p, end);
+	if (p < end && *p == '+')
+		p++;
+	const auto [next, err] = std::from_chars(p, end, value);
+	if (err != std::errc() || next == p)
+		return false;
+	p = next;
+	return true;
+}
+
+static bool parseLine(const char *p, const char *end, ImportRecord &record)
+{
+	if (!parseNumber(p, end, record.x) ||
+	    !parseNumber(p, end, record.y) ||
+	    !parseNumber(p, end, record.vx) ||
+	    !parseNumber(p, end, record.vy) ||
+	    !parseNumber(p, end, record.mass))
+		return false;
+	return skipSeparators(p, end) == end;
+}
+
+/* The first line is a header if it holds anything but numbers */
+static bool isHeaderLine(const char *p, const char *end)
+{
+	p = skipSeparators(p, end);
+	return p < end && !(std::isdigit(static_cast<unsigned char>(*p)) || *p == '-' || *p == '+' || *p == '.');
+}
+
+/*
+ * Splits [begin, end) into chunks of whole lines and counts the
+ * particles in every chunk in parallel. A prefix sum over the counts
+ * then gives each chunk its place in the output, so the chunks can
+ * also be parsed in parallel, straight into place.
+ */
+static std::vector<TextChunk> countText(const char *begin, const char *end)
+{
+	std::size_t skipped = 0;
+	const char *first = begin;
+	while (first < end) {
+		const char *next = lineEnd(first, end);
+		if (isDataLine(first, next)) {
+			if (isHeaderLine(first, next)) {
+				first = next + 1;
+				skipped++;
+			}
+			break;
+		}
+		first = next + 1;
+		skipped++;
+	}
+
+	std::vector<TextChunk> chunks;
+	for (const char *p = std::min(first, end); p < end; ) {
+		const char *split = end;
+		if (static_cast<std::size_t>(end - p) > importChunkSize)
+			split = std::min(lineEnd(p + importChunkSize, end) + 1, end);
+		chunks.push_back(TextChunk { p, split });
+		p = split;
+	}
+
+	threadPool.detach_loop(std::size_t(0), chunks.size(), [&](std::size_t c) {
+		TextChunk &chunk = chunks[c];
+		for (const char *line = chunk.begin; line < chunk.end; chunk.lines++) {
+			const char *next = lineEnd(line, chunk.end);
+			chunk.particles += isDataLine(line, next);
+			line = next + 1;
+		}
+	});
+	threadPool.wait();
+
+	std::size_t particles = 0;
+	std::size_t lines = skipped;
+	for (TextChunk &chunk : chunks) {
+		chunk.firstParticle = particles;
+		chunk.firstLine = lines;
+		particles += chunk.particles;
+		lines += chunk.lines;
+	}
+	return chunks;
+}
+
+void ParticleSet::importFrom(const std::string &fname)
+{
+	const int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("failed to open " + fname + ": " + std::strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		const int err = errno;
+		close(fd);
+		throw std::runtime_error("failed to stat " + fname + ": " + std::strerror(err));
+	}
+
+	const std::size_t fileSize = static_cast<std::size_t>(st.st_size);
+	const bool binary = isBinaryImport(fname);
+	if (binary && fileSize % sizeof(ImportRecord) != 0) {
+		close(fd);
+		throw std::runtime_error(fname + " is not a whole number of particle records");
+	}
+	if (fileSize == 0) {
+		close(fd);
+		throw std::runtime_error(fname + " holds no particles");
+	}
+
+	void *map = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("failed to map " + fname + ": " + std::strerror(errno));
+	std::unique_ptr<void, std::function<void(void *)>> mapping(map, [fileSize](void *p) {
+		munmap(p, fileSize);
+	});
+	madvise(map, fileSize, MADV_SEQUENTIAL);
+
+	/* Filled on the side, so a failed import leaves the set as it was */
+	ArenaVector<ParticleInfo> imported;
+	if (binary) {
+		const auto *records = static_cast<const ImportRecord *>(map);
+		const std::size_t n = fileSize / sizeof(ImportRecord);
+		imported.resize(n);
+		threadPool.detach_blocks(std::size_t(0), n, [&](std::size_t start, std::size_t end) {
+			for (std::size_t i = start; i < end; i++)
+				imported[i] = ParticleInfo { { records[i].x, records[i].y }, { records[i].vx, records[i].vy }, records[i].mass };
+		});
+		threadPool.wait();
+	} else {
+		const char *text = static_cast<const char *>(map);
+		std::vector<TextChunk> chunks = countText(text, text + fileSize);
+		const std::size_t n = chunks.empty() ? 0 : chunks.back().firstParticle + chunks.back().particles;
+		if (!n)
+			throw std::runtime_error(fname + " holds no particles");
+
+		imported.resize(n);
+		threadPool.detach_loop(std::size_t(0), chunks.size(), [&](std::size_t c) {
+			TextChunk &chunk = chunks[c];
+			std::size_t i = chunk.firstParticle;
+			std::size_t lineNo = 0;
+			for (const char *line = chunk.begin; line < chunk.end; lineNo++) {
+				const char *next = lineEnd(line, chunk.end);
+				ImportRecord record;
+				if (isDataLine(line, next)) {
+					if (!parseLine(line, next, record)) {
+						chunk.badLine = chunk.firstLine + lineNo;
+						chunk.bad = true;
+						return;
+					}
+					imported[i++] = ParticleInfo { { record.x, record.y }, { record.vx, record.vy }, record.mass };
+				}
+				line = next + 1;
+			}
+		});
+		threadPool.wait();
+
+		for (const TextChunk &chunk : chunks) {
+			if (chunk.bad)
+				throw std::runtime_error(fname + ":" + std::to_string(chunk.badLine + 1) + ": expected x y vx vy mass");
+		}
+	}
+
+	infos.swap(imported);
+	stepCount = 0;
+	resetIds();
+}
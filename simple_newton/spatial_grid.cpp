@@ -0,0 +1,44 @@
+#include <spatial_grid.hpp>
+
+#include <algorithm>
+
+void SpatialGrid::resize(std::size_t n)
+{
+	std::size_t buckets = 64;
+	while (buckets < 2 * n)
+		buckets <<= 1;
+	mask = buckets - 1;
+
+	counts.assign(buckets, 0);
+
+	cellOf.resize(n);
+	sorted.resize(n);
+	bucketStart.resize(buckets + 1);
+}
+
+void SpatialGrid::scatter(std::size_t n)
+{
+	const std::size_t buckets = mask + 1;
+
+	/* Exclusive prefix sum; the counts become the write cursors */
+	std::uint32_t running = 0;
+	for (std::size_t b = 0; b < buckets; b++) {
+		bucketStart[b] = running;
+		running += counts[b];
+		counts[b] = bucketStart[b];
+	}
+	bucketStart[buckets] = running;
+
+	stealPool.parallelFor(0, n, buildGrain, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			const std::uint32_t slot = std::atomic_ref<std::uint32_t>(counts[cellOf[i]]).fetch_add(1, std::memory_order_relaxed);
+			sorted[slot] = static_cast<std::uint32_t>(i);
+		}
+	});
+
+	/* The scatter order depends on scheduling, undo that */
+	stealPool.parallelFor(0, buckets, buildGrain, [&](std::size_t start, std::size_t end) {
+		for (std::size_t b = start; b < end; b++)
+			std::sort(sorted.begin() + bucketStart[b], sorted.begin() + bucketStart[b + 1]);
+	});
+}
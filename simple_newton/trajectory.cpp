@@ -0,0 +1,711 @@
+#include <main.hpp>
+#include <trajectory.hpp>
+#include <trajectory_codec.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+static std::size_t alignUp(std::size_t n, std::size_t align)
+{
+	return (n + align - 1) / align * align;
+}
+
+#if HAVE_IO_URING
+/*
+ * Just enough of io_uring to keep a handful of writes in flight, talking
+ * to the kernel directly so we don't depend on liburing.
+ */
+class IoUring {
+	private:
+		int ringFd = -1;
+		void *sqRing = MAP_FAILED;
+		void *cqRing = MAP_FAILED;
+		std::size_t sqRingSize = 0;
+		std::size_t cqRingSize = 0;
+		io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+		std::size_t sqesSize = 0;
+
+		unsigned *sqHead, *sqTail, *sqArray;
+		unsigned *cqHead, *cqTail;
+		io_uring_cqe *cqes;
+		unsigned sqMask, cqMask, sqEntries;
+		unsigned localTail = 0;
+
+	public:
+		bool init(unsigned entries)
+		{
+			io_uring_params params{};
+			ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+			if (ringFd < 0)
+				return false;
+
+			sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			const bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+			if (singleMap)
+				sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+			sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+			if (sqRing == MAP_FAILED)
+				return false;
+
+			if (singleMap) {
+				cqRing = sqRing;
+			} else {
+				cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+				if (cqRing == MAP_FAILED)
+					return false;
+			}
+
+			sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+			sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+			if (sqes == MAP_FAILED)
+				return false;
+
+			auto *sq = static_cast<std::byte *>(sqRing);
+			auto *cq = static_cast<std::byte *>(cqRing);
+			sqHead  = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+			sqTail  = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+			sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+			sqMask  = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+			cqHead  = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+			cqTail  = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+			cqes    = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+			cqMask  = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+			sqEntries = params.sq_entries;
+			localTail = *sqTail;
+			return true;
+		}
+
+		bool registerBuffers(const iovec *iovecs, unsigned count)
+		{
+			return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iovecs, count) == 0;
+		}
+
+		/* Returns nullptr if the submission queue is full */
+		io_uring_sqe *getSqe()
+		{
+			const unsigned head = std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire);
+			if (localTail - head >= sqEntries)
+				return nullptr;
+
+			const unsigned index = localTail & sqMask;
+			sqArray[index] = index;
+			localTail++;
+
+			io_uring_sqe *sqe = &sqes[index];
+			std::memset(sqe, 0, sizeof(*sqe));
+			return sqe;
+		}
+
+		int submitAndWait(unsigned toSubmit, unsigned waitFor)
+		{
+			std::atomic_ref<unsigned>(*sqTail).store(localTail, std::memory_order_release);
+			const unsigned flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+			int ret;
+			do {
+				ret = static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor, flags, nullptr, 0));
+			} while (ret < 0 && errno == EINTR);
+			return ret;
+		}
+
+		bool popCqe(io_uring_cqe &out)
+		{
+			const unsigned head = *cqHead;
+			if (head == std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire))
+				return false;
+
+			out = cqes[head & cqMask];
+			std::atomic_ref<unsigned>(*cqHead).store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		~IoUring()
+		{
+			if (sqes != MAP_FAILED)
+				munmap(sqes, sqesSize);
+			if (cqRing != MAP_FAILED && cqRing != sqRing)
+				munmap(cqRing, cqRingSize);
+			if (sqRing != MAP_FAILED)
+				munmap(sqRing, sqRingSize);
+			if (ringFd >= 0)
+				close(ringFd);
+		}
+};
+#endif
+
+TrajectoryWriter::IndexRing::IndexRing(std::size_t capacity):
+	slots(capacity)
+{
+}
+
+bool TrajectoryWriter::IndexRing::push(std::uint32_t index)
+{
+	const std::size_t t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) == slots.size())
+		return false;
+
+	slots[t % slots.size()] = index;
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+bool TrajectoryWriter::IndexRing::pop(std::uint32_t &index)
+{
+	const std::size_t h = head.load(std::memory_order_relaxed);
+	if (h == tail.load(std::memory_order_acquire))
+		return false;
+
+	index = slots[h % slots.size()];
+	head.store(h + 1, std::memory_order_release);
+	return true;
+}
+
+std::size_t TrajectoryWriter::frameSize(std::size_t count)
+{
+	return alignUp(sizeof(TrajectoryFrameHeader) + count * sizeof(TrajectoryRecord), TrajectoryFileHeader::frameAlign);
+}
+
+TrajectoryWriter::TrajectoryWriter(const std::string &fname, std::size_t maxParticles, std::size_t nBuffers,
+                                   unsigned bits, std::uint32_t keyframeInterval):
+	readyRing(nBuffers), freeRing(nBuffers)
+{
+	if (bits)
+		encoder = std::make_unique<TrajectoryEncoder>(bits, keyframeInterval);
+
+	fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to create trajectory " + fname + ": " + std::strerror(errno));
+
+	std::byte first[TrajectoryFileHeader::frameAlign] = {};
+	TrajectoryFileHeader header{};
+	std::memcpy(header.magic, TrajectoryFileHeader::magicValue, sizeof(header.magic));
+	header.version = TrajectoryFileHeader::currentVersion;
+	header.headerSize = sizeof(TrajectoryFileHeader);
+	header.frameHeaderSize = sizeof(TrajectoryFrameHeader);
+	header.recordSize = sizeof(TrajectoryRecord);
+	std::memcpy(first, &header, sizeof(header));
+	if (pwrite(fd, first, sizeof(first), 0) != static_cast<ssize_t>(sizeof(first))) {
+		const int err = errno;
+		close(fd);
+		throw std::runtime_error("failed to write trajectory " + fname + ": " + std::strerror(err));
+	}
+	fileOffset = sizeof(first);
+
+	buffers.resize(nBuffers);
+	if (encoder)
+		encoded.resize(nBuffers);
+	try {
+		mapBuffers(frameSize(maxParticles));
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	for (std::size_t i = 0; i < nBuffers; i++)
+		freeRing.push(static_cast<std::uint32_t>(i));
+
+	startWriter();
+}
+
+/*
+ * One mapping for every buffer, locked so the kernel never has to
+ * fault it in mid-write. Encoded frames are never larger than raw
+ * ones, so with quantization the second half holds those. The writer
+ * thread must not be running.
+ */
+void TrajectoryWriter::mapBuffers(std::size_t capacity)
+{
+	const std::size_t nBuffers = buffers.size();
+	const std::size_t size = capacity * nBuffers * (encoder ? 2 : 1);
+	void *block = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (block == MAP_FAILED)
+		throw std::runtime_error("failed to allocate trajectory buffers");
+	if (mlock(block, size) != 0)
+		std::cerr << "trajectory buffers could not be pinned: " << std::strerror(errno) << std::endl;
+
+	if (pinned)
+		munmap(pinned, pinnedSize);
+	pinned = block;
+	pinnedSize = size;
+
+	for (std::size_t i = 0; i < nBuffers; i++) {
+		buffers[i].data = static_cast<std::byte *>(pinned) + i * capacity;
+		buffers[i].capacity = capacity;
+	}
+	for (std::size_t i = 0; i < encoded.size(); i++) {
+		encoded[i].data = static_cast<std::byte *>(pinned) + (nBuffers + i) * capacity;
+		encoded[i].capacity = capacity;
+	}
+}
+
+void TrajectoryWriter::startWriter()
+{
+	stopping.store(false, std::memory_order_relaxed);
+	thread = std::jthread([this]() {
+		writerLoop();
+	});
+}
+
+/* Returns once every submitted frame was written, or dropped */
+void TrajectoryWriter::stopWriter()
+{
+	stopping.store(true, std::memory_order_release);
+	readySeq.fetch_add(1, std::memory_order_release);
+	readySeq.notify_one();
+	thread.join();
+}
+
+void TrajectoryWriter::reserve(std::size_t maxParticles)
+{
+	const std::size_t capacity = frameSize(maxParticles);
+	if (capacity <= buffers.front().capacity || !thread.joinable())
+		return;
+
+	/* The writer thread holds on to the buffers until it's done with them */
+	stopWriter();
+	try {
+		mapBuffers(capacity);
+	} catch (...) {
+		startWriter();
+		throw;
+	}
+	startWriter();
+}
+
+TrajectoryWriter::Buffer *TrajectoryWriter::acquire(std::size_t frameSize)
+{
+	std::uint32_t index;
+	if (frameSize > buffers.front().capacity) {
+		if (!oversizeReported) {
+			oversizeReported = true;
+			std::cerr << "trajectory frames no longer fit the buffers, dropping them" << std::endl;
+		}
+		droppedFrames.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	if (!freeRing.pop(index)) {
+		droppedFrames.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	buffers[index].size = frameSize;
+	return &buffers[index];
+}
+
+void TrajectoryWriter::submit(Buffer *buffer)
+{
+	readyRing.push(static_cast<std::uint32_t>(buffer - buffers.data()));
+	readySeq.fetch_add(1, std::memory_order_release);
+	readySeq.notify_one();
+}
+
+void TrajectoryWriter::writeFailed(int err)
+{
+	if (!failed.exchange(true))
+		std::cerr << "trajectory write failed, no more frames will be recorded: " << std::strerror(err) << std::endl;
+}
+
+void TrajectoryWriter::release(std::uint32_t index, bool written)
+{
+	if (written)
+		writtenFrames.fetch_add(1, std::memory_order_relaxed);
+	else
+		droppedFrames.fetch_add(1, std::memory_order_relaxed);
+	freeRing.push(index);
+}
+
+TrajectoryWriter::Buffer &TrajectoryWriter::prepare(std::uint32_t index)
+{
+	if (!encoder)
+		return buffers[index];
+
+	const auto *raw = reinterpret_cast<const TrajectoryFrameHeader *>(buffers[index].data);
+	encoded[index].size = encoder->encode(raw, encoded[index].data);
+	return encoded[index];
+}
+
+void TrajectoryWriter::writerLoop()
+{
+	if (!uringLoop())
+		pwriteLoop();
+}
+
+void TrajectoryWriter::pwriteLoop()
+{
+	while (true) {
+		const bool stop = stopping.load(std::memory_order_acquire);
+		const std::uint32_t seq = readySeq.load(std::memory_order_acquire);
+
+		std::uint32_t index;
+		bool any = false;
+		while (readyRing.pop(index)) {
+			any = true;
+			const Buffer &buffer = prepare(index);
+			std::size_t done = 0;
+			while (!failed && done < buffer.size) {
+				const ssize_t ret = pwrite(fd, buffer.data + done, buffer.size - done, static_cast<off_t>(fileOffset + done));
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret <= 0)
+					writeFailed(ret < 0 ? errno : EIO);
+				else
+					done += static_cast<std::size_t>(ret);
+			}
+			if (!failed)
+				frameOffsets.push_back(fileOffset);
+			fileOffset += buffer.size;
+			release(index, !failed);
+		}
+
+		if (stop && !any)
+			return;
+		if (!any)
+			readySeq.wait(seq, std::memory_order_acquire);
+	}
+}
+
+bool TrajectoryWriter::uringLoop()
+{
+#if HAVE_IO_URING
+	IoUring ring;
+	if (!ring.init(static_cast<unsigned>(buffers.size())))
+		return false;
+
+	std::vector<Buffer> &wire = encoder ? encoded : buffers;
+	std::vector<iovec> iovecs(wire.size());
+	for (std::size_t i = 0; i < wire.size(); i++)
+		iovecs[i] = iovec { wire[i].data, wire[i].capacity };
+	const bool fixed = ring.registerBuffers(iovecs.data(), static_cast<unsigned>(iovecs.size()));
+
+	struct Pending {
+		std::uint64_t offset;
+		std::size_t done;
+	};
+	std::vector<Pending> pending(buffers.size());
+	unsigned inflight = 0;
+	unsigned toSubmit = 0;
+
+	/* There are never more writes in flight than buffers, so the queue can't overflow */
+	auto queueWrite = [&](std::uint32_t index) {
+		const Buffer &buffer = wire[index];
+		const Pending &p = pending[index];
+		io_uring_sqe *sqe = ring.getSqe();
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<std::uint64_t>(buffer.data + p.done);
+		sqe->len = static_cast<std::uint32_t>(std::min<std::size_t>(buffer.size - p.done, 1u << 30));
+		sqe->off = p.offset + p.done;
+		sqe->buf_index = fixed ? static_cast<std::uint16_t>(index) : 0;
+		sqe->user_data = index;
+		toSubmit++;
+		inflight++;
+	};
+
+	while (true) {
+		const bool stop = stopping.load(std::memory_order_acquire);
+		const std::uint32_t seq = readySeq.load(std::memory_order_acquire);
+
+		std::uint32_t index;
+		while (readyRing.pop(index)) {
+			if (failed) {
+				release(index, false);
+				continue;
+			}
+
+			pending[index] = Pending { fileOffset, 0 };
+			frameOffsets.push_back(fileOffset);
+			fileOffset += prepare(index).size;
+			queueWrite(index);
+		}
+
+		if (inflight == 0) {
+			if (stop)
+				return true;
+			readySeq.wait(seq, std::memory_order_acquire);
+			continue;
+		}
+
+		if (ring.submitAndWait(toSubmit, 1) < 0) {
+			writeFailed(errno);
+			return true;
+		}
+		toSubmit = 0;
+
+		io_uring_cqe cqe;
+		while (ring.popCqe(cqe)) {
+			inflight--;
+			index = static_cast<std::uint32_t>(cqe.user_data);
+			Pending &p = pending[index];
+
+			if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+				queueWrite(index);
+			} else if (cqe.res <= 0) {
+				writeFailed(cqe.res < 0 ? -cqe.res : EIO);
+				release(index, false);
+			} else if ((p.done += static_cast<std::size_t>(cqe.res)) < wire[index].size) {
+				queueWrite(index);
+			} else {
+				release(index, true);
+			}
+		}
+	}
+#else
+	return false;
+#endif
+}
+
+void TrajectoryWriter::finish()
+{
+	if (!thread.joinable())
+		return;
+
+	stopWriter();
+	writeIndex();
+}
+
+/*
+ * Only once every frame made it: a reader trusts the index, and without
+ * one it still finds the frames by walking them.
+ */
+void TrajectoryWriter::writeIndex()
+{
+	if (failed)
+		return;
+
+	TrajectoryIndexFooter footer{};
+	footer.indexOffset = fileOffset;
+	footer.frames = frameOffsets.size();
+	std::memcpy(footer.magic, TrajectoryIndexFooter::magicValue, sizeof(footer.magic));
+
+	const iovec parts[] = {
+		{ frameOffsets.data(), frameOffsets.size() * sizeof(std::uint64_t) },
+		{ &footer, sizeof(footer) }
+	};
+	const std::size_t size = parts[0].iov_len + parts[1].iov_len;
+	const ssize_t ret = pwritev(fd, parts, 2, static_cast<off_t>(fileOffset));
+	if (ret != static_cast<ssize_t>(size))
+		writeFailed(ret < 0 ? errno : EIO);
+}
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+	finish();
+	munmap(pinned, pinnedSize);
+	close(fd);
+}
+
+void ParticleSet::record(TrajectoryWriter &writer) const
+{
+	const std::size_t n = infos.size();
+	const std::size_t frameSize = TrajectoryWriter::frameSize(n);
+	TrajectoryWriter::Buffer *buffer = writer.acquire(frameSize);
+	if (!buffer)
+		return;
+
+	auto *header = reinterpret_cast<TrajectoryFrameHeader *>(buffer->data);
+	*header = TrajectoryFrameHeader{};
+	header->magic = TrajectoryFrameHeader::magicValue;
+	header->encoding = TrajectoryFrameHeader::ENCODING_RAW;
+	header->step = stepCount;
+	header->count = n;
+	header->frameSize = frameSize;
+
+	auto *records = reinterpret_cast<TrajectoryRecord *>(buffer->data + sizeof(TrajectoryFrameHeader));
+	/* stealPool waits only for this copy, not for whatever else is using the pool */
+	stealPool.parallelFor(0, n, 4096, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			records[i] = TrajectoryRecord {
+				infos[i].pos.x, infos[i].pos.y,
+				infos[i].veloc.x, infos[i].veloc.y,
+				infos[i].mass
+			};
+		}
+	});
+
+	std::byte *padding = reinterpret_cast<std::byte *>(records + n);
+	std::memset(padding, 0, buffer->data + frameSize - padding);
+	writer.submit(buffer);
+}
+
+TrajectoryReader::TrajectoryReader(const std::string &fname)
+{
+	const int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("failed to open trajectory " + fname + ": " + std::strerror(errno));
+
+	const off_t size = lseek(fd, 0, SEEK_END);
+	if (size < static_cast<off_t>(TrajectoryFileHeader::frameAlign)) {
+		close(fd);
+		throw std::runtime_error("trajectory " + fname + " is truncated");
+	}
+
+	fileSize = static_cast<std::size_t>(size);
+	void *map = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("failed to map trajectory " + fname + ": " + std::strerror(errno));
+	base = static_cast<const std::byte *>(map);
+
+	const auto *header = reinterpret_cast<const TrajectoryFileHeader *>(base);
+	const char *problem = nullptr;
+	if (std::memcmp(header->magic, TrajectoryFileHeader::magicValue, sizeof(header->magic)) != 0)
+		problem = "is not a trajectory";
+	else if (header->version < 1 || header->version > TrajectoryFileHeader::currentVersion)
+		problem = "has an unsupported version";
+	else if (header->frameHeaderSize != (header->version == 1 ? trajectoryFrameHeaderSizeV1 : sizeof(TrajectoryFrameHeader)) ||
+	         header->recordSize != sizeof(TrajectoryRecord))
+		problem = "has mismatched record sizes";
+	frameHeaderSize = header->frameHeaderSize;
+	decoder = std::make_unique<TrajectoryDecoder>();
+
+	if (problem) {
+		munmap(map, fileSize);
+		base = nullptr;
+		throw std::runtime_error("trajectory " + fname + " " + problem);
+	}
+
+	if (header->version < 3 || !readIndex())
+		scanFrames();
+
+	madvise(map, fileSize, MADV_SEQUENTIAL);
+}
+
+/*
+ * Whether a complete, sane frame starts at offset.
+ */
+bool TrajectoryReader::frameAt(std::uint64_t offset, const TrajectoryFrameHeader *&header) const
+{
+	if (offset > fileSize || fileSize - offset < sizeof(TrajectoryFrameHeader))
+		return false;
+
+	header = reinterpret_cast<const TrajectoryFrameHeader *>(base + offset);
+	if (header->magic != TrajectoryFrameHeader::magicValue ||
+	    header->frameSize < frameHeaderSize ||
+	    header->frameSize % alignof(TrajectoryRecord) != 0 ||
+	    header->frameSize > fileSize - offset)
+		return false;
+
+	const std::size_t payload = header->frameSize - frameHeaderSize;
+	switch (header->encoding) {
+		case TrajectoryFrameHeader::ENCODING_RAW:
+			return header->count <= payload / sizeof(TrajectoryRecord);
+		case TrajectoryFrameHeader::ENCODING_KEYFRAME:
+		case TrajectoryFrameHeader::ENCODING_DELTA:
+			return frameHeaderSize == sizeof(TrajectoryFrameHeader) &&
+			       header->bits >= 1 && header->bits <= 32 &&
+			       header->count <= payload * 8 / (2 * header->bits);
+		default:
+			return false;
+	}
+}
+
+/*
+ * Takes the frame offsets from the index at the end of the file, if
+ * there is a sane one. The frames themselves are checked as they're
+ * read.
+ */
+bool TrajectoryReader::readIndex()
+{
+	if (fileSize < TrajectoryFileHeader::frameAlign + sizeof(TrajectoryIndexFooter))
+		return false;
+
+	TrajectoryIndexFooter footer;
+	const std::size_t footerAt = fileSize - sizeof(footer);
+	std::memcpy(&footer, base + footerAt, sizeof(footer));
+	if (std::memcmp(footer.magic, TrajectoryIndexFooter::magicValue, sizeof(footer.magic)) != 0 ||
+	    footer.indexOffset < TrajectoryFileHeader::frameAlign || footer.indexOffset > footerAt ||
+	    (footerAt - footer.indexOffset) / sizeof(std::uint64_t) != footer.frames ||
+	    (footerAt - footer.indexOffset) % sizeof(std::uint64_t) != 0)
+		return false;
+
+	offsets.resize(footer.frames);
+	std::memcpy(offsets.data(), base + footer.indexOffset, footer.frames * sizeof(std::uint64_t));
+	for (std::size_t frame = 0; frame < offsets.size(); frame++) {
+		const std::uint64_t previous = frame ? offsets[frame - 1] : 0;
+		if (offsets[frame] <= previous || offsets[frame] < TrajectoryFileHeader::frameAlign || offsets[frame] >= footer.indexOffset) {
+			offsets.clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+void TrajectoryReader::scanFrames()
+{
+	offsets.clear();
+
+	/* A torn last frame, e.g. from a crash, just ends the recording */
+	std::uint64_t offset = TrajectoryFileHeader::frameAlign;
+	const TrajectoryFrameHeader *header;
+	while (frameAt(offset, header)) {
+		offsets.push_back(offset);
+		offset += header->frameSize;
+	}
+}
+
+const TrajectoryFrameHeader *TrajectoryReader::frameHeader(std::size_t frame) const
+{
+	const TrajectoryFrameHeader *header;
+	if (frame >= offsets.size() || !frameAt(offsets[frame], header))
+		throw std::runtime_error("trajectory frame is corrupt");
+	return header;
+}
+
+std::uint64_t TrajectoryReader::step(std::size_t frame) const
+{
+	return frameHeader(frame)->step;
+}
+
+void TrajectoryReader::read(std::size_t frame, std::vector<float> &x, std::vector<float> &y) const
+{
+	const TrajectoryFrameHeader *header = frameHeader(frame);
+	if (header->encoding != TrajectoryFrameHeader::ENCODING_RAW) {
+		const TrajectoryFrameHeader *keyframe = nullptr;
+		if (header->encoding == TrajectoryFrameHeader::ENCODING_DELTA && header->keyDistance <= frame)
+			keyframe = frameHeader(frame - header->keyDistance);
+		decoder->decode(header, keyframe, x, y);
+		return;
+	}
+
+	const auto *records = reinterpret_cast<const TrajectoryRecord *>(reinterpret_cast<const std::byte *>(header) + frameHeaderSize);
+	const std::size_t n = header->count;
+
+	x.resize(n);
+	y.resize(n);
+	threadPool.detach_blocks(std::size_t(0), n, [&](std::size_t start, std::size_t end) {
+		for (std::size_t i = start; i < end; i++) {
+			x[i] = static_cast<float>(records[i].x);
+			y[i] = static_cast<float>(records[i].y);
+		}
+	});
+	threadPool.wait();
+}
+
+void TrajectoryReader::prefetch(std::size_t frame) const
+{
+	const TrajectoryFrameHeader *header;
+	if (frame >= offsets.size() || !frameAt(offsets[frame], header))
+		return;
+
+	madvise(const_cast<std::byte *>(base + offsets[frame]), header->frameSize, MADV_WILLNEED);
+}
+
+TrajectoryReader::~TrajectoryReader()
+{
+	if (base)
+		munmap(const_cast<std::byte *>(base), fileSize);
+}
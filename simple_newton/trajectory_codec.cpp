@@ -0,0 +1,288 @@
+#include <main.hpp>
+#include <trajectory_codec.hpp>
+
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+static constexpr std::size_t frameSizeAlign = 64;
+
+namespace {
+
+class BitWriter {
+	private:
+		std::byte *out;
+		std::uint64_t acc = 0;
+		unsigned pending = 0;
+
+	public:
+		explicit BitWriter(std::byte *out):
+			out(out) {}
+
+		void put(std::uint32_t value, unsigned width)
+		{
+			acc |= static_cast<std::uint64_t>(value) << pending;
+			pending += width;
+			while (pending >= 8) {
+				*out++ = static_cast<std::byte>(acc);
+				acc >>= 8;
+				pending -= 8;
+			}
+		}
+
+		void flush()
+		{
+			if (pending)
+				*out++ = static_cast<std::byte>(acc);
+			acc = 0;
+			pending = 0;
+		}
+};
+
+class BitReader {
+	private:
+		const std::byte *in;
+		std::uint64_t acc = 0;
+		unsigned avail = 0;
+
+	public:
+		explicit BitReader(const std::byte *in):
+			in(in) {}
+
+		std::uint32_t get(unsigned width)
+		{
+			while (avail < width) {
+				acc |= static_cast<std::uint64_t>(*in++) << avail;
+				avail += 8;
+			}
+			const std::uint32_t value = static_cast<std::uint32_t>(acc & ((std::uint64_t(1) << width) - 1));
+			acc >>= width;
+			avail -= width;
+			return value;
+		}
+};
+
+struct Bounds {
+	double min[2] = {  std::numeric_limits<double>::infinity(),  std::numeric_limits<double>::infinity() };
+	double max[2] = { -std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity() };
+
+	bool finite() const
+	{
+		return std::isfinite(min[0]) && std::isfinite(min[1]) &&
+		       std::isfinite(max[0]) && std::isfinite(max[1]);
+	}
+};
+
+}
+
+static std::size_t numBlocks(std::size_t count)
+{
+	return (count + codecBlockSize - 1) / codecBlockSize;
+}
+
+/* Blocks hold a multiple of 8 coordinates, so every block starts on a byte */
+static std::size_t blockOffset(std::size_t block, unsigned bits)
+{
+	return block * codecBlockSize * 2 * bits / 8;
+}
+
+std::size_t packedSize(std::size_t count, unsigned bits)
+{
+	return (count * 2 * bits + 7) / 8;
+}
+
+/*
+ * Runs fn(block, first, last) over every block on the work-stealing
+ * pool. It takes several callers at once, so the writer thread neither
+ * queues behind the simulation's steps nor makes them wait for it.
+ */
+template <class Fn>
+static void forEachBlock(std::size_t count, Fn &&fn)
+{
+	stealPool.parallelFor(0, numBlocks(count), 1, [&](std::size_t firstBlock, std::size_t lastBlock) {
+		for (std::size_t block = firstBlock; block < lastBlock; block++) {
+			const std::size_t first = block * codecBlockSize;
+			fn(block, first, std::min(first + codecBlockSize, count));
+		}
+	});
+}
+
+/* Per-block partial bounds, merged in block order */
+template <class CoordFn>
+static Bounds bounds(std::size_t count, CoordFn &&coord)
+{
+	std::vector<Bounds> partial(numBlocks(count));
+	forEachBlock(count, [&](std::size_t block, std::size_t first, std::size_t last) {
+		Bounds b;
+		for (std::size_t i = first; i < last; i++) {
+			for (int axis = 0; axis < 2; axis++) {
+				const double v = coord(i, axis);
+				b.min[axis] = std::min(b.min[axis], v);
+				b.max[axis] = std::max(b.max[axis], v);
+			}
+		}
+		partial[block] = b;
+	});
+
+	Bounds total;
+	for (const Bounds &b : partial) {
+		for (int axis = 0; axis < 2; axis++) {
+			total.min[axis] = std::min(total.min[axis], b.min[axis]);
+			total.max[axis] = std::max(total.max[axis], b.max[axis]);
+		}
+	}
+	return total;
+}
+
+TrajectoryEncoder::TrajectoryEncoder(unsigned bits, std::uint32_t keyframeInterval):
+	bits(bits), keyframeInterval(std::max<std::uint32_t>(keyframeInterval, 1)), sinceKeyframe(this->keyframeInterval)
+{
+	if (bits < 1 || bits > 32)
+		throw std::invalid_argument("trajectory quantization must be 1 to 32 bits");
+}
+
+std::size_t TrajectoryEncoder::encodeRaw(const TrajectoryFrameHeader *raw, std::byte *out)
+{
+	std::memcpy(out, raw, raw->frameSize);
+	sinceKeyframe = keyframeInterval;
+	return raw->frameSize;
+}
+
+std::size_t TrajectoryEncoder::encode(const TrajectoryFrameHeader *raw, std::byte *out)
+{
+	const auto *records = reinterpret_cast<const TrajectoryRecord *>(raw + 1);
+	const std::size_t n = raw->count;
+	auto position = [&](std::size_t i, int axis) {
+		return axis ? records[i].y : records[i].x;
+	};
+
+	TrajectoryFrameHeader header = *raw;
+	unsigned width = bits;
+	bool keyframe = sinceKeyframe >= keyframeInterval || keyX.size() != n;
+
+	if (!keyframe) {
+		const Bounds b = bounds(n, [&](std::size_t i, int axis) {
+			return position(i, axis) - (axis ? keyY[i] : keyX[i]);
+		});
+
+		/* Fall back to a keyframe once the offsets need as many bits */
+		double levels = 0;
+		for (int axis = 0; axis < 2; axis++)
+			levels = std::max(levels, std::ceil((b.max[axis] - b.min[axis]) / keyScale[axis]));
+
+		if (!b.finite() || levels >= std::ldexp(1.0, static_cast<int>(bits))) {
+			keyframe = true;
+		} else {
+			width = std::max(1u, static_cast<unsigned>(std::bit_width(static_cast<std::uint64_t>(levels))));
+			header.encoding = TrajectoryFrameHeader::ENCODING_DELTA;
+			header.keyDistance = sinceKeyframe;
+			for (int axis = 0; axis < 2; axis++) {
+				header.origin[axis] = b.min[axis];
+				header.scale[axis] = keyScale[axis];
+			}
+		}
+	}
+
+	if (keyframe) {
+		const Bounds b = bounds(n, position);
+		if (!b.finite())
+			return encodeRaw(raw, out);
+
+		const double maxLevel = std::ldexp(1.0, static_cast<int>(bits)) - 1;
+		header.encoding = TrajectoryFrameHeader::ENCODING_KEYFRAME;
+		header.keyDistance = 0;
+		for (int axis = 0; axis < 2; axis++) {
+			const double range = b.max[axis] - b.min[axis];
+			header.origin[axis] = b.min[axis];
+			header.scale[axis] = range > 0 ? range / maxLevel : 1.0;
+			keyScale[axis] = header.scale[axis];
+		}
+
+		keyX.resize(n);
+		keyY.resize(n);
+		sinceKeyframe = 0;
+	}
+
+	header.bits = width;
+	std::byte *payload = out + sizeof(TrajectoryFrameHeader);
+	const double maxQ = std::ldexp(1.0, static_cast<int>(width)) - 1;
+
+	forEachBlock(n, [&](std::size_t block, std::size_t first, std::size_t last) {
+		BitWriter writer(payload + blockOffset(block, width));
+		for (std::size_t i = first; i < last; i++) {
+			for (int axis = 0; axis < 2; axis++) {
+				double *key = axis ? keyY.data() : keyX.data();
+				const double v = keyframe ? position(i, axis) : position(i, axis) - key[i];
+				const double q = std::clamp(std::round((v - header.origin[axis]) / header.scale[axis]), 0.0, maxQ);
+				writer.put(static_cast<std::uint32_t>(q), width);
+
+				if (keyframe)
+					key[i] = header.origin[axis] + q * header.scale[axis];
+			}
+		}
+		writer.flush();
+	});
+
+	sinceKeyframe++;
+
+	const std::size_t used = sizeof(TrajectoryFrameHeader) + packedSize(n, width);
+	header.frameSize = (used + frameSizeAlign - 1) / frameSizeAlign * frameSizeAlign;
+	std::memcpy(out, &header, sizeof(header));
+	std::memset(out + used, 0, header.frameSize - used);
+	return header.frameSize;
+}
+
+void TrajectoryDecoder::decodeKeyframe(const TrajectoryFrameHeader *keyframe)
+{
+	const std::size_t n = keyframe->count;
+	const unsigned width = keyframe->bits;
+	const auto *payload = reinterpret_cast<const std::byte *>(keyframe + 1);
+
+	keyX.resize(n);
+	keyY.resize(n);
+	forEachBlock(n, [&](std::size_t block, std::size_t first, std::size_t last) {
+		BitReader reader(payload + blockOffset(block, width));
+		for (std::size_t i = first; i < last; i++) {
+			keyX[i] = keyframe->origin[0] + reader.get(width) * keyframe->scale[0];
+			keyY[i] = keyframe->origin[1] + reader.get(width) * keyframe->scale[1];
+		}
+	});
+	cachedKeyframe = keyframe;
+}
+
+void TrajectoryDecoder::decode(const TrajectoryFrameHeader *frame, const TrajectoryFrameHeader *keyframe,
+                               std::vector<float> &x, std::vector<float> &y)
+{
+	const std::size_t n = frame->count;
+	x.resize(n);
+	y.resize(n);
+
+	if (frame->encoding == TrajectoryFrameHeader::ENCODING_KEYFRAME) {
+		if (cachedKeyframe != frame)
+			decodeKeyframe(frame);
+		forEachBlock(n, [&](std::size_t, std::size_t first, std::size_t last) {
+			for (std::size_t i = first; i < last; i++) {
+				x[i] = static_cast<float>(keyX[i]);
+				y[i] = static_cast<float>(keyY[i]);
+			}
+		});
+		return;
+	}
+
+	if (!keyframe || keyframe->encoding != TrajectoryFrameHeader::ENCODING_KEYFRAME || keyframe->count != n)
+		throw std::runtime_error("trajectory delta frame doesn't match its keyframe");
+	if (cachedKeyframe != keyframe)
+		decodeKeyframe(keyframe);
+
+	const unsigned width = frame->bits;
+	const auto *payload = reinterpret_cast<const std::byte *>(frame + 1);
+	forEachBlock(n, [&](std::size_t block, std::size_t first, std::size_t last) {
+		BitReader reader(payload + blockOffset(block, width));
+		for (std::size_t i = first; i < last; i++) {
+			x[i] = static_cast<float>(keyX[i] + frame->origin[0] + reader.get(width) * frame->scale[0]);
+			y[i] = static_cast<float>(keyY[i] + frame->origin[1] + reader.get(width) * frame->scale[1]);
+		}
+	});
+}
@@ -0,0 +1,458 @@
+#include <main.hpp>
+#include <transport.hpp>
+
+#include <cerrno>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* How long ranks wait for each other while connecting */
+static constexpr int connectTimeoutMs = 60000;
+static constexpr int connectRetryMs = 100;
+
+/* Anything longer is a corrupt header, not a message */
+static constexpr std::uint64_t maxMessage = std::uint64_t(1) << 40;
+
+namespace {
+
+struct Endpoint {
+	bool local;
+	std::string path;
+	std::string host;
+	std::string port;
+};
+
+}
+
+static std::runtime_error socketError(const std::string &what)
+{
+	return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+/* Paths (anything with a slash) are Unix sockets, the rest is host:port */
+static Endpoint parseAddress(const std::string &address)
+{
+	Endpoint endpoint { false, {}, {}, {} };
+	if (address.find('/') != std::string::npos) {
+		endpoint.local = true;
+		endpoint.path = address;
+		return endpoint;
+	}
+
+	const std::size_t colon = address.rfind(':');
+	if (colon == std::string::npos || colon + 1 == address.size())
+		throw std::runtime_error("expected a socket path or host:port, got " + address);
+	endpoint.host = address.substr(0, colon);
+	endpoint.port = address.substr(colon + 1);
+	if (endpoint.host.size() >= 2 && endpoint.host.front() == '[' && endpoint.host.back() == ']')
+		endpoint.host = endpoint.host.substr(1, endpoint.host.size() - 2);
+	return endpoint;
+}
+
+static sockaddr_un unixAddress(const std::string &path)
+{
+	sockaddr_un address {};
+	if (path.size() >= sizeof(address.sun_path))
+		throw std::runtime_error("socket path too long: " + path);
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	return address;
+}
+
+static addrinfo *resolve(const Endpoint &endpoint, bool passive)
+{
+	addrinfo hints {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	addrinfo *result = nullptr;
+	const int error = getaddrinfo(endpoint.host.empty() ? nullptr : endpoint.host.c_str(),
+	                              endpoint.port.c_str(), &hints, &result);
+	if (error)
+		throw std::runtime_error("can't resolve " + endpoint.host + ": " + gai_strerror(error));
+	return result;
+}
+
+/* Small messages go out right away rather than waiting for more */
+static void tuneSocket(int fd, bool tcp)
+{
+	if (tcp) {
+		const int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+}
+
+static int listenOn(const Endpoint &endpoint, std::size_t backlog)
+{
+	if (endpoint.local) {
+		const sockaddr_un address = unixAddress(endpoint.path);
+		const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			throw socketError("can't create a socket");
+		unlink(endpoint.path.c_str());
+		if (bind(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+		    listen(fd, static_cast<int>(backlog)) != 0) {
+			close(fd);
+			throw socketError("can't listen on " + endpoint.path);
+		}
+		return fd;
+	}
+
+	addrinfo *addresses = resolve(endpoint, true);
+	int fd = -1;
+	for (addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+		if (fd < 0)
+			continue;
+		const int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, a->ai_addr, a->ai_addrlen) != 0 || listen(fd, static_cast<int>(backlog)) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	if (fd < 0)
+		throw socketError("can't listen on " + endpoint.host + ":" + endpoint.port);
+	return fd;
+}
+
+/* Retries until the other side listens, as ranks start in any order */
+static int connectTo(const std::string &address)
+{
+	const Endpoint endpoint = parseAddress(address);
+	for (int waited = 0; ; waited += connectRetryMs) {
+		int fd = -1;
+		if (endpoint.local) {
+			const sockaddr_un target = unixAddress(endpoint.path);
+			fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (fd >= 0 && connect(fd, reinterpret_cast<const sockaddr *>(&target), sizeof(target)) != 0) {
+				close(fd);
+				fd = -1;
+			}
+		} else {
+			addrinfo *addresses = resolve(endpoint, false);
+			for (addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+				fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+				if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+					close(fd);
+					fd = -1;
+				}
+			}
+			freeaddrinfo(addresses);
+		}
+
+		if (fd >= 0) {
+			tuneSocket(fd, !endpoint.local);
+			return fd;
+		}
+		if (waited >= connectTimeoutMs)
+			throw socketError("can't connect to " + address);
+		std::this_thread::sleep_for(std::chrono::milliseconds(connectRetryMs));
+	}
+}
+
+static int acceptFrom(int listener, bool tcp)
+{
+	pollfd waiting { listener, POLLIN, 0 };
+	const int ready = poll(&waiting, 1, connectTimeoutMs);
+	if (ready == 0)
+		throw std::runtime_error("timed out waiting for the other ranks");
+	const int fd = ready > 0 ? accept4(listener, nullptr, nullptr, SOCK_CLOEXEC) : -1;
+	if (fd < 0)
+		throw socketError("can't accept a rank");
+	tuneSocket(fd, tcp);
+	return fd;
+}
+
+/* Where the socket is bound on this side, as host:port */
+static std::string localAddress(int fd)
+{
+	sockaddr_storage address {};
+	socklen_t length = sizeof(address);
+	if (getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+		throw socketError("can't find the local address");
+
+	char host[INET6_ADDRSTRLEN] = {};
+	if (address.ss_family == AF_INET6) {
+		const sockaddr_in6 &v6 = reinterpret_cast<const sockaddr_in6 &>(address);
+		inet_ntop(AF_INET6, &v6.sin6_addr, host, sizeof(host));
+		return "[" + std::string(host) + "]:" + std::to_string(ntohs(v6.sin6_port));
+	}
+	const sockaddr_in &v4 = reinterpret_cast<const sockaddr_in &>(address);
+	inet_ntop(AF_INET, &v4.sin_addr, host, sizeof(host));
+	return std::string(host) + ":" + std::to_string(ntohs(v4.sin_port));
+}
+
+static void writeAll(int fd, const void *data, std::size_t n)
+{
+	const std::uint8_t *bytes = static_cast<const std::uint8_t *>(data);
+	while (n) {
+		const ssize_t written = ::send(fd, bytes, n, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			throw socketError("lost the connection to a rank");
+		bytes += written;
+		n -= static_cast<std::size_t>(written);
+	}
+}
+
+static void readAll(int fd, void *data, std::size_t n)
+{
+	std::uint8_t *bytes = static_cast<std::uint8_t *>(data);
+	while (n) {
+		const ssize_t got = recv(fd, bytes, n, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got == 0)
+			throw std::runtime_error("a rank hung up");
+		if (got < 0)
+			throw socketError("lost the connection to a rank");
+		bytes += got;
+		n -= static_cast<std::size_t>(got);
+	}
+}
+
+PeerMesh::PeerMesh(const std::string &address, std::size_t rank, std::size_t ranks):
+	rankId(rank), nRanks(ranks), sockets(ranks, -1), transfers(ranks), polls(ranks)
+{
+	if (rank >= ranks)
+		throw std::runtime_error("rank " + std::to_string(rank) + " out of " + std::to_string(ranks));
+
+	try {
+		connectAll(address);
+	} catch (...) {
+		for (int fd : sockets) {
+			if (fd >= 0)
+				close(fd);
+		}
+		throw;
+	}
+}
+
+PeerMesh::~PeerMesh()
+{
+	for (int fd : sockets) {
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+void PeerMesh::connectAll(const std::string &address)
+{
+	const Endpoint endpoint = parseAddress(address);
+	Buffer message;
+
+	if (rankId == 0) {
+		const int listener = listenOn(endpoint, nRanks);
+		std::vector<std::string> addresses(nRanks);
+		try {
+			for (std::size_t k = 1; k < nRanks; k++) {
+				const int fd = acceptFrom(listener, !endpoint.local);
+				Buffer hello;
+				std::uint64_t length;
+				readAll(fd, &length, sizeof(length));
+				if (length > 4096) {
+					close(fd);
+					throw std::runtime_error("unexpected connection while waiting for the ranks");
+				}
+				hello.resize(length);
+				readAll(fd, hello.data(), hello.size());
+
+				MessageReader reader(hello);
+				const std::size_t rank = reader.get<std::uint64_t>();
+				const std::size_t ranks = reader.get<std::uint64_t>();
+				if (ranks != nRanks || rank == 0 || rank >= nRanks || sockets[rank] >= 0) {
+					close(fd);
+					throw std::runtime_error("rank " + std::to_string(rank) + " of " + std::to_string(ranks) +
+					                         " doesn't fit a run of " + std::to_string(nRanks));
+				}
+				sockets[rank] = fd;
+				addresses[rank].resize(hello.size() - 2 * sizeof(std::uint64_t));
+				reader.getValues(addresses[rank].data(), addresses[rank].size());
+			}
+		} catch (...) {
+			close(listener);
+			throw;
+		}
+		close(listener);
+		if (endpoint.local)
+			unlink(endpoint.path.c_str());
+
+		for (const std::string &peer : addresses) {
+			putValue<std::uint64_t>(message, peer.size());
+			putValues(message, peer.data(), peer.size());
+		}
+		for (std::size_t rank = 1; rank < nRanks; rank++)
+			send(rank, message);
+		return;
+	}
+
+	sockets[0] = connectTo(address);
+
+	/* Our own address, for the ranks above us to connect to */
+	Endpoint own = endpoint;
+	if (endpoint.local) {
+		own.path = endpoint.path + "." + std::to_string(rankId);
+	} else {
+		own = parseAddress(localAddress(sockets[0]));
+		own.port = "0";
+	}
+	const int listener = listenOn(own, nRanks);
+	const std::string ownAddress = own.local ? own.path : localAddress(listener);
+
+	try {
+		putValue<std::uint64_t>(message, rankId);
+		putValue<std::uint64_t>(message, nRanks);
+		putValues(message, ownAddress.data(), ownAddress.size());
+		send(0, message);
+
+		receive(0, message);
+		MessageReader reader(message);
+		std::vector<std::string> addresses(nRanks);
+		for (std::string &peer : addresses) {
+			peer.resize(reader.get<std::uint64_t>());
+			reader.getValues(peer.data(), peer.size());
+		}
+
+		/* Lower ranks are already listening; higher ones connect to us */
+		for (std::size_t rank = 1; rank < rankId; rank++) {
+			sockets[rank] = connectTo(addresses[rank]);
+			const std::uint64_t self = rankId;
+			writeAll(sockets[rank], &self, sizeof(self));
+		}
+		for (std::size_t k = rankId + 1; k < nRanks; k++) {
+			const int fd = acceptFrom(listener, !own.local);
+			std::uint64_t rank = 0;
+			readAll(fd, &rank, sizeof(rank));
+			if (rank <= rankId || rank >= nRanks || sockets[rank] >= 0) {
+				close(fd);
+				throw std::runtime_error("unexpected connection from rank " + std::to_string(rank));
+			}
+			sockets[rank] = fd;
+		}
+	} catch (...) {
+		close(listener);
+		if (own.local)
+			unlink(own.path.c_str());
+		throw;
+	}
+	close(listener);
+	if (own.local)
+		unlink(own.path.c_str());
+}
+
+void PeerMesh::send(std::size_t peer, const Buffer &message)
+{
+	const std::uint64_t length = message.size();
+	writeAll(sockets[peer], &length, sizeof(length));
+	writeAll(sockets[peer], message.data(), message.size());
+}
+
+void PeerMesh::receive(std::size_t peer, Buffer &message)
+{
+	std::uint64_t length;
+	readAll(sockets[peer], &length, sizeof(length));
+	if (length > maxMessage)
+		throw std::runtime_error("corrupt message from rank " + std::to_string(peer));
+	resizeWithSlack(message, length);
+	readAll(sockets[peer], message.data(), message.size());
+}
+
+void PeerMesh::exchange(const std::vector<Buffer> &out, std::vector<Buffer> &in)
+{
+	constexpr std::size_t header = sizeof(std::uint64_t);
+
+	in.resize(nRanks);
+	in[rankId].assign(out[rankId].begin(), out[rankId].end());
+
+	std::size_t pending = 0;
+	for (std::size_t peer = 0; peer < nRanks; peer++) {
+		transfers[peer] = Transfer { out[peer].size(), 0, 0, 0 };
+		if (peer != rankId)
+			pending += 2;
+	}
+
+	while (pending) {
+		for (std::size_t peer = 0; peer < nRanks; peer++) {
+			const Transfer &t = transfers[peer];
+			short events = 0;
+			if (peer != rankId && t.sent < header + t.sendLength)
+				events |= POLLOUT;
+			if (peer != rankId && (t.received < header || t.received < header + t.receiveLength))
+				events |= POLLIN;
+			/* Negative descriptors are skipped */
+			polls[peer] = pollfd { events ? sockets[peer] : -1, events, 0 };
+		}
+		if (poll(polls.data(), polls.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			throw socketError("can't wait for the other ranks");
+		}
+
+		for (std::size_t peer = 0; peer < nRanks; peer++) {
+			const short revents = polls[peer].revents;
+			if (polls[peer].fd < 0 || !revents)
+				continue;
+			Transfer &t = transfers[peer];
+			const int fd = sockets[peer];
+
+			if ((revents & (POLLOUT | POLLERR)) && t.sent < header + t.sendLength) {
+				/* Whatever is left of the length, then of the message */
+				iovec parts[2];
+				int nParts = 0;
+				if (t.sent < header)
+					parts[nParts++] = iovec { reinterpret_cast<std::uint8_t *>(&t.sendLength) + t.sent, header - t.sent };
+				const std::size_t body = t.sent > header ? t.sent - header : 0;
+				if (body < t.sendLength)
+					parts[nParts++] = iovec { const_cast<std::uint8_t *>(out[peer].data()) + body, t.sendLength - body };
+
+				msghdr msg {};
+				msg.msg_iov = parts;
+				msg.msg_iovlen = nParts;
+				const ssize_t written = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+				if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					throw socketError("lost the connection to rank " + std::to_string(peer));
+				if (written > 0) {
+					t.sent += static_cast<std::size_t>(written);
+					if (t.sent == header + t.sendLength)
+						pending--;
+				}
+			}
+
+			if ((revents & (POLLIN | POLLHUP | POLLERR)) && (t.received < header || t.received < header + t.receiveLength)) {
+				std::uint8_t *into;
+				std::size_t want;
+				if (t.received < header) {
+					into = reinterpret_cast<std::uint8_t *>(&t.receiveLength) + t.received;
+					want = header - t.received;
+				} else {
+					into = in[peer].data() + (t.received - header);
+					want = header + t.receiveLength - t.received;
+				}
+
+				const ssize_t got = recv(fd, into, want, MSG_DONTWAIT);
+				if (got == 0)
+					throw std::runtime_error("rank " + std::to_string(peer) + " hung up");
+				if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					throw socketError("lost the connection to rank " + std::to_string(peer));
+				if (got > 0) {
+					t.received += static_cast<std::size_t>(got);
+					if (t.received == header) {
+						if (t.receiveLength > maxMessage)
+							throw std::runtime_error("corrupt message from rank " + std::to_string(peer));
+						resizeWithSlack(in[peer], t.receiveLength);
+					}
+					if (t.received >= header && t.received == header + t.receiveLength)
+						pending--;
+				}
+			}
+		}
+	}
+}
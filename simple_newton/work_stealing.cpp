@@ -0,0 +1,307 @@
+#include <work_stealing.hpp>
+
+#include <algorithm>
+#include <bit>
+
+/* How often an idle thread looks for work before it goes to sleep */
+static constexpr unsigned spinRounds = 64;
+
+static constexpr std::size_t noSlot = ~std::size_t(0);
+
+struct WorkStealingPool::CallerSlot {
+	std::shared_ptr<Callers> callers;
+	/* Into workers, and for calling threads, the bit taken in callers */
+	std::size_t index = noSlot;
+	std::size_t caller = noSlot;
+
+	void release()
+	{
+		if (caller != noSlot)
+			callers->taken.fetch_and(~(std::uint32_t(1) << caller), std::memory_order_release);
+		caller = noSlot;
+	}
+
+	~CallerSlot()
+	{
+		release();
+	}
+};
+
+thread_local WorkStealingPool::CallerSlot WorkStealingPool::callerSlot;
+
+void WorkStealingPool::Deque::store(std::int64_t index, const Task &task)
+{
+	Slot &slot = slots[index & (capacity - 1)];
+	slot.job.store(task.job, std::memory_order_relaxed);
+	slot.start.store(task.start, std::memory_order_relaxed);
+	slot.end.store(task.end, std::memory_order_relaxed);
+}
+
+WorkStealingPool::Task WorkStealingPool::Deque::load(std::int64_t index) const
+{
+	const Slot &slot = slots[index & (capacity - 1)];
+	return Task {
+		slot.job.load(std::memory_order_relaxed),
+		slot.start.load(std::memory_order_relaxed),
+		slot.end.load(std::memory_order_relaxed)
+	};
+}
+
+bool WorkStealingPool::Deque::push(const Task &task)
+{
+	const std::int64_t b = bottom.load(std::memory_order_relaxed);
+	const std::int64_t t = top.load(std::memory_order_acquire);
+	if (b - t >= capacity)
+		return false;
+
+	store(b, task);
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom.store(b + 1, std::memory_order_relaxed);
+	return true;
+}
+
+bool WorkStealingPool::Deque::take(Task &task)
+{
+	const std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+	bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	std::int64_t t = top.load(std::memory_order_relaxed);
+
+	if (t > b) {
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return false;
+	}
+
+	task = load(b);
+	if (t < b)
+		return true;
+
+	/* The last one left, race the thieves for it */
+	const bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+	bottom.store(b + 1, std::memory_order_relaxed);
+	return won;
+}
+
+bool WorkStealingPool::Deque::steal(Task &task)
+{
+	std::int64_t t = top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	const std::int64_t b = bottom.load(std::memory_order_acquire);
+	if (t >= b)
+		return false;
+
+	task = load(t);
+	return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+WorkStealingPool::WorkStealingPool(std::size_t nThreads)
+{
+	start(nThreads, {});
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	stop();
+}
+
+void WorkStealingPool::reset(std::size_t nThreads, const std::function<void(std::size_t)> &init)
+{
+	stop();
+	start(nThreads, init);
+}
+
+void WorkStealingPool::start(std::size_t nThreads, const std::function<void(std::size_t)> &init)
+{
+	if (!nThreads)
+		nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	nWorkers = nThreads - 1;
+	workers = std::make_unique<Worker[]>(nWorkers + maxCallers);
+	callers = std::make_shared<Callers>();
+	nCallers.store(0, std::memory_order_relaxed);
+	stopping.store(false, std::memory_order_relaxed);
+
+	for (std::size_t i = 0; i < nWorkers; i++) {
+		threads.emplace_back([this, i, init] {
+			if (init)
+				init(i);
+			workerLoop(i);
+		});
+	}
+}
+
+void WorkStealingPool::stop()
+{
+	stopping.store(true);
+	workEpoch.fetch_add(1);
+	workEpoch.notify_all();
+	threads.clear();
+}
+
+/* The lowest free caller deque, so the ones thieves look at stay few */
+std::size_t WorkStealingPool::takeCaller()
+{
+	std::uint32_t taken = callers->taken.load(std::memory_order_relaxed);
+	while (true) {
+		const std::uint32_t free = ~taken & ((std::uint64_t(1) << maxCallers) - 1);
+		if (!free)
+			return noSlot;
+
+		const std::size_t caller = std::countr_zero(free);
+		if (!callers->taken.compare_exchange_weak(taken, taken | std::uint32_t(1) << caller, std::memory_order_acquire, std::memory_order_relaxed))
+			continue;
+
+		std::size_t seen = nCallers.load(std::memory_order_relaxed);
+		while (seen <= caller && !nCallers.compare_exchange_weak(seen, caller + 1, std::memory_order_relaxed))
+			;
+		return caller;
+	}
+}
+
+WorkStealingPool::Worker *WorkStealingPool::self()
+{
+	CallerSlot &slot = callerSlot;
+	if (slot.callers != callers) {
+		slot.release();
+		slot.callers = callers;
+		slot.index = noSlot;
+	}
+
+	/* Threads that found every deque taken try again, one may have been given back */
+	if (slot.index == noSlot) {
+		slot.caller = takeCaller();
+		if (slot.caller == noSlot)
+			return nullptr;
+		slot.index = nWorkers + slot.caller;
+		workers[slot.index].victimSeed = 0x9E3779B97F4A7C15ull * (slot.index + 1);
+	}
+
+	return &workers[slot.index];
+}
+
+/* Tries every other deque once, starting at a random one */
+bool WorkStealingPool::steal(Worker &thief, Task &task)
+{
+	const std::size_t n = nWorkers + std::min(nCallers.load(std::memory_order_relaxed), maxCallers);
+
+	std::uint64_t &seed = thief.victimSeed;
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	const std::size_t first = seed % n;
+	for (std::size_t k = 0; k < n; k++) {
+		Worker &victim = workers[(first + k) % n];
+		if (&victim != &thief && victim.deque.steal(task))
+			return true;
+	}
+	return false;
+}
+
+void WorkStealingPool::wake()
+{
+	workEpoch.fetch_add(1);
+	if (sleepers.load())
+		workEpoch.notify_one();
+}
+
+/*
+ * Splits the range down to the grain, leaving the upper halves for
+ * thieves, then runs what is left. The job may be gone as soon as its
+ * count drops to zero, so nothing touches it after that.
+ */
+void WorkStealingPool::execute(Worker &owner, Task task)
+{
+	Job &job = *task.job;
+	while (task.end - task.start > job.grain) {
+		const std::size_t mid = task.start + (task.end - task.start) / 2;
+		if (!owner.deque.push(Task { &job, mid, task.end }))
+			break;
+		wake();
+		task.end = mid;
+	}
+
+	try {
+		job.run(job.fn, task.start, task.end);
+	} catch (...) {
+		if (!job.failed.exchange(true))
+			job.error = std::current_exception();
+	}
+
+	const std::size_t done = task.end - task.start;
+	if (job.remaining.fetch_sub(done) == done) {
+		doneEpoch.fetch_add(1);
+		doneEpoch.notify_all();
+	}
+}
+
+void WorkStealingPool::workerLoop(std::size_t index)
+{
+	callerSlot.callers = callers;
+	callerSlot.index = index;
+	Worker &me = workers[index];
+	me.victimSeed = 0x9E3779B97F4A7C15ull * (index + 1);
+
+	unsigned idle = 0;
+	while (!stopping.load(std::memory_order_relaxed)) {
+		Task task;
+		if (me.deque.take(task) || steal(me, task)) {
+			execute(me, task);
+			idle = 0;
+			continue;
+		}
+
+		if (++idle < spinRounds) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		/* Announce ourselves before the last look, so wake() can't miss us */
+		sleepers.fetch_add(1);
+		const std::uint32_t epoch = workEpoch.load();
+		if (steal(me, task)) {
+			sleepers.fetch_sub(1);
+			execute(me, task);
+			idle = 0;
+			continue;
+		}
+		if (!stopping.load())
+			workEpoch.wait(epoch);
+		sleepers.fetch_sub(1);
+		idle = 0;
+	}
+}
+
+void WorkStealingPool::run(Job &job, std::size_t first, std::size_t last)
+{
+	Worker *owner = self();
+	if (!owner) {
+		job.run(job.fn, first, last);
+		return;
+	}
+
+	execute(*owner, Task { &job, first, last });
+
+	/* Help out with whatever is around until our loop is done */
+	unsigned idle = 0;
+	while (job.remaining.load() != 0) {
+		Task task;
+		if (owner->deque.take(task) || steal(*owner, task)) {
+			execute(*owner, task);
+			idle = 0;
+			continue;
+		}
+
+		if (++idle < spinRounds) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		const std::uint32_t epoch = doneEpoch.load();
+		if (job.remaining.load() != 0)
+			doneEpoch.wait(epoch);
+	}
+
+	if (job.failed.load())
+		std::rethrow_exception(job.error);
+}
@@ -0,0 +1,135 @@
+#include <worker_team.hpp>
+
+#include <algorithm>
+
+/*
+ * How many times a waiting member polls before it parks. Long enough
+ * to cover the gap between two steps of a small simulation, short
+ * enough not to burn a core for long once the steps stop coming.
+ */
+static constexpr unsigned spinLimit = 1 << 12;
+
+static void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+WorkerTeam::WorkerTeam(std::size_t nThreads)
+{
+	spawn(nThreads, {});
+}
+
+WorkerTeam::~WorkerTeam()
+{
+	stop();
+}
+
+void WorkerTeam::reset(std::size_t nThreads, const std::function<void(std::size_t)> &init)
+{
+	stop();
+	spawn(nThreads, init);
+}
+
+void WorkerTeam::spawn(std::size_t nThreads, const std::function<void(std::size_t)> &init)
+{
+	this->nThreads = nThreads ? nThreads : std::max(1u, std::thread::hardware_concurrency());
+	stopping = false;
+	shares = std::make_unique<Share[]>(this->nThreads);
+	setGroups({});
+
+	/* Members start from the current run count, so they don't take the last run for a new one */
+	const std::uint32_t seen = dispatch.load();
+	for (std::size_t member = 1; member < this->nThreads; member++) {
+		threads.emplace_back([this, member, seen, init] {
+			if (init)
+				init(member);
+			memberLoop(member, seen);
+		});
+	}
+}
+
+void WorkerTeam::setGroups(const std::vector<std::size_t> &groups)
+{
+	auto groupOf = [&](std::size_t member) {
+		return member < groups.size() ? groups[member] : 0;
+	};
+
+	/* Going round from the member itself, so the helpers spread over the shares */
+	helpOrder.clear();
+	for (std::size_t member = 0; member < nThreads; member++) {
+		for (const bool sameGroup : { true, false }) {
+			for (std::size_t k = 0; k < nThreads; k++) {
+				const std::size_t other = (member + k) % nThreads;
+				if ((groupOf(other) == groupOf(member)) == sameGroup)
+					helpOrder.push_back(other);
+			}
+		}
+	}
+}
+
+void WorkerTeam::stop()
+{
+	stopping = true;
+	release(dispatch);
+	threads.clear();
+}
+
+void WorkerTeam::waitWhile(const std::atomic<std::uint32_t> &value, std::uint32_t old)
+{
+	for (unsigned spin = 0; spin < spinLimit; spin++) {
+		if (value.load(std::memory_order_acquire) != old)
+			return;
+		cpuRelax();
+	}
+
+	/* Counted before the last look, so release() can't miss us */
+	parked.fetch_add(1);
+	while (value.load() == old)
+		value.wait(old);
+	parked.fetch_sub(1);
+}
+
+void WorkerTeam::release(std::atomic<std::uint32_t> &value)
+{
+	value.fetch_add(1);
+	if (parked.load())
+		value.notify_all();
+}
+
+void WorkerTeam::start()
+{
+	release(dispatch);
+}
+
+void WorkerTeam::barrier()
+{
+	if (nThreads == 1)
+		return;
+
+	/* Nobody can bump the phase before we arrive, so this is the one to wait out */
+	const std::uint32_t current = phase.load(std::memory_order_acquire);
+	if (arrived.fetch_add(1, std::memory_order_acq_rel) == nThreads - 1) {
+		arrived.store(0, std::memory_order_relaxed);
+		release(phase);
+	} else {
+		waitWhile(phase, current);
+	}
+}
+
+/* A member finishes every run before the next one can start, so runs never get skipped */
+void WorkerTeam::memberLoop(std::size_t member, std::uint32_t seen)
+{
+	for (;;) {
+		waitWhile(dispatch, seen);
+		seen++;
+		if (stopping)
+			return;
+
+		job(jobFn, member);
+		barrier();
+	}
+}